@@ -0,0 +1,191 @@
+#include "reader.h"
+
+/* -- Arenas -----------------------------
+ *
+ * A DmArena hands out memory by bumping a pointer through a chunk, and
+ * only ever gives it back all at once. Everything a workbook's DmReturn
+ * owns - its path, the values array, the sheet names and the values
+ * themselves - comes from its arena, so finishing with a workbook is one
+ * dm_arena_free() rather than a free() per cell.
+ *
+ * Chunks double in size up to DM_ARENA_MAX_CHUNK, so a workbook costs a
+ * handful of mallocs however many values it has. Strings that turn up
+ * over and over ("N/A", "Green", sheet names) can be interned: the arena
+ * keeps one copy and hands back the same pointer every time.
+ *
+ * An arena that is all zeroes is ready to use.
+ */
+
+struct DmArenaChunk {
+    struct DmArenaChunk *prev; // the chunk filled before this one
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+#define DM_ARENA_ALIGN sizeof(void *)
+
+extern void dm_arena_init(DmArena *a, size_t chunk_size)
+{
+    memset(a, 0, sizeof(DmArena));
+    a->chunk_size = chunk_size;
+}
+
+static int arena_new_chunk(DmArena *a, size_t need)
+{
+    size_t size = a->chunk_size ? a->chunk_size : DM_ARENA_MIN_CHUNK;
+
+    if (a->chunk && size < DM_ARENA_MAX_CHUNK)
+        size *= 2;
+    if (size < need)
+        size = need;
+
+    DmArenaChunk *chunk = malloc(sizeof(DmArenaChunk) + size);
+    if (chunk == NULL)
+        return 1;
+    chunk->prev = a->chunk;
+    chunk->size = size;
+    chunk->used = 0;
+    a->chunk = chunk;
+    a->chunk_size = size;
+    return 0;
+}
+
+// size bytes, aligned for any pointer or integer. NULL if out of memory.
+extern void *dm_arena_alloc(DmArena *a, size_t size)
+{
+    size = (size + DM_ARENA_ALIGN - 1) & ~(DM_ARENA_ALIGN - 1);
+    if (a->chunk == NULL || a->chunk->size - a->chunk->used < size) {
+        if (arena_new_chunk(a, size))
+            return NULL;
+    }
+    void *p = a->chunk->data + a->chunk->used;
+    a->chunk->used += size;
+    return p;
+}
+
+extern void *dm_arena_calloc(DmArena *a, size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size)
+        return NULL;
+    void *p = dm_arena_alloc(a, n * size);
+    if (p)
+        memset(p, 0, n * size);
+    return p;
+}
+
+extern char *dm_arena_strndup(DmArena *a, const char *s, size_t len)
+{
+    char *copy = dm_arena_alloc(a, len + 1);
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+extern char *dm_arena_strdup(DmArena *a, const char *s)
+{
+    return dm_arena_strndup(a, s, strlen(s));
+}
+
+static size_t intern_slot(char **table, size_t bits, const char *s, size_t len)
+{
+    size_t mask = ((size_t)1 << bits) - 1;
+    size_t i = (size_t)dm_hash_bytes(s, len) & mask;
+
+    while (table[i] && strcmp(table[i], s) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static int intern_grow(DmArena *a)
+{
+    size_t bits = a->intern_bits ? a->intern_bits + 1 : 6;
+    char **table = calloc((size_t)1 << bits, sizeof(char *));
+
+    if (table == NULL)
+        return 1;
+    if (a->interned) {
+        for (size_t i = 0; i < ((size_t)1 << a->intern_bits); i++) {
+            char *s = a->interned[i];
+            if (s)
+                table[intern_slot(table, bits, s, strlen(s))] = s;
+        }
+        free(a->interned);
+    }
+    a->interned = table;
+    a->intern_bits = bits;
+    return 0;
+}
+
+// The arena's one copy of s, made on first sight. NULL if out of memory.
+extern const char *dm_arena_intern(DmArena *a, const char *s)
+{
+    size_t len = strlen(s);
+
+    // keep the table at most half full
+    if ((a->intern_count + 1) * 2 > ((size_t)1 << a->intern_bits) && intern_grow(a))
+        return NULL;
+
+    size_t i = intern_slot(a->interned, a->intern_bits, s, len);
+    if (a->interned[i] == NULL) {
+        if ((a->interned[i] = dm_arena_strndup(a, s, len)) == NULL)
+            return NULL;
+        a->intern_count++;
+    }
+    return a->interned[i];
+}
+
+// Forget everything allocated so far but keep the newest (largest) chunk
+// for reuse, so an arena recycled per workbook settles at a fixed size.
+extern void dm_arena_reset(DmArena *a)
+{
+    if (a->chunk) {
+        DmArenaChunk *chunk = a->chunk->prev;
+        while (chunk) {
+            DmArenaChunk *prev = chunk->prev;
+            free(chunk);
+            chunk = prev;
+        }
+        a->chunk->prev = NULL;
+        a->chunk->used = 0;
+    }
+    if (a->interned)
+        memset(a->interned, 0, ((size_t)1 << a->intern_bits) * sizeof(char *));
+    a->intern_count = 0;
+}
+
+// Take over everything allocated from src, which is left empty. Strings
+// src interned stay valid but are not interned in a.
+extern void dm_arena_adopt(DmArena *a, DmArena *src)
+{
+    DmArenaChunk *oldest = src->chunk;
+
+    if (oldest) {
+        while (oldest->prev)
+            oldest = oldest->prev;
+        if (a->chunk == NULL) {
+            a->chunk = src->chunk;
+            a->chunk_size = src->chunk_size;
+        } else {
+            // keep filling a's current chunk; src's go behind it
+            oldest->prev = a->chunk->prev;
+            a->chunk->prev = src->chunk;
+        }
+        src->chunk = NULL;
+    }
+    dm_arena_free(src);
+}
+
+extern void dm_arena_free(DmArena *a)
+{
+    DmArenaChunk *chunk = a->chunk;
+    while (chunk) {
+        DmArenaChunk *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    free(a->interned);
+    memset(a, 0, sizeof(DmArena));
+}
@@ -0,0 +1,1405 @@
+#include <pthread.h>
+#include <time.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "reader.h"
+
+/* -- Batch import -----------------------------
+ *
+ * A pool of worker threads each take the next workbook from the list,
+ * extract it against the shared (read-only) datamap with their own
+ * xlsxioreader, and push the DmReturn onto a bounded queue. The calling
+ * thread is the only one that touches sqlite3: it drains the queue and
+ * writes the returns through a DmWriter, committing every
+ * DM_BATCH_COMMIT_EVERY of them.
+ *
+ * A workbook that cannot be read is reported by the writer and the batch
+ * carries on.
+ *
+ * Workbooks don't have to be files: a DmWorkbook can hold one already in
+ * memory (read from stdin, or a member of a bundle), which the worker
+ * hashes and extracts from where it is.
+ *
+ * A batch can apply several datamaps at once (a DmDatamapSet). Workbooks
+ * are extracted once against the merged datamap and the writer stores a
+ * return per datamap.
+ *
+ * Before extracting, a worker hashes the workbook file. If it was already
+ * imported against this datamap with the same hash it is skipped without
+ * being parsed; if the hash differs, the writer replaces the old return.
+ *
+ * With opts->bulk the writer fills a staging database instead, and the
+ * batch is published into test.db at the end (see "Bulk loading" below).
+ */
+
+// A workbook already in the database for the datamap being imported
+struct seen_return {
+    char *file;
+    uint64_t hash;
+};
+
+// Loaded before the workers start and read-only afterwards
+struct seen_returns {
+    struct seen_return *items;
+    size_t count;
+};
+
+struct return_queue {
+    DmReturn **items;
+    size_t size;
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct batch {
+    const DmDatamapSet *set;
+    const struct seen_returns *seen; // one per datamap in set
+    int force;
+    int sheet_threads;
+    const DmWorkbook *workbooks;
+    size_t nworkbooks;
+    size_t next; // guarded by queue.lock
+    struct return_queue queue;
+};
+
+static int queue_init(struct return_queue *q, size_t size)
+{
+    q->items = calloc(size, sizeof(DmReturn *));
+    q->size = size;
+    q->head = 0;
+    q->count = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return q->items == NULL;
+}
+
+static void queue_destroy(struct return_queue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+}
+
+// Blocks while the queue is full, so workers can't run ahead of the writer
+static void queue_push(struct return_queue *q, DmReturn *ret)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->size)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % q->size] = ret;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static DmReturn *queue_pop(struct return_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    DmReturn *ret = q->items[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+static int compare_seen(const void *a, const void *b)
+{
+    return strcmp(((const struct seen_return *)a)->file, ((const struct seen_return *)b)->file);
+}
+
+// Everything already imported against datamap dm_id, sorted by file
+static int load_seen_returns(sqlite3 *db, int64_t dm_id, struct seen_returns *seen)
+{
+    sqlite3_stmt *stmt;
+    size_t size = 0;
+    int rc;
+
+    seen->items = NULL;
+    seen->count = 0;
+
+    rc = sqlite3_prepare_v2(db, "SELECT file, hash FROM return WHERE dm_id = ? AND hash IS NOT NULL",
+                            -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_int64(stmt, 1, dm_id);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (seen->count == size) {
+            size = size ? size * 2 : 256;
+            struct seen_return *items = realloc(seen->items, size * sizeof(struct seen_return));
+            if (items == NULL)
+                break;
+            seen->items = items;
+        }
+        seen->items[seen->count].file = strdup((const char *)sqlite3_column_text(stmt, 0));
+        seen->items[seen->count].hash = (uint64_t)sqlite3_column_int64(stmt, 1);
+        if (seen->items[seen->count].file == NULL)
+            break;
+        seen->count++;
+    }
+    sqlite3_finalize(stmt);
+    if (seen->count > 1)
+        qsort(seen->items, seen->count, sizeof(struct seen_return), compare_seen);
+    return rc != SQLITE_DONE;
+}
+
+static void free_seen_returns(struct seen_returns *seen)
+{
+    for (size_t i = 0; i < seen->count; i++)
+        free(seen->items[i].file);
+    free(seen->items);
+}
+
+// Was file imported before with exactly this hash?
+static int seen_unchanged(const struct seen_returns *seen, const char *file, uint64_t hash)
+{
+    struct seen_return key = {(char *)file, 0};
+    const struct seen_return *found;
+
+    if (seen->count == 0) // items is NULL, which bsearch() mustn't be given
+        return 0;
+    found = bsearch(&key, seen->items, seen->count, sizeof(struct seen_return), compare_seen);
+    return found != NULL && found->hash == hash;
+}
+
+// Unchanged as far as every datamap in the batch is concerned?
+static int batch_unchanged(const struct batch *b, const char *file, uint64_t hash)
+{
+    for (size_t d = 0; d < b->set->ndms; d++) {
+        if (!seen_unchanged(&b->seen[d], file, hash))
+            return 0;
+    }
+    return 1;
+}
+
+// Handed to the writer in place of a workbook we couldn't allocate for
+static DmReturn out_of_memory = {NULL, NULL, 0, "out of memory"};
+
+/* The bytes of an in-memory workbook, inflated if it is compressed in its
+ * bundle. *owned is set to anything that has to be freed afterwards.
+ * NULL if it won't inflate. */
+static const void *workbook_bytes(const DmWorkbook *wb, void **owned, size_t *size)
+{
+    *owned = NULL;
+    *size = wb->size;
+    if (wb->inflated == 0)
+        return wb->data;
+    if ((*owned = malloc(wb->inflated)) == NULL
+            || dm_inflate_raw(wb->data, wb->size, *owned, wb->inflated)) {
+        free(*owned);
+        *owned = NULL;
+        return NULL;
+    }
+    *size = wb->inflated;
+    return *owned;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch *b = (struct batch *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&b->queue.lock);
+        size_t i = b->next++;
+        pthread_mutex_unlock(&b->queue.lock);
+        if (i >= b->nworkbooks)
+            break;
+        const DmWorkbook *wb = &b->workbooks[i];
+
+        DmReturn *ret = malloc(sizeof(DmReturn));
+        if (ret == NULL) {
+            // we still owe the writer an entry for this path
+            queue_push(&b->queue, &out_of_memory);
+            continue;
+        }
+        uint64_t hash = 0;
+        size_t size = 0;
+        const void *data = NULL;
+        void *owned = NULL;
+        int unreadable;
+        double t = dm_now();
+        if (wb->data) {
+            // already in memory: a bundle member or stdin
+            unreadable = (data = workbook_bytes(wb, &owned, &size)) == NULL;
+            if (!unreadable)
+                hash = dm_hash_bytes(data, size);
+        } else {
+            unreadable = dm_hash_file(wb->name, &hash, &size);
+        }
+        double hash_time = dm_now() - t;
+        if (unreadable) {
+            memset(ret, 0, sizeof(DmReturn));
+            ret->filepath = dm_arena_strdup(&ret->arena, wb->name);
+            ret->error = wb->data ? "cannot inflate it from the bundle" : "cannot read file";
+        } else if (!b->force && batch_unchanged(b, wb->name, hash)) {
+            memset(ret, 0, sizeof(DmReturn));
+            ret->filepath = dm_arena_strdup(&ret->arena, wb->name);
+            ret->hash = hash;
+            ret->unchanged = 1;
+        } else {
+            dm_extract_workbook_buffer(b->set->extract, wb->name, data, size, ret, b->sheet_threads);
+            ret->hash = hash;
+        }
+        free(owned);
+        ret->stats.hash_time = hash_time;
+        ret->stats.bytes_read = size;
+        ret->stats.workbooks = 1;
+        queue_push(&b->queue, ret);
+    }
+    return NULL;
+}
+
+/* -- The writer -----------------------------
+ *
+ * Everything that goes into the return tables goes through here, using the
+ * same prepared statements for every return. Values are stored typed (see
+ * dm_classify_value()). Transactions are left to the caller so that many
+ * returns share one commit.
+ */
+
+/* Bring an older database's return_data up to date:
+ *
+ * - it used to keep every value as TEXT. A column's type can't be changed
+ *   in place, so a table from before typed values is rebuilt with its
+ *   values carried over as text.
+ * - range_row and range_col came with range lines.
+ * - text used to be stored in every row that had it. It is moved into the
+ *   value table and referred to by value_id.
+ *
+ * The indexes and view are recreated afterwards. Returns 0 if nothing
+ * needed doing or the upgrade worked. */
+extern int dm_upgrade_return_data(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int has_value = 0, has_vtype = 0, has_range = 0, has_value_id = 0;
+
+    int rc = sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info('return_data')", -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+        has_value |= strcmp(name, "value") == 0;
+        has_vtype |= strcmp(name, "vtype") == 0;
+        has_range |= strcmp(name, "range_row") == 0;
+        has_value_id |= strcmp(name, "value_id") == 0;
+    }
+    sqlite3_finalize(stmt);
+    // no table yet, or the current one
+    if (!has_value || has_value_id)
+        return 0;
+
+    fprintf(stderr, "Upgrading return_data.\n");
+    rc = dm_exec_sql_stmt("BEGIN TRANSACTION;"
+                          "DROP VIEW IF EXISTS return_value;"
+                          "DROP INDEX IF EXISTS return_data_line;"
+                          "DROP INDEX IF EXISTS return_data_by_line;", db) != SQLITE_OK;
+    if (!rc && !has_vtype) {
+        rc = dm_exec_sql_stmt("ALTER TABLE return_data RENAME TO return_data_text;", db) != SQLITE_OK
+             || dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK
+             || dm_exec_sql_stmt("INSERT INTO return_data(id, return_id, datamap_line_id, value, vtype)"
+                                 "   SELECT id, return_id, datamap_line_id, value, 0 FROM return_data_text;"
+                                 "DROP TABLE return_data_text;", db) != SQLITE_OK;
+    } else if (!rc) {
+        if (!has_range)
+            rc = dm_exec_sql_stmt("ALTER TABLE return_data ADD COLUMN range_row INTEGER NOT NULL DEFAULT 0;"
+                                  "ALTER TABLE return_data ADD COLUMN range_col INTEGER NOT NULL DEFAULT 0;", db) != SQLITE_OK;
+        rc = rc || dm_exec_sql_stmt("ALTER TABLE return_data ADD COLUMN value_id INTEGER REFERENCES value(id);", db) != SQLITE_OK
+             || dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK;
+    }
+    // every text value into the dictionary, then swapped for its id
+    rc = rc || dm_exec_sql_stmt("INSERT OR IGNORE INTO value(text)"
+                                "   SELECT value FROM return_data WHERE vtype = 0 AND value IS NOT NULL;"
+                                "UPDATE return_data SET value_id = (SELECT id FROM value WHERE text = return_data.value),"
+                                "                       value = NULL"
+                                " WHERE vtype = 0 AND value IS NOT NULL;"
+                                "COMMIT;", db) != SQLITE_OK;
+    if (rc)
+        dm_exec_sql_stmt("ROLLBACK;", db);
+    return rc;
+}
+
+// Prepare the writer's statements against the return tables in schema
+static int writer_prepare(DmWriter *w, sqlite3 *db, const char *schema)
+{
+    char *sql[4];
+    int rc = SQLITE_OK;
+
+    memset(w, 0, sizeof(DmWriter));
+    w->db = db;
+    w->staging = strcmp(schema, "staging") == 0;
+
+    sql[0] = sqlite3_mprintf("DELETE FROM %s.return WHERE file = ? AND dm_id = ?;", schema);
+    sql[1] = sqlite3_mprintf("INSERT INTO %s.return(file, hash, imported, dm_id)"
+                             " VALUES (?, ?, datetime('now', 'localtime'), ?);", schema);
+    sql[2] = sqlite3_mprintf("INSERT INTO %s.return_data(return_id, datamap_line_id, value, vtype, raw,"
+                             "                           range_row, range_col, value_id)"
+                             " VALUES (?, ?, ?, ?, ?, ?, ?, ?);", schema);
+    sql[3] = sqlite3_mprintf("INSERT INTO %s.return_check(return_id, datamap_line_id, range_row, range_col, problem)"
+                             " VALUES (?, ?, ?, ?, ?);", schema);
+    if (sql[0] && sql[1] && sql[2] && sql[3]) {
+        rc = sqlite3_prepare_v2(db, sql[0], -1, &w->delete_return, NULL);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_prepare_v2(db, sql[1], -1, &w->insert_return, NULL);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_prepare_v2(db, sql[2], -1, &w->insert_value, NULL);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_prepare_v2(db, sql[3], -1, &w->insert_check, NULL);
+    } else {
+        rc = SQLITE_NOMEM;
+    }
+    for (int i = 0; i < 4; i++)
+        sqlite3_free(sql[i]);
+
+    // text already in the database is always found in the main one
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, "SELECT id FROM main.value WHERE text = ?;", -1, &w->find_text, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, w->staging ? "INSERT INTO staging.value(id, text) VALUES (?2, ?1);"
+                                               : "INSERT INTO main.value(text) VALUES (?1);",
+                                -1, &w->insert_text, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Error #%d: %s\n", rc, sqlite3_errmsg(db));
+        dm_writer_close(w);
+        return 1;
+    }
+    return 0;
+}
+
+extern int dm_writer_open(DmWriter *w, sqlite3 *db)
+{
+    if (dm_upgrade_return_data(db))
+        return 1;
+    if (dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK)
+        return 1;
+    return writer_prepare(w, db, "main");
+}
+
+/* As dm_writer_open(), but the returns go into a staging database (see
+ * dm_stage_open()) until dm_stage_publish() moves them into the main one. */
+extern int dm_writer_open_staging(DmWriter *w, sqlite3 *db)
+{
+    if (dm_upgrade_return_data(db))
+        return 1;
+    if (dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK)
+        return 1;
+    if (dm_stage_open(db))
+        return 1;
+    if (writer_prepare(w, db, "staging")) {
+        dm_stage_discard(db);
+        return 1;
+    }
+    return 0;
+}
+
+/* Text values are interned: the value table keeps one copy of each, and
+ * return_data refers to it by id. The writer remembers the ids it has
+ * looked up in a hash table, so a batch goes to the database once per
+ * distinct string rather than once per cell. Past DM_WRITER_MAX_TEXTS of
+ * them it starts afresh, so one batch of free text can't take all the
+ * memory.
+ *
+ * While staging, text the main database hasn't got goes into the staging
+ * database's value table with a negative id, and dm_stage_publish() swaps
+ * those for real ones. */
+
+// Forget every text id, after a rollback has taken some of them away
+static void text_ids_clear(DmWriter *w)
+{
+    if (w->text_ids)
+        memset(w->text_ids, 0, ((size_t)1 << w->text_bits) * sizeof(DmTextId));
+    w->ntexts = 0;
+    dm_arena_reset(&w->texts);
+}
+
+static size_t text_slot(const DmTextId *table, size_t bits, const char *text, size_t len)
+{
+    size_t mask = ((size_t)1 << bits) - 1;
+    size_t i = (size_t)dm_hash_bytes(text, len) & mask;
+
+    while (table[i].text && strcmp(table[i].text, text) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static int text_ids_grow(DmWriter *w)
+{
+    size_t bits = w->text_bits ? w->text_bits + 1 : 10;
+    DmTextId *table = calloc((size_t)1 << bits, sizeof(DmTextId));
+
+    if (table == NULL)
+        return 1;
+    for (size_t i = 0; w->text_ids && i < ((size_t)1 << w->text_bits); i++) {
+        const char *text = w->text_ids[i].text;
+        if (text)
+            table[text_slot(table, bits, text, strlen(text))] = w->text_ids[i];
+    }
+    free(w->text_ids);
+    w->text_ids = table;
+    w->text_bits = bits;
+    return 0;
+}
+
+// text's id in the value table, adding it if it's new. 0 on failure.
+static int64_t writer_text_id(DmWriter *w, const char *text)
+{
+    size_t len = strlen(text), i = 0;
+    int64_t id = 0;
+
+    if (w->text_ids) {
+        i = text_slot(w->text_ids, w->text_bits, text, len);
+        if (w->text_ids[i].text)
+            return w->text_ids[i].id;
+    }
+
+    sqlite3_stmt *stmt = w->find_text;
+    sqlite3_bind_text(stmt, 1, text, (int)len, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        id = sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+    if (id == 0) {
+        stmt = w->insert_text;
+        sqlite3_bind_text(stmt, 1, text, (int)len, SQLITE_STATIC);
+        if (w->staging)
+            sqlite3_bind_int64(stmt, 2, w->last_staged - 1);
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE)
+            return 0;
+        id = w->staging ? --w->last_staged : sqlite3_last_insert_rowid(w->db);
+    }
+
+    if (w->ntexts == DM_WRITER_MAX_TEXTS)
+        text_ids_clear(w);
+    // keep the table at most half full
+    if ((w->ntexts + 1) * 2 > ((size_t)1 << w->text_bits)) {
+        if (text_ids_grow(w))
+            return id; // just not remembered
+    }
+    char *copy = dm_arena_strndup(&w->texts, text, len);
+    if (copy) {
+        i = text_slot(w->text_ids, w->text_bits, text, len);
+        w->text_ids[i].text = copy;
+        w->text_ids[i].id = id;
+        w->ntexts++;
+    }
+    return id;
+}
+
+// Undo whatever part of a return we managed to write
+static int writer_fail(DmWriter *w, int rc)
+{
+    fprintf(stderr, "Error #%d: %s\n", rc, sqlite3_errmsg(w->db));
+    dm_exec_sql_stmt("ROLLBACK TO one_return; RELEASE one_return;", w->db);
+    text_ids_clear(w);
+    return 1;
+}
+
+// Write one extracted return. Runs on the writer thread only. A return is
+// written completely or not at all, inside whatever transaction is open,
+// and replaces any earlier import of the same file against this datamap.
+extern int dm_writer_store(DmWriter *w, const DmDatamap *dm, const DmReturn *ret)
+{
+    sqlite3_stmt *stmt = w->delete_return;
+
+    if (dm_exec_sql_stmt("SAVEPOINT one_return;", w->db) != SQLITE_OK)
+        return 1;
+
+    // return_data goes with it (ON DELETE CASCADE)
+    sqlite3_bind_text(stmt, 1, ret->filepath, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, dm->id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE)
+        return writer_fail(w, rc);
+
+    stmt = w->insert_return;
+    sqlite3_bind_text(stmt, 1, ret->filepath, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)ret->hash);
+    sqlite3_bind_int64(stmt, 3, dm->id);
+    rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE)
+        return writer_fail(w, rc);
+    sqlite3_int64 return_id = sqlite3_last_insert_rowid(w->db);
+
+    stmt = w->insert_value;
+    sqlite3_bind_int64(stmt, 1, return_id);
+    for (size_t i = 0; i < dm->nlines; i++) {
+        const DmLine *line = &dm->lines[i];
+        uint32_t ncells = DM_LINE_CELLS(line);
+
+        sqlite3_bind_int64(stmt, 2, line->id);
+        for (uint32_t k = 0; k < ncells; k++) {
+            const char *value = ret->values[line->value + k];
+            if (value == NULL)
+                continue;
+            DmValue v;
+            sqlite3_int64 text_id = 0;
+            switch (dm_classify_value(value, &v)) {
+                case DM_VALUE_INTEGER: case DM_VALUE_BOOLEAN:
+                    sqlite3_bind_int64(stmt, 3, v.i);
+                    break;
+                case DM_VALUE_REAL:
+                    sqlite3_bind_double(stmt, 3, v.r);
+                    break;
+                default:
+                    if ((text_id = writer_text_id(w, value)) == 0) {
+                        sqlite3_reset(stmt);
+                        return writer_fail(w, sqlite3_errcode(w->db));
+                    }
+                    sqlite3_bind_null(stmt, 3);
+            }
+            if (text_id)
+                sqlite3_bind_int64(stmt, 8, text_id);
+            else
+                sqlite3_bind_null(stmt, 8);
+            sqlite3_bind_int(stmt, 4, v.type);
+            if (v.exact)
+                sqlite3_bind_null(stmt, 5);
+            else
+                sqlite3_bind_text(stmt, 5, value, -1, SQLITE_STATIC);
+            // a range's values are row by row, so k gives the cell
+            sqlite3_bind_int(stmt, 6, DM_LINE_IS_RANGE(line) ? k / DM_LINE_WIDTH(line) + 1 : 0);
+            sqlite3_bind_int(stmt, 7, DM_LINE_IS_RANGE(line) ? k % DM_LINE_WIDTH(line) + 1 : 0);
+            rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (rc != SQLITE_DONE)
+                return writer_fail(w, rc);
+        }
+    }
+    sqlite3_clear_bindings(stmt);
+
+    // and what was wrong with any of them
+    stmt = w->insert_check;
+    sqlite3_bind_int64(stmt, 1, return_id);
+    for (size_t i = 0; i < ret->nfailures; i++) {
+        const DmCheckFailure *f = &ret->failures[i];
+        const DmLine *line = &dm->lines[f->line];
+        uint32_t k = f->slot - line->value;
+        char problem[256];
+
+        dm_rule_describe(&dm->rules[f->rule], f->why, problem, sizeof(problem));
+        sqlite3_bind_int64(stmt, 2, line->id);
+        sqlite3_bind_int(stmt, 3, DM_LINE_IS_RANGE(line) ? k / DM_LINE_WIDTH(line) + 1 : 0);
+        sqlite3_bind_int(stmt, 4, DM_LINE_IS_RANGE(line) ? k % DM_LINE_WIDTH(line) + 1 : 0);
+        sqlite3_bind_text(stmt, 5, problem, -1, SQLITE_TRANSIENT);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE)
+            return writer_fail(w, rc);
+    }
+    sqlite3_clear_bindings(stmt);
+    return dm_exec_sql_stmt("RELEASE one_return;", w->db) != SQLITE_OK;
+}
+
+/* Write ret, extracted against set->extract, as a return for each datamap
+ * in set: all of them or, if one fails, none. *rows gets the number of
+ * rows inserted. */
+extern int dm_writer_store_set(DmWriter *w, const DmDatamapSet *set, const DmReturn *ret, size_t *rows)
+{
+    *rows = 0;
+    if (set->merged_line == NULL) {
+        if (dm_writer_store(w, &set->dms[0], ret))
+            return 1;
+        *rows = 1 + ret->nmatched;
+        return 0;
+    }
+
+    if (dm_exec_sql_stmt("SAVEPOINT one_workbook;", w->db) != SQLITE_OK)
+        return 1;
+    for (size_t d = 0; d < set->ndms; d++) {
+        size_t nvalues = set->dms[d].nvalues;
+        if (nvalues > w->values_size) {
+            const char **values = realloc(w->values, nvalues * sizeof(char *));
+            if (values == NULL)
+                goto fail;
+            w->values = values;
+            w->values_size = nvalues;
+        }
+        if (ret->nfailures > w->failures_size) {
+            DmCheckFailure *failures = realloc(w->failures, ret->nfailures * sizeof(DmCheckFailure));
+            if (failures == NULL)
+                goto fail;
+            w->failures = failures;
+            w->failures_size = ret->nfailures;
+        }
+        // the same workbook, seen through datamap d
+        DmReturn view = *ret;
+        view.values = w->values;
+        view.nmatched = dm_datamap_set_values(set, d, ret->values, w->values);
+        view.failures = w->failures;
+        view.nfailures = dm_datamap_set_failures(set, d, ret->failures, ret->nfailures, w->failures);
+        if (dm_writer_store(w, &set->dms[d], &view))
+            goto fail;
+        *rows += 1 + view.nmatched;
+    }
+    return dm_exec_sql_stmt("RELEASE one_workbook;", w->db) != SQLITE_OK;
+
+fail:
+    dm_exec_sql_stmt("ROLLBACK TO one_workbook; RELEASE one_workbook;", w->db);
+    text_ids_clear(w);
+    *rows = 0;
+    return 1;
+}
+
+extern void dm_writer_close(DmWriter *w)
+{
+    free(w->values);
+    free(w->failures);
+    free(w->text_ids);
+    dm_arena_free(&w->texts);
+    sqlite3_finalize(w->delete_return);
+    sqlite3_finalize(w->insert_return);
+    sqlite3_finalize(w->insert_value);
+    sqlite3_finalize(w->insert_check);
+    sqlite3_finalize(w->find_text);
+    sqlite3_finalize(w->insert_text);
+    memset(w, 0, sizeof(DmWriter));
+}
+
+
+/* -- Bulk loading -----------------------------
+ *
+ * With --bulk a batch is written into a staging database attached beside
+ * test.db rather than into test.db itself. The staging file keeps its
+ * journal in memory and has no fsync and no indexes: if the batch dies it
+ * is just thrown away. When
+ * the batch is done, dm_stage_publish() copies it into the main database in
+ * one transaction, replacing earlier imports of the same workbooks, so
+ * anyone reading test.db sees all of the batch or none of it.
+ *
+ * The main database is switched to WAL, which lets readers carry on with
+ * the old data while the batch is published and keeps the publish to one
+ * fsync. If the batch is bigger than what is already there, return_data's
+ * indexes are dropped for the copy and built again afterwards, which is
+ * quicker than updating them row by row.
+ *
+ * Text the main database hasn't seen before is staged in staging.value
+ * (see writer_text_id()) and added to the main value table on publish.
+ */
+
+static const char *stage_schema = "CREATE TABLE staging.return("
+                                  "id INTEGER PRIMARY KEY,"
+                                  "file TEXT NOT NULL,"
+                                  "hash INTEGER,"
+                                  "imported TEXT NOT NULL,"
+                                  "dm_id INTEGER NOT NULL"
+                                  ");"
+                                  // in the order the writer stores them, which is the
+                                  // order of the main table's unique index
+                                  "CREATE TABLE staging.return_data("
+                                  "return_id INTEGER NOT NULL"
+                                  "   REFERENCES return(id) ON DELETE CASCADE,"
+                                  "datamap_line_id INTEGER NOT NULL,"
+                                  "value,"
+                                  "vtype INTEGER NOT NULL,"
+                                  "raw TEXT,"
+                                  "range_row INTEGER NOT NULL,"
+                                  "range_col INTEGER NOT NULL,"
+                                  "value_id INTEGER" // below 0 for staging.value's
+                                  ");"
+                                  "CREATE TABLE staging.return_check("
+                                  "return_id INTEGER NOT NULL"
+                                  "   REFERENCES return(id) ON DELETE CASCADE,"
+                                  "datamap_line_id INTEGER NOT NULL,"
+                                  "range_row INTEGER NOT NULL,"
+                                  "range_col INTEGER NOT NULL,"
+                                  "problem TEXT NOT NULL"
+                                  ");"
+                                  // text the main value table hasn't got
+                                  "CREATE TABLE staging.value("
+                                  "id INTEGER PRIMARY KEY,"
+                                  "text TEXT NOT NULL"
+                                  ");";
+
+// A staging file left by a batch that never finished is thrown away
+static void stage_unlink(void)
+{
+    const char *suffixes[] = {"", "-journal", "-wal", "-shm"};
+    char path[64];
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", DM_STAGING_DB, suffixes[i]);
+        unlink(path);
+    }
+}
+
+/* Set db up for a bulk load and attach an empty staging database to it as
+ * "staging". Returns 0 on success. */
+extern int dm_stage_open(sqlite3 *db)
+{
+    char *sql;
+    int rc;
+
+    sql = sqlite3_mprintf("PRAGMA main.journal_mode = WAL;"
+                          "PRAGMA main.synchronous = NORMAL;"
+                          "PRAGMA main.cache_size = %d;", -DM_BULK_CACHE_KB);
+    rc = sql ? dm_exec_sql_stmt(sql, db) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Cannot set test.db up for a bulk load: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    stage_unlink();
+    sql = sqlite3_mprintf("ATTACH DATABASE %Q AS staging;", DM_STAGING_DB);
+    rc = sql ? dm_exec_sql_stmt(sql, db) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Cannot create %s: %s\n", DM_STAGING_DB, sqlite3_errmsg(db));
+        return 1;
+    }
+    /* nothing to recover if we crash, so no fsync and the journal only in
+     * memory: it's still needed to roll a failed return back to its savepoint */
+    sql = sqlite3_mprintf("PRAGMA staging.journal_mode = MEMORY;"
+                          "PRAGMA staging.synchronous = OFF;"
+                          "PRAGMA staging.cache_size = %d;", -DM_BULK_CACHE_KB);
+    rc = sql ? dm_exec_sql_stmt(sql, db) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc == SQLITE_OK)
+        rc = dm_exec_sql_stmt(stage_schema, db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Cannot create %s: %s\n", DM_STAGING_DB, sqlite3_errmsg(db));
+        dm_stage_discard(db);
+        return 1;
+    }
+    return 0;
+}
+
+// The first integer in the first row of sql, or -1
+static sqlite3_int64 stage_count(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt;
+    sqlite3_int64 n = -1;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        n = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return n;
+}
+
+/* Move everything in the staging database into the main one, in a single
+ * transaction. A staged return replaces an earlier import of the same
+ * workbook against the same datamap. Returns 0 on success; on failure the
+ * main database is left as it was. */
+extern int dm_stage_publish(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (dm_exec_sql_stmt("BEGIN IMMEDIATE;", db) != SQLITE_OK)
+        return 1;
+
+    // staged ids are moved past everything in the main table
+    sqlite3_int64 offset = stage_count(db, "SELECT IFNULL(MAX(id), 0) FROM main.return;");
+    sqlite3_int64 staged = stage_count(db, "SELECT COUNT(*) FROM staging.return_data;");
+    // rowids, so near enough a count without reading the table
+    sqlite3_int64 existing = stage_count(db, "SELECT IFNULL(MAX(id), 0) FROM main.return_data;");
+    if (offset < 0 || staged < 0 || existing < 0)
+        goto fail;
+
+    int rebuild = staged > existing;
+    // return_data goes with it (ON DELETE CASCADE)
+    rc = dm_exec_sql_stmt("DELETE FROM main.return WHERE EXISTS"
+                          "   (SELECT 1 FROM staging.return s"
+                          "     WHERE s.file = return.file AND s.dm_id = return.dm_id);", db);
+    if (rc == SQLITE_OK && rebuild)
+        rc = dm_exec_sql_stmt("DROP INDEX main.return_data_line;"
+                              "DROP INDEX main.return_data_by_line;", db);
+    if (rc != SQLITE_OK)
+        goto fail;
+
+    const char *copy[] = {
+        "INSERT INTO main.return(id, file, hash, imported, dm_id)"
+        "   SELECT id + ?1, file, hash, imported, dm_id FROM staging.return;",
+        // OR IGNORE: someone else may have added the same text meanwhile;
+        // staged ids count down, so -1 is the first text the batch saw
+        "INSERT OR IGNORE INTO main.value(text) SELECT text FROM staging.value ORDER BY id DESC;",
+        // a staged text id becomes the main table's id for the same text
+        "INSERT INTO main.return_data(return_id, datamap_line_id, value, vtype, raw, range_row, range_col, value_id)"
+        "   SELECT d.return_id + ?1, d.datamap_line_id, d.value, d.vtype, d.raw, d.range_row, d.range_col,"
+        "          CASE WHEN d.value_id < 0 THEN m.id ELSE d.value_id END"
+        "     FROM staging.return_data AS d"
+        "     LEFT JOIN staging.value AS s ON s.id = d.value_id"
+        "     LEFT JOIN main.value AS m ON m.text = s.text;",
+        "INSERT INTO main.return_check(return_id, datamap_line_id, range_row, range_col, problem)"
+        "   SELECT return_id + ?1, datamap_line_id, range_row, range_col, problem FROM staging.return_check;",
+    };
+    for (size_t i = 0; i < sizeof(copy) / sizeof(copy[0]); i++) {
+        if (sqlite3_prepare_v2(db, copy[i], -1, &stmt, NULL) != SQLITE_OK)
+            goto fail;
+        sqlite3_bind_int64(stmt, 1, offset);
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE)
+            goto fail;
+    }
+
+    // puts back any indexes dropped above
+    if (rebuild && dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK)
+        goto fail;
+    if (dm_exec_sql_stmt("COMMIT;", db) != SQLITE_OK)
+        goto fail;
+    return 0;
+
+fail:
+    fprintf(stderr, "Cannot publish the batch: %s\n", sqlite3_errmsg(db));
+    dm_exec_sql_stmt("ROLLBACK;", db);
+    return 1;
+}
+
+// Detach the staging database and delete it
+extern void dm_stage_discard(sqlite3 *db)
+{
+    dm_exec_sql_stmt("DETACH DATABASE staging;", db);
+    stage_unlink();
+}
+
+// seen[d] for every datamap in the set
+static int load_seen_set(sqlite3 *db, const DmDatamapSet *set, struct seen_returns **seen)
+{
+    *seen = calloc(set->ndms, sizeof(struct seen_returns));
+    if (*seen == NULL)
+        return 1;
+    for (size_t d = 0; d < set->ndms; d++) {
+        if (load_seen_returns(db, set->dms[d].id, &(*seen)[d]))
+            return 1;
+    }
+    return 0;
+}
+
+static void free_seen_set(struct seen_returns *seen, size_t n)
+{
+    for (size_t d = 0; seen && d < n; d++)
+        free_seen_returns(&seen[d]);
+    free(seen);
+}
+
+/* Import every workbook in paths against each of the datamaps dm_names,
+ * using up to opts->jobs extraction threads (0 means one per online CPU).
+ * However many datamaps there are, each workbook is read once.
+ *
+ * Returns 0 if every workbook was imported or unchanged, 1 if any failed. */
+extern int dm_import_batch(char **paths, size_t npaths, char **dm_names, size_t ndm_names, const DmImportOptions *opts)
+{
+    DmWorkbook *workbooks = calloc(npaths ? npaths : 1, sizeof(DmWorkbook));
+
+    if (workbooks == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < npaths; i++)
+        workbooks[i].name = paths[i];
+    int rc = dm_import_workbooks(workbooks, npaths, dm_names, ndm_names, opts);
+    free(workbooks);
+    return rc;
+}
+
+/* Import the workbook on stdin, as dm_import_batch() would a file. It has
+ * no path, so it is stored as name: a return is replaced by the next
+ * import of the same file, and without a name of their own every stdin
+ * import would be the same file.
+ *
+ * Returns 0 if it was imported or unchanged, 1 if not. */
+extern int dm_import_stdin(const char *name, char **dm_names, size_t ndm_names, const DmImportOptions *opts)
+{
+    DmWorkbook wb;
+    void *data;
+
+    if (name == NULL) {
+        fprintf(stderr, "A spreadsheet on standard input needs a name to be stored under (--as NAME).\n");
+        return 1;
+    }
+    memset(&wb, 0, sizeof(wb));
+    wb.name = (char *)name;
+    if (dm_read_stream(stdin, &data, &wb.size)) {
+        fprintf(stderr, "Cannot read a spreadsheet from standard input.\n");
+        return 1;
+    }
+    wb.data = data;
+    int rc = dm_import_workbooks(&wb, 1, dm_names, ndm_names, opts);
+    free(data);
+    return rc;
+}
+
+// One line for each value in ret that broke its rule
+static void print_failures(const DmDatamap *dm, const DmReturn *ret)
+{
+    for (size_t i = 0; i < ret->nfailures; i++) {
+        const DmCheckFailure *f = &ret->failures[i];
+        const DmLine *line = &dm->lines[f->line];
+        uint32_t k = f->slot - line->value;
+        char problem[256];
+
+        dm_rule_describe(&dm->rules[f->rule], f->why, problem, sizeof(problem));
+        if (DM_LINE_IS_RANGE(line))
+            printf("  %s[%u,%u]: '%s' %s\n", line->key, k / DM_LINE_WIDTH(line) + 1, k % DM_LINE_WIDTH(line) + 1,
+                   ret->values[f->slot], problem);
+        else
+            printf("  %s: '%s' %s\n", line->key, ret->values[f->slot], problem);
+    }
+}
+
+/* Commit what the writer has stored since the last commit. If that fails
+ * it is rolled back, and the writer forgets the text ids that went with it.
+ * Returns 1 on failure. */
+static int commit_writes(DmWriter *w, sqlite3 *db)
+{
+    if (dm_exec_sql_stmt("COMMIT;", db) == SQLITE_OK)
+        return 0;
+    if (!sqlite3_get_autocommit(db))
+        dm_exec_sql_stmt("ROLLBACK;", db);
+    text_ids_clear(w);
+    return 1;
+}
+
+// Finished with the writer, and with the staging database if there is one
+static void close_writer(DmWriter *w, sqlite3 *db, int bulk)
+{
+    dm_writer_close(w);
+    if (bulk)
+        dm_stage_discard(db);
+}
+
+/* As dm_import_batch(), for workbooks that may already be in memory. */
+extern int dm_import_workbooks(const DmWorkbook *workbooks, size_t npaths, char **dm_names, size_t ndm_names,
+                               const DmImportOptions *opts)
+{
+    sqlite3 *db;
+    DmDatamapSet set;
+    DmWriter writer;
+    struct batch b;
+    struct seen_returns *seen = NULL;
+    DmStats stats;
+    size_t imported = 0, unchanged = 0, failed = 0;
+    size_t committed = 0, committed_rows = 0; // as of the last commit that worked
+    int jobs = opts->jobs;
+    double start = dm_now(), t;
+
+    memset(&stats, 0, sizeof(DmStats));
+
+    // returns a return code
+    int rc = sqlite3_open("test.db", &db);
+    // handle error if this fails - we use this all over the place
+    dm_sql_check_error(rc, db);
+
+    rc = dm_exec_sql_stmt("PRAGMA foreign_keys = ON;",  db); // we have to do this every call
+
+    t = dm_now();
+    if (dm_load_datamap_set(db, dm_names, ndm_names, &set)) {
+        sqlite3_close(db);
+        return 1;
+    }
+    stats.datamap_time = dm_now() - t;
+    if (opts->bulk ? dm_writer_open_staging(&writer, db) : dm_writer_open(&writer, db)) {
+        dm_datamap_set_free(&set);
+        sqlite3_close(db);
+        return 1;
+    }
+    if (load_seen_set(db, &set, &seen)) {
+        fprintf(stderr, "Unable to read previous imports.\n");
+        free_seen_set(seen, set.ndms);
+        close_writer(&writer, db, opts->bulk);
+        dm_datamap_set_free(&set);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    if (jobs <= 0)
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0)
+        jobs = 1;
+    if ((size_t)jobs > npaths)
+        jobs = (int)npaths;
+
+    b.set = &set;
+    b.seen = seen;
+    b.force = opts->force;
+    b.sheet_threads = opts->sheet_threads;
+    b.workbooks = workbooks;
+    b.nworkbooks = npaths;
+    b.next = 0;
+    if (queue_init(&b.queue, (size_t)jobs * 2)) {
+        fprintf(stderr, "Out of memory.\n");
+        free_seen_set(seen, set.ndms);
+        close_writer(&writer, db, opts->bulk);
+        dm_datamap_set_free(&set);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    pthread_t *workers = calloc(jobs ? jobs : 1, sizeof(pthread_t));
+    int nworkers = 0;
+    for (int i = 0; workers && i < jobs; i++) {
+        if (pthread_create(&workers[i], NULL, batch_worker, &b) != 0)
+            break;
+        nworkers++;
+    }
+    if (nworkers == 0 && npaths > 0) {
+        fprintf(stderr, "Unable to start any import threads.\n");
+        free(workers);
+        queue_destroy(&b.queue);
+        free_seen_set(seen, set.ndms);
+        close_writer(&writer, db, opts->bulk);
+        dm_datamap_set_free(&set);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    // The writer: one transaction per DM_BATCH_COMMIT_EVERY returns
+    dm_exec_sql_stmt("BEGIN TRANSACTION;", db);
+    for (size_t n = 0; n < npaths; n++) {
+        DmReturn *ret = queue_pop(&b.queue);
+
+        dm_stats_add(&stats, &ret->stats);
+        if (ret->error) {
+            fprintf(stderr, "Failed to import %s: %s\n", ret->filepath ? ret->filepath : "workbook", ret->error);
+            failed++;
+        } else if (ret->unchanged) {
+            if (!opts->quiet)
+                printf("Unchanged %s\n", ret->filepath);
+            unchanged++;
+        } else {
+            size_t rows;
+            t = dm_now();
+            int err = dm_writer_store_set(&writer, &set, ret, &rows);
+            stats.store_time += dm_now() - t;
+            if (err) {
+                fprintf(stderr, "Failed to store %s\n", ret->filepath);
+                failed++;
+            } else {
+                if (!opts->quiet) {
+                    printf("Imported %s (%zu values)\n", ret->filepath, ret->nmatched);
+                    print_failures(set.extract, ret);
+                }
+                imported++;
+                stats.rows_inserted += rows;
+                if (imported % DM_BATCH_COMMIT_EVERY == 0) {
+                    t = dm_now();
+                    int err = commit_writes(&writer, db);
+                    stats.commit_time += dm_now() - t;
+                    stats.commits++;
+                    if (err) {
+                        fprintf(stderr, "Failed to commit the last %zu workbooks.\n", imported - committed);
+                        failed += imported - committed;
+                        imported = committed;
+                        stats.rows_inserted = committed_rows;
+                    }
+                    committed = imported;
+                    committed_rows = stats.rows_inserted;
+                    dm_exec_sql_stmt("BEGIN TRANSACTION;", db);
+                }
+            }
+        }
+        if (ret != &out_of_memory) {
+            dm_return_free(ret);
+            free(ret);
+        }
+    }
+    t = dm_now();
+    if (commit_writes(&writer, db)) {
+        fprintf(stderr, "Failed to commit the last %zu workbooks.\n", imported - committed);
+        failed += imported - committed;
+        imported = committed;
+        stats.rows_inserted = committed_rows;
+    }
+    stats.commit_time += dm_now() - t;
+    stats.commits++;
+    if (opts->bulk) {
+        // the whole batch becomes visible here
+        t = dm_now();
+        if (dm_stage_publish(db)) {
+            failed += imported;
+            imported = 0;
+        }
+        stats.commit_time += dm_now() - t;
+        stats.commits++;
+    }
+
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    if (npaths > 1 && !opts->quiet)
+        printf("Imported %zu of %zu workbooks (%zu unchanged, %zu failed).\n", imported, npaths, unchanged, failed);
+
+    stats.wall_time = dm_now() - start;
+    if (opts->stats)
+        *opts->stats = stats;
+
+    queue_destroy(&b.queue);
+    free_seen_set(seen, set.ndms);
+    close_writer(&writer, db, opts->bulk);
+    dm_datamap_set_free(&set);
+    sqlite3_close(db);
+    return failed > 0;
+}
+
+
+/* -- Stats -----------------------------
+ *
+ * Every DmReturn carries the counters and timings for its own workbook, so
+ * the extraction threads never share them; the writer adds each one into
+ * the batch's totals as it pops it off the queue. Collecting them costs a
+ * few increments per cell and a clock read per sheet, so it is always on
+ * and --stats only decides whether they are printed.
+ */
+
+extern double dm_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+extern void dm_stats_add(DmStats *total, const DmStats *s)
+{
+    total->datamap_time += s->datamap_time;
+    total->hash_time += s->hash_time;
+    total->open_time += s->open_time;
+    total->sheet_time += s->sheet_time;
+    total->store_time += s->store_time;
+    total->commit_time += s->commit_time;
+    total->workbooks += s->workbooks;
+    total->bytes_read += s->bytes_read;
+    total->sheets_opened += s->sheets_opened;
+    total->rows += s->rows;
+    total->cells += s->cells;
+    total->matched += s->matched;
+    total->checks_failed += s->checks_failed;
+    total->rows_inserted += s->rows_inserted;
+    total->commits += s->commits;
+}
+
+// Print s as a human summary, or as one JSON object if json is set
+extern void dm_stats_print(const DmStats *s, FILE *out, int json)
+{
+    if (json) {
+        fprintf(out, "{\"seconds\": {\"wall\": %.6f, \"datamap\": %.6f, \"hash\": %.6f, "
+                     "\"open\": %.6f, \"sheets\": %.6f, \"store\": %.6f, \"commit\": %.6f}, ",
+                s->wall_time, s->datamap_time, s->hash_time, s->open_time,
+                s->sheet_time, s->store_time, s->commit_time);
+        fprintf(out, "\"counts\": {\"workbooks\": %llu, \"bytes_read\": %llu, \"sheets_opened\": %llu, "
+                     "\"rows\": %llu, \"cells\": %llu, \"matched\": %llu, \"rows_inserted\": %llu, "
+                     "\"commits\": %llu, \"checks_failed\": %llu}}\n",
+                (unsigned long long)s->workbooks, (unsigned long long)s->bytes_read,
+                (unsigned long long)s->sheets_opened, (unsigned long long)s->rows,
+                (unsigned long long)s->cells, (unsigned long long)s->matched,
+                (unsigned long long)s->rows_inserted, (unsigned long long)s->commits,
+                (unsigned long long)s->checks_failed);
+        return;
+    }
+    fprintf(out, "%-16s %10.3fs\n", "wall:", s->wall_time);
+    fprintf(out, "%-16s %10.3fs\n", "load datamap:", s->datamap_time);
+    fprintf(out, "%-16s %10.3fs\n", "hash files:", s->hash_time);
+    fprintf(out, "%-16s %10.3fs\n", "open workbooks:", s->open_time);
+    fprintf(out, "%-16s %10.3fs  (inflate, parse and match)\n", "read sheets:", s->sheet_time);
+    fprintf(out, "%-16s %10.3fs\n", "store returns:", s->store_time);
+    fprintf(out, "%-16s %10.3fs\n", "commit:", s->commit_time);
+    fprintf(out, "%-16s %10llu  (%llu bytes)\n", "workbooks:",
+            (unsigned long long)s->workbooks, (unsigned long long)s->bytes_read);
+    fprintf(out, "%-16s %10llu\n", "sheets opened:", (unsigned long long)s->sheets_opened);
+    fprintf(out, "%-16s %10llu\n", "rows visited:", (unsigned long long)s->rows);
+    fprintf(out, "%-16s %10llu\n", "cells visited:", (unsigned long long)s->cells);
+    fprintf(out, "%-16s %10llu\n", "cells matched:", (unsigned long long)s->matched);
+    fprintf(out, "%-16s %10llu\n", "checks failed:", (unsigned long long)s->checks_failed);
+    fprintf(out, "%-16s %10llu\n", "rows inserted:", (unsigned long long)s->rows_inserted);
+    fprintf(out, "%-16s %10llu\n", "commits:", (unsigned long long)s->commits);
+}
+
+
+/* -- Finding workbooks ----------------------------- */
+
+extern int dm_is_workbook_name(const char *name)
+{
+    size_t len = strlen(name);
+    // skip Excel's "~$name.xlsx" lock files
+    return len > 5 && strcmp(name + len - 5, ".xlsx") == 0 && strncmp(name, "~$", 2) != 0;
+}
+
+// Paths are stored resolved, so the same workbook is recognised on a re-run
+// however it was named on the command line
+static int add_path(char ***paths, size_t *npaths, size_t *size, const char *path)
+{
+    char *resolved = realpath(path, NULL);
+
+    if (*npaths == *size) {
+        size_t new_size = *size ? *size * 2 : 64;
+        char **p = realloc(*paths, new_size * sizeof(char *));
+        if (p == NULL) {
+            free(resolved);
+            return 1;
+        }
+        *paths = p;
+        *size = new_size;
+    }
+    (*paths)[*npaths] = resolved ? resolved : strdup(path);
+    if ((*paths)[*npaths] == NULL)
+        return 1;
+    (*npaths)++;
+    return 0;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Turn spec into a sorted list of workbook paths. spec may be a single
+ * file, a directory (every .xlsx file in it) or a glob pattern.
+ * Returns 0 on success, 1 if nothing matched. */
+extern int dm_expand_paths(const char *spec, char ***paths, size_t *npaths)
+{
+    struct stat st;
+    size_t size = 0;
+
+    *paths = NULL;
+    *npaths = 0;
+
+    if (stat(spec, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(spec);
+        struct dirent *entry;
+        if (dir == NULL)
+            return 1;
+        while ((entry = readdir(dir)) != NULL) {
+            if (!dm_is_workbook_name(entry->d_name))
+                continue;
+            size_t len = strlen(spec) + strlen(entry->d_name) + 2;
+            char *path = malloc(len);
+            if (path == NULL)
+                break;
+            snprintf(path, len, "%s/%s", spec, entry->d_name);
+            int err = add_path(paths, npaths, &size, path);
+            free(path);
+            if (err)
+                break;
+        }
+        closedir(dir);
+        if (*npaths > 1)
+            qsort(*paths, *npaths, sizeof(char *), compare_paths);
+    } else {
+        glob_t g;
+        if (glob(spec, 0, NULL, &g) == 0) {
+            // glob() sorts for us
+            for (size_t i = 0; i < g.gl_pathc; i++) {
+                if (add_path(paths, npaths, &size, g.gl_pathv[i]))
+                    break;
+            }
+            globfree(&g);
+        } else if (stat(spec, &st) == 0) {
+            add_path(paths, npaths, &size, spec);
+        }
+    }
+    return *npaths == 0;
+}
+
+extern void dm_free_paths(char **paths, size_t npaths)
+{
+    for (size_t i = 0; i < npaths; i++)
+        free(paths[i]);
+    free(paths);
+}
+
+/* -- Finding returns ----------------------------- */
+
+extern int dm_is_return_id(const char *spec)
+{
+    if (*spec == '\0')
+        return 0;
+    for (; *spec; spec++) {
+        if (*spec < '0' || *spec > '9')
+            return 0;
+    }
+    return 1;
+}
+
+// name_off is where its name starts in file
+static int add_ref(DmReturnRefs *refs, size_t *size, int64_t id, const char *file, size_t name_off)
+{
+    if (refs->count == *size) {
+        size_t new_size = *size ? *size * 2 : 16;
+        DmReturnRef *r = realloc(refs->refs, new_size * sizeof(DmReturnRef));
+        if (r == NULL)
+            return 1;
+        refs->refs = r;
+        *size = new_size;
+    }
+    DmReturnRef *ref = &refs->refs[refs->count];
+    if ((ref->file = strdup(file)) == NULL)
+        return 1;
+    ref->id = id;
+    ref->name = ref->file + name_off;
+    refs->count++;
+    return 0;
+}
+
+/* The returns against datamap dm_id that spec stands for: the return with
+ * that id if spec is all digits, or else the workbook imported from spec
+ * or, if batches is set and there isn't one, every workbook imported from
+ * under the directory or bundle spec. Finding none isn't an error; returns
+ * 1 only if the database can't be read or memory runs out. */
+extern int dm_find_returns(sqlite3 *db, int64_t dm_id, const char *spec, int batches, DmReturnRefs *refs)
+{
+    sqlite3_stmt *stmt;
+    size_t size = 0;
+    int by_id = dm_is_return_id(spec);
+    int rc, err = 0;
+
+    memset(refs, 0, sizeof(DmReturnRefs));
+    // paths are stored resolved (see dm_expand_paths())
+    char *resolved = by_id ? NULL : realpath(spec, NULL);
+    const char *file = resolved ? resolved : spec;
+
+    rc = sqlite3_prepare_v2(db, by_id ? "SELECT id, file FROM return WHERE dm_id = ?1 AND id = ?2"
+                                      : "SELECT id, file FROM return WHERE dm_id = ?1 AND file = ?2",
+                            -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_int64(stmt, 1, dm_id);
+    if (by_id)
+        sqlite3_bind_int64(stmt, 2, strtoll(spec, NULL, 10));
+    else
+        sqlite3_bind_text(stmt, 2, file, -1, SQLITE_STATIC);
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *found = (const char *)sqlite3_column_text(stmt, 1);
+        const char *base = strrchr(found, '/');
+        err = add_ref(refs, &size, sqlite3_column_int64(stmt, 0), found, base ? (size_t)(base + 1 - found) : 0);
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc == SQLITE_DONE && batches && !by_id) {
+        // everything from "file/" up to "file0" ('0' follows '/'), a range
+        // of return_dm already in name order
+        rc = sqlite3_prepare_v2(db, "SELECT id, file FROM return"
+                                    " WHERE dm_id = ?1 AND file >= ?2 || '/' AND file < ?2 || '0'"
+                                    " ORDER BY file",
+                                -1, &stmt, NULL);
+        dm_sql_check_error(rc, db);
+        sqlite3_bind_int64(stmt, 1, dm_id);
+        sqlite3_bind_text(stmt, 2, file, -1, SQLITE_STATIC);
+        while (!err && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            err = add_ref(refs, &size, sqlite3_column_int64(stmt, 0), (const char *)sqlite3_column_text(stmt, 1),
+                          strlen(file) + 1);
+        sqlite3_finalize(stmt);
+        refs->batch = 1;
+    }
+    free(resolved);
+    return err || (rc != SQLITE_DONE && rc != SQLITE_ROW);
+}
+
+extern void dm_free_return_refs(DmReturnRefs *refs)
+{
+    for (size_t i = 0; i < refs->count; i++)
+        free(refs->refs[i].file);
+    free(refs->refs);
+    memset(refs, 0, sizeof(DmReturnRefs));
+}
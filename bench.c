@@ -0,0 +1,227 @@
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <xlsxio_write.h>
+#include "reader.h"
+
+/* -- datamaps benchmark -----------------------------
+ *
+ * Generates a directory of synthetic returns and a matching datamap, then
+ * times the three things we care about: importing the datamap, extracting
+ * single workbooks, and a batch import of the lot.
+ *
+ * xlsxio's writer produces single-sheet workbooks, so every generated
+ * return has one sheet ("Return") and the datamap spreads its lines over
+ * that sheet's grid.
+ *
+ * Usage: datamaps_bench [-n returns] [-r rows] [-c cols] [-d density]
+ *                       [-s string_ratio] [-l datamap_lines] [-j jobs]
+ *                       [-o dir]
+ */
+
+#define BENCH_SHEET "Return"
+
+struct bench_config {
+    int returns;
+    int rows;
+    int cols;
+    double density;      // chance a cell has a value
+    double string_ratio; // chance a value is a string rather than a number
+    int dm_lines;
+    int jobs;
+    const char *dir;
+};
+
+// xorshift64* - deterministic so runs are comparable
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static const char *words[] = {
+    "Green", "Amber", "Red", "Amber/Green", "Department for Transport",
+    "Outline Business Case", "Full Business Case", "N/A", "Delivery", "Closed"
+};
+
+// Write one return. Returns the number of non-empty cells written.
+static long generate_return(const struct bench_config *cfg, const char *path)
+{
+    xlsxiowriter w = xlsxiowrite_open(path, BENCH_SHEET);
+    long cells = 0;
+
+    if (w == NULL)
+        return -1;
+    for (int r = 1; r <= cfg->rows; r++) {
+        for (int c = 1; c <= cfg->cols; c++) {
+            if (rng_unit() >= cfg->density) {
+                xlsxiowrite_add_cell_string(w, NULL);
+                continue;
+            }
+            if (rng_unit() < cfg->string_ratio)
+                xlsxiowrite_add_cell_string(w, words[rng_next() % (sizeof(words) / sizeof(words[0]))]);
+            else
+                xlsxiowrite_add_cell_float(w, (double)(rng_next() % 10000000) / 100.0);
+            cells++;
+        }
+        xlsxiowrite_next_row(w);
+    }
+    xlsxiowrite_close(w);
+    return cells;
+}
+
+// A datamap of cfg->dm_lines distinct cells on the generated grid
+static int generate_datamap(const struct bench_config *cfg, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return 1;
+
+    long grid = (long)cfg->rows * cfg->cols;
+    int lines = cfg->dm_lines < grid ? cfg->dm_lines : (int)grid;
+    char *used = calloc(grid, 1);
+    if (used == NULL) {
+        fclose(f);
+        return 1;
+    }
+
+    fprintf(f, "cell_key,template_sheet,cellreference\n");
+    for (int i = 0; i < lines; i++) {
+        long cell;
+        do {
+            cell = (long)(rng_next() % (uint64_t)grid);
+        } while (used[cell]);
+        used[cell] = 1;
+
+        char cref[DM_CELLREF_MAX];
+        dm_format_cellref(cell / cfg->cols + 1, cell % cfg->cols + 1, cref);
+        fprintf(f, "\"Key %d, synthetic\",%s,%s\n", i, BENCH_SHEET, cref);
+    }
+    free(used);
+    return fclose(f) != 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n returns] [-r rows] [-c cols] [-d density] "
+                    "[-s string_ratio] [-l datamap_lines] [-j jobs] [-o dir]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {50, 2000, 30, 0.6, 0.3, 1000, 0, "bench_data"};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:c:d:s:l:j:o:h")) != -1) {
+        switch (opt) {
+            case 'n': cfg.returns = atoi(optarg); break;
+            case 'r': cfg.rows = atoi(optarg); break;
+            case 'c': cfg.cols = atoi(optarg); break;
+            case 'd': cfg.density = atof(optarg); break;
+            case 's': cfg.string_ratio = atof(optarg); break;
+            case 'l': cfg.dm_lines = atoi(optarg); break;
+            case 'j': cfg.jobs = atoi(optarg); break;
+            case 'o': cfg.dir = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (cfg.returns < 1 || cfg.rows < 1 || cfg.cols < 1 || cfg.cols > EXCEL_MAX_COLS || cfg.dm_lines < 1)
+        usage(argv[0]);
+
+    // everything, including test.db, lives in the bench directory
+    mkdir(cfg.dir, 0755);
+    if (chdir(cfg.dir) != 0) {
+        fprintf(stderr, "Cannot use directory %s\n", cfg.dir);
+        return 1;
+    }
+    unlink("test.db");
+
+    printf("Generating %d returns of %d x %d cells (density %.2f, %.0f%% strings), datamap of %d lines\n",
+           cfg.returns, cfg.rows, cfg.cols, cfg.density, cfg.string_ratio * 100, cfg.dm_lines);
+
+    char **paths = calloc(cfg.returns, sizeof(char *));
+    long total_cells = 0;
+    double t = dm_now();
+    for (int i = 0; i < cfg.returns; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "return_%04d.xlsx", i);
+        long cells = generate_return(&cfg, name);
+        if (cells < 0) {
+            fprintf(stderr, "Cannot write %s\n", name);
+            return 1;
+        }
+        total_cells += cells;
+        paths[i] = realpath(name, NULL);
+    }
+    if (generate_datamap(&cfg, "datamap.csv")) {
+        fprintf(stderr, "Cannot write datamap.csv\n");
+        return 1;
+    }
+    printf("  generated in %.2fs, %ld non-empty cells\n\n", dm_now() - t, total_cells);
+
+    // 1. datamap import (includes compiling the cache image)
+    t = dm_now();
+    if (dm_import_dm("datamap.csv", "bench", 1))
+        return 1;
+    double dm_time = dm_now() - t;
+
+    // 2. single-threaded extraction, one workbook at a time
+    sqlite3 *db;
+    DmDatamap dm;
+    size_t matched = 0;
+    sqlite3_open("test.db", &db);
+    if (dm_load_datamap(db, "bench", &dm))
+        return 1;
+    sqlite3_close(db);
+    t = dm_now();
+    for (int i = 0; i < cfg.returns; i++) {
+        DmReturn ret;
+        if (dm_extract_workbook(&dm, paths[i], &ret) == 0)
+            matched += ret.nmatched;
+        dm_return_free(&ret);
+    }
+    double extract_time = dm_now() - t;
+    dm_datamap_free(&dm);
+
+    // 3. batch import into the database
+    char *dm_name = "bench";
+    DmStats stats;
+    DmImportOptions opts = {cfg.jobs, 1, 1, &stats};
+    memset(&stats, 0, sizeof(DmStats));
+    t = dm_now();
+    int failed = dm_import_batch(paths, cfg.returns, &dm_name, 1, &opts);
+    double batch_time = dm_now() - t;
+
+    printf("%-28s %10.3fs  (%.0f lines/s)\n", "datamap import:", dm_time, cfg.dm_lines / dm_time);
+    printf("%-28s %10.3fs  (%.2f ms/workbook)\n", "extraction, 1 thread:", extract_time,
+           extract_time * 1000 / cfg.returns);
+    printf("%-28s %10.0f cells/s, %.0f matched cells/s\n", "", total_cells / extract_time,
+           matched / extract_time);
+    printf("%-28s %10.3fs  (%.1f workbooks/s, %.0f cells/s)%s\n", "batch import:", batch_time,
+           cfg.returns / batch_time, total_cells / batch_time, failed ? "  SOME FAILED" : "");
+    printf("%-28s %10ld KB\n\n", "peak RSS:", peak_rss_kb());
+    printf("batch import by phase:\n");
+    dm_stats_print(&stats, stdout, 0);
+
+    for (int i = 0; i < cfg.returns; i++)
+        free(paths[i]);
+    free(paths);
+    return failed;
+}
@@ -0,0 +1,389 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "reader.h"
+
+/* -- Bundles -----------------------------
+ *
+ * Returns often arrive as one zip or tar file. Rather than unpack it to
+ * disk and read every workbook back, the bundle is mapped and each member
+ * becomes a DmWorkbook pointing straight at its bytes, which xlsxio opens
+ * from memory.
+ *
+ * - tar members are stored as they are, so they cost nothing to hand over.
+ * - zip members are usually deflated. They are left compressed here and
+ *   the batch worker that takes one inflates it (dm_inflate_raw()), so
+ *   that work is spread over the extraction threads and only the
+ *   workbooks being read at the moment are ever inflated in memory.
+ * - a gzipped tar has to be inflated in one go before its members can be
+ *   found.
+ *
+ * A bundle can also come in on stdin ("-"), in which case it is read into
+ * memory first. Members are stored as "bundle path/member name", so
+ * re-importing the same bundle recognises members that haven't changed.
+ * A bundle on stdin has no path, so it has to be given a name to use
+ * instead (--as); otherwise one stdin bundle's members would replace
+ * another's. Only .xlsx members are imported.
+ */
+
+/* Read all of f into a malloc'd buffer. Returns 0 on success, 1 on a read
+ * error or if out of memory. */
+extern int dm_read_stream(FILE *f, void **data, size_t *size)
+{
+    size_t cap = 1 << 16, len = 0;
+    char *buf = malloc(cap);
+
+    while (buf) {
+        len += fread(buf + len, 1, cap - len, f);
+        if (len < cap)
+            break;
+        cap *= 2;
+        char *p = realloc(buf, cap);
+        if (p == NULL) {
+            free(buf);
+            buf = NULL;
+        } else {
+            buf = p;
+        }
+    }
+    if (buf == NULL || ferror(f)) {
+        free(buf);
+        return 1;
+    }
+    *data = buf;
+    *size = len;
+    return 0;
+}
+
+/* Inflate the raw deflate stream src (a zip member) into dst, which must
+ * be exactly the size it inflates to. Returns 0 on success. */
+extern int dm_inflate_raw(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+        return 1;
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = (uInt)src_size;
+    zs.next_out = dst;
+    zs.avail_out = (uInt)dst_size;
+    int rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    return rc != Z_STREAM_END || zs.total_out != dst_size;
+}
+
+// A gzip file inflated into a malloc'd buffer
+static int gunzip(const void *src, size_t src_size, void **out, size_t *out_size)
+{
+    z_stream zs;
+    size_t cap = src_size * 4 + 4096;
+    char *buf = malloc(cap);
+    int rc = Z_OK;
+
+    memset(&zs, 0, sizeof(zs));
+    if (buf == NULL || inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+        free(buf);
+        return 1;
+    }
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = (uInt)src_size;
+    while (rc == Z_OK) {
+        if (zs.total_out == cap) {
+            char *p = realloc(buf, cap * 2);
+            if (p == NULL)
+                break;
+            buf = p;
+            cap *= 2;
+        }
+        zs.next_out = (Bytef *)buf + zs.total_out;
+        zs.avail_out = (uInt)(cap - zs.total_out);
+        rc = inflate(&zs, Z_NO_FLUSH);
+    }
+    *out_size = zs.total_out;
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        free(buf);
+        return 1;
+    }
+    *out = buf;
+    return 0;
+}
+
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Add a member, if it is a workbook. Returns 1 if out of memory.
+static int bundle_add(DmBundle *b, size_t *size, const char *prefix, const char *name, size_t name_len,
+                      const void *data, size_t data_size, size_t inflated)
+{
+    char *member = dm_arena_strndup(&b->arena, name, name_len);
+    if (member == NULL)
+        return 1;
+    if (!dm_is_workbook_name(base_name(member)))
+        return 0;
+
+    if (b->nworkbooks == *size) {
+        *size = *size ? *size * 2 : 64;
+        DmWorkbook *wbs = realloc(b->workbooks, *size * sizeof(DmWorkbook));
+        if (wbs == NULL)
+            return 1;
+        b->workbooks = wbs;
+    }
+    DmWorkbook *wb = &b->workbooks[b->nworkbooks++];
+    if (prefix) {
+        size_t len = strlen(prefix) + strlen(member) + 2;
+        if ((wb->name = dm_arena_alloc(&b->arena, len)) == NULL)
+            return 1;
+        snprintf(wb->name, len, "%s/%s", prefix, member);
+    } else {
+        wb->name = member;
+    }
+    wb->data = data;
+    wb->size = data_size;
+    wb->inflated = inflated;
+    return 0;
+}
+
+static uint32_t le16(const unsigned char *p)
+{
+    return p[0] | (uint32_t)p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* The members of a zip, from its central directory. Zip64 bundles (over
+ * 4GB, or more than 65535 members) aren't supported. */
+static int bundle_zip(DmBundle *b, const unsigned char *data, size_t size, const char *prefix)
+{
+    size_t eocd = 0, wbs_size = 0;
+    int found = 0;
+
+    // the end of central directory record is in the last 64K or so
+    for (size_t i = size >= 22 ? size - 22 : 0; size >= 22; i--) {
+        if (le32(data + i) == 0x06054b50) {
+            eocd = i;
+            found = 1;
+            break;
+        }
+        if (i == 0 || size - i > 22 + 65535)
+            break;
+    }
+    if (!found) {
+        fprintf(stderr, "Not a zip file: no central directory.\n");
+        return 1;
+    }
+    size_t nentries = le16(data + eocd + 10);
+    size_t pos = le32(data + eocd + 16);
+
+    for (size_t n = 0; n < nentries; n++) {
+        if (pos + 46 > size || le32(data + pos) != 0x02014b50) {
+            fprintf(stderr, "Zip central directory is damaged.\n");
+            return 1;
+        }
+        const unsigned char *cd = data + pos;
+        uint32_t method = le16(cd + 10);
+        size_t csize = le32(cd + 20), usize = le32(cd + 24);
+        size_t name_len = le16(cd + 28), extra_len = le16(cd + 30), comment_len = le16(cd + 32);
+        size_t local = le32(cd + 42);
+        const char *name = (const char *)cd + 46;
+        pos += 46 + name_len + extra_len + comment_len;
+        if (pos > size) {
+            fprintf(stderr, "Zip central directory is damaged.\n");
+            return 1;
+        }
+        if (name_len == 0 || name[name_len - 1] == '/')
+            continue; // a directory
+
+        // the member's data follows its local header, whose extra field
+        // can differ from the central one
+        if (local + 30 > size || le32(data + local) != 0x04034b50) {
+            fprintf(stderr, "Skipping %.*s: damaged zip entry.\n", (int)name_len, name);
+            continue;
+        }
+        size_t start = local + 30 + le16(data + local + 26) + le16(data + local + 28);
+        if (csize == 0xffffffff || usize == 0xffffffff || start + csize > size) {
+            fprintf(stderr, "Skipping %.*s: too big or damaged.\n", (int)name_len, name);
+            continue;
+        }
+        if (method != 0 && method != 8) {
+            fprintf(stderr, "Skipping %.*s: unsupported compression.\n", (int)name_len, name);
+            continue;
+        }
+        if (bundle_add(b, &wbs_size, prefix, name, name_len, data + start, method == 0 ? usize : csize,
+                       method == 8 ? usize : 0))
+            return 1;
+    }
+    return 0;
+}
+
+static size_t octal(const char *p, size_t len)
+{
+    size_t n = 0;
+    for (; len > 0 && (*p == ' ' || *p == '\0'); p++, len--)
+        ;
+    for (; len > 0 && *p >= '0' && *p <= '7'; p++, len--)
+        n = n * 8 + (*p - '0');
+    return n;
+}
+
+/* The regular files in a tar. ustar names (with their prefix), GNU long
+ * names and pax path records are all understood. */
+static int bundle_tar(DmBundle *b, const unsigned char *data, size_t size, const char *prefix)
+{
+    size_t pos = 0, wbs_size = 0;
+    const char *long_name = NULL;
+    size_t long_len = 0;
+
+    while (pos + 512 <= size) {
+        const char *h = (const char *)data + pos;
+        if (h[0] == '\0')
+            break; // the zero blocks at the end
+        size_t len = octal(h + 124, 12);
+        size_t body = pos + 512;
+        if (body + len > size) {
+            fprintf(stderr, "Tar file is truncated.\n");
+            return 1;
+        }
+        char type = h[156];
+
+        if (type == 'L') {
+            // GNU: the next member's name
+            long_name = (const char *)data + body;
+            long_len = strnlen(long_name, len);
+        } else if (type == 'x') {
+            // pax: "len path=name\n" among the records
+            const char *rec = (const char *)data + body, *end = rec + len;
+            while (rec < end) {
+                char *sp;
+                size_t rlen = strtoul(rec, &sp, 10);
+                if (rlen == 0 || rec + rlen > end || *sp != ' ')
+                    break;
+                if ((size_t)(rec + rlen - sp) > 6 && strncmp(sp + 1, "path=", 5) == 0) {
+                    long_name = sp + 6;
+                    long_len = rec + rlen - 1 - long_name;
+                }
+                rec += rlen;
+            }
+        } else if (type == '0' || type == '\0') {
+            char name[256 + 2];
+            const char *member = long_name;
+            size_t member_len = long_len;
+            if (member == NULL) {
+                // ustar: prefix/name, each NUL-terminated only if short
+                size_t plen = strnlen(h + 345, 155), nlen = strnlen(h, 100);
+                if (plen && memcmp(h + 257, "ustar", 5) == 0)
+                    member_len = snprintf(name, sizeof(name), "%.*s/%.*s", (int)plen, h + 345, (int)nlen, h);
+                else
+                    member_len = snprintf(name, sizeof(name), "%.*s", (int)nlen, h);
+                member = name;
+            }
+            if (bundle_add(b, &wbs_size, prefix, member, member_len, data + body, len, 0))
+                return 1;
+        }
+        if (type != 'L' && type != 'x')
+            long_name = NULL; // it was for this member
+        pos = body + (len + 511) / 512 * 512;
+    }
+    return 0;
+}
+
+/* Open the bundle at path, or on stdin if path is "-", and list the
+ * workbooks in it. They point into the bundle, which must stay open until
+ * they have been imported. A bundle on stdin's members are named after
+ * stdin_name, which it must have.
+ *
+ * Returns 0 on success, 1 if the bundle can't be read or isn't a zip, tar
+ * or gzipped tar. */
+extern int dm_bundle_open(const char *path, const char *stdin_name, DmBundle *bundle)
+{
+    const unsigned char *data;
+    size_t size;
+    char *prefix = NULL;
+
+    memset(bundle, 0, sizeof(DmBundle));
+    if (strcmp(path, DM_STDIN_NAME) == 0) {
+        if (stdin_name == NULL) {
+            fprintf(stderr, "A bundle on standard input needs a name to store its spreadsheets under (--as NAME).\n");
+            return 1;
+        }
+        if (dm_read_stream(stdin, &bundle->buf, &size)) {
+            fprintf(stderr, "Cannot read a bundle from standard input.\n");
+            return 1;
+        }
+        data = bundle->buf;
+        if ((prefix = dm_arena_strdup(&bundle->arena, stdin_name)) == NULL) {
+            dm_bundle_close(bundle);
+            return 1;
+        }
+    } else {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+            fprintf(stderr, "Cannot read bundle %s\n", path);
+            if (fd >= 0)
+                close(fd);
+            return 1;
+        }
+        bundle->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (bundle->map == MAP_FAILED) {
+            bundle->map = NULL;
+            fprintf(stderr, "Cannot read bundle %s\n", path);
+            return 1;
+        }
+        bundle->map_size = size = st.st_size;
+        data = bundle->map;
+        // members are named after the bundle the way a batch names files
+        char *resolved = realpath(path, NULL);
+        prefix = dm_arena_strdup(&bundle->arena, resolved ? resolved : path);
+        free(resolved);
+    }
+
+    int rc;
+    if (size >= 4 && le32(data) == 0x04034b50) {
+        rc = bundle_zip(bundle, data, size, prefix);
+    } else {
+        if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+            void *tar;
+            if (gunzip(data, size, &tar, &size)) {
+                fprintf(stderr, "Cannot inflate bundle %s\n", path);
+                dm_bundle_close(bundle);
+                return 1;
+            }
+            // the tar is all we need from now on
+            free(bundle->buf);
+            bundle->buf = tar;
+            data = tar;
+        }
+        if (size < 512 || memcmp(data + 257, "ustar", 5) != 0) {
+            fprintf(stderr, "%s is not a zip or tar bundle.\n", path);
+            dm_bundle_close(bundle);
+            return 1;
+        }
+        rc = bundle_tar(bundle, data, size, prefix);
+    }
+    if (rc) {
+        dm_bundle_close(bundle);
+        return 1;
+    }
+    return 0;
+}
+
+extern void dm_bundle_close(DmBundle *bundle)
+{
+    if (bundle->map)
+        munmap(bundle->map, bundle->map_size);
+    free(bundle->buf);
+    free(bundle->workbooks);
+    dm_arena_free(&bundle->arena);
+    memset(bundle, 0, sizeof(DmBundle));
+}
@@ -0,0 +1,72 @@
+#ifndef DATAMAPS_H
+#define DATAMAPS_H
+
+#include <stddef.h>
+
+/* -- libdatamaps -----------------------------
+ *
+ * Extracting datamap values from workbooks in-process, without the CLI or
+ * the database. Link with -ldatamaps -lsqlite3 -lxlsxio_read -lz -pthread.
+ *
+ * A DmExtractor is a compiled datamap. Once made it is only ever read, so
+ * any number of threads can open cursors on it at once. A DmCursor reads
+ * one workbook and hands back the values the datamap wants a record at a
+ * time, reading the sheets as it goes rather than the whole workbook up
+ * front; a cursor belongs to one thread at a time.
+ *
+ *     DmExtractor *ex = dm_extractor_compile("datamap.csv");
+ *     DmCursor *c = dm_cursor_open(ex, "return.xlsx");
+ *     while ((rc = dm_cursor_next(c)) == 1) {
+ *         const DmRecord *r = dm_cursor_record(c);
+ *         ...
+ *     }
+ *     if (rc < 0)
+ *         fprintf(stderr, "%s\n", dm_cursor_error(c));
+ *     dm_cursor_close(c);
+ *     dm_extractor_free(ex);
+ *
+ * Records come sheet by sheet, ordered by sheet name (byte by byte, as
+ * strcmp() compares them, not in the order the datamap lists them), and
+ * down each sheet row by row. Sheets the workbook doesn't have and cells
+ * with no value yield nothing.
+ */
+
+typedef struct DmExtractor DmExtractor;
+typedef struct DmCursor DmCursor;
+
+// One value. Everything here is the cursor's and only good until the next dm_cursor_next().
+typedef struct DmRecord {
+    const char *key;
+    const char *sheet;
+    const char *cellref; // where it was: "B5"
+    const char *value;   // as xlsxio read it
+    unsigned range_row;  // for a range line, the value's row and column in
+    unsigned range_col;  // the range from 1; 0 for a single cell
+    const char *problem; // how it breaks the line's rules ("is above 100"), or NULL
+} DmRecord;
+
+/* Compile the datamap CSV file at path (key,sheet,cellref and any rule
+ * columns), as `datamaps datamap --import PATH` would read it. Lines it can't
+ * use are skipped with a message on stderr. NULL if there is nothing to
+ * extract or the file can't be read. */
+extern DmExtractor *dm_extractor_compile(const char *path);
+
+// The datamap called dm_name in an existing datamaps database. NULL if it isn't there.
+extern DmExtractor *dm_extractor_load(const char *db_path, const char *dm_name);
+
+extern void dm_extractor_free(DmExtractor *ex);
+
+/* A cursor on the workbook at path, or in the size bytes at data (which
+ * must stay put until the cursor is closed). NULL only if out of memory:
+ * a workbook that can't be opened makes a cursor whose dm_cursor_next()
+ * fails, so dm_cursor_error() can say why. ex must outlive the cursor. */
+extern DmCursor *dm_cursor_open(const DmExtractor *ex, const char *path);
+extern DmCursor *dm_cursor_open_memory(const DmExtractor *ex, const void *data, size_t size);
+
+// 1 with the next record ready, 0 at the end of the workbook, -1 on error
+extern int dm_cursor_next(DmCursor *c);
+extern const DmRecord *dm_cursor_record(const DmCursor *c);
+extern const char *dm_cursor_error(const DmCursor *c); // NULL if there wasn't one
+extern void dm_cursor_close(DmCursor *c);
+
+#endif
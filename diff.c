@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include "reader.h"
+
+/* -- Diffing returns -----------------------------
+ *
+ * Compares two returns imported against the same datamap, or two batches
+ * of them, and writes out every value that changed, appeared or went away
+ * as CSV:
+ *
+ *   return,key,status,old,new,delta
+ *
+ * where delta is new - old when both values are numbers. A side is given
+ * as a return id, a workbook as it was imported, or the directory (or
+ * bundle) a batch was imported from. Batches are paired up by each
+ * workbook's name within its directory, so Q1/project.xlsx is compared
+ * with Q2/project.xlsx; a workbook on only one side has all its values
+ * reported as added or removed.
+ *
+ * Each pair of returns is a merge of two queries ordered by (datamap line,
+ * range cell), which the return_data_line index gives back already sorted.
+ * Only the current row of each is held, so memory doesn't grow with the
+ * size of the returns, and each value is read once.
+ */
+
+struct diff_counts {
+    size_t changed;
+    size_t added;
+    size_t removed;
+};
+
+// A return and its cells, in the order the merge needs them
+static const char *diff_sql = "SELECT v.datamap_line_id, v.range_row, v.range_col, v.value, v.vtype, v.text, l.key"
+                              "  FROM return_value AS v"
+                              "  JOIN datamap_line AS l ON l.id = v.datamap_line_id"
+                              " WHERE v.return_id = ?"
+                              " ORDER BY v.datamap_line_id, v.range_row, v.range_col";
+
+enum {COL_LINE, COL_ROW, COL_COL, COL_VALUE, COL_VTYPE, COL_TEXT, COL_KEY};
+
+/* The returns spec stands for: a return id, a workbook or, failing those,
+ * every workbook imported from under the directory or bundle spec. A
+ * batch's returns are paired with the other side's by name. */
+static int load_side(sqlite3 *db, int64_t dm_id, const char *spec, DmReturnRefs *side)
+{
+    if (dm_find_returns(db, dm_id, spec, 1, side)) {
+        fprintf(stderr, "Unable to read the returns for %s.\n", spec);
+        return 1;
+    }
+    if (side->count == 0) {
+        fprintf(stderr, "No returns for %s found against this datamap.\n", spec);
+        return 1;
+    }
+    return 0;
+}
+
+static int compare_cells(sqlite3_stmt *a, sqlite3_stmt *b)
+{
+    for (int col = COL_LINE; col <= COL_COL; col++) {
+        int64_t x = sqlite3_column_int64(a, col), y = sqlite3_column_int64(b, col);
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+    return 0;
+}
+
+static int is_number(sqlite3_stmt *stmt)
+{
+    int vtype = sqlite3_column_int(stmt, COL_VTYPE);
+    return vtype == DM_VALUE_INTEGER || vtype == DM_VALUE_REAL;
+}
+
+// Numbers are compared as numbers, so 1 and 1.0 are the same
+static int same_value(sqlite3_stmt *a, sqlite3_stmt *b)
+{
+    if (is_number(a) && is_number(b)) {
+        if (sqlite3_column_int(a, COL_VTYPE) == DM_VALUE_INTEGER && sqlite3_column_int(b, COL_VTYPE) == DM_VALUE_INTEGER)
+            return sqlite3_column_int64(a, COL_VALUE) == sqlite3_column_int64(b, COL_VALUE);
+        return sqlite3_column_double(a, COL_VALUE) == sqlite3_column_double(b, COL_VALUE);
+    }
+    return sqlite3_column_int(a, COL_VTYPE) == sqlite3_column_int(b, COL_VTYPE)
+           && strcmp((const char *)sqlite3_column_text(a, COL_TEXT), (const char *)sqlite3_column_text(b, COL_TEXT)) == 0;
+}
+
+static void write_delta(FILE *out, sqlite3_stmt *old, sqlite3_stmt *new)
+{
+    if (sqlite3_column_int(old, COL_VTYPE) == DM_VALUE_INTEGER && sqlite3_column_int(new, COL_VTYPE) == DM_VALUE_INTEGER) {
+        int64_t a = sqlite3_column_int64(old, COL_VALUE), b = sqlite3_column_int64(new, COL_VALUE);
+        // b - a, unless it doesn't fit
+        if (a >= 0 ? b >= INT64_MIN + a : b <= INT64_MAX + a) {
+            fprintf(out, "%lld", (long long)(b - a));
+            return;
+        }
+    }
+    fprintf(out, "%.15g", sqlite3_column_double(new, COL_VALUE) - sqlite3_column_double(old, COL_VALUE));
+}
+
+// One line of the diff. cell is whichever of old and new is there.
+static void write_change(FILE *out, const char *name, sqlite3_stmt *cell, const char *status,
+                         sqlite3_stmt *old, sqlite3_stmt *new)
+{
+    const char *key = (const char *)sqlite3_column_text(cell, COL_KEY);
+    int64_t range_row = sqlite3_column_int64(cell, COL_ROW);
+
+    dm_csv_field(out, name);
+    fputc(',', out);
+    if (range_row) {
+        char *label = sqlite3_mprintf("%s[%lld,%lld]", key, (long long)range_row,
+                                      (long long)sqlite3_column_int64(cell, COL_COL));
+        dm_csv_field(out, label ? label : key);
+        sqlite3_free(label);
+    } else {
+        dm_csv_field(out, key);
+    }
+    fprintf(out, ",%s,", status);
+    if (old)
+        dm_csv_field(out, (const char *)sqlite3_column_text(old, COL_TEXT));
+    fputc(',', out);
+    if (new)
+        dm_csv_field(out, (const char *)sqlite3_column_text(new, COL_TEXT));
+    fputc(',', out);
+    if (old && new && is_number(old) && is_number(new))
+        write_delta(out, old, new);
+    fputc('\n', out);
+}
+
+/* Merge return old_id against return new_id, either of which may be 0 for
+ * a workbook that is only on one side. */
+static int diff_pair(FILE *out, sqlite3_stmt *old, sqlite3_stmt *new, int64_t old_id, int64_t new_id,
+                     const char *name, struct diff_counts *counts)
+{
+    int rc_old = SQLITE_DONE, rc_new = SQLITE_DONE;
+
+    if (old_id) {
+        sqlite3_bind_int64(old, 1, old_id);
+        rc_old = sqlite3_step(old);
+    }
+    if (new_id) {
+        sqlite3_bind_int64(new, 1, new_id);
+        rc_new = sqlite3_step(new);
+    }
+    while (rc_old == SQLITE_ROW || rc_new == SQLITE_ROW) {
+        int c = rc_old != SQLITE_ROW ? 1 : rc_new != SQLITE_ROW ? -1 : compare_cells(old, new);
+        if (c < 0) {
+            write_change(out, name, old, "removed", old, NULL);
+            counts->removed++;
+            rc_old = sqlite3_step(old);
+        } else if (c > 0) {
+            write_change(out, name, new, "added", NULL, new);
+            counts->added++;
+            rc_new = sqlite3_step(new);
+        } else {
+            if (!same_value(old, new)) {
+                write_change(out, name, new, "changed", old, new);
+                counts->changed++;
+            }
+            rc_old = sqlite3_step(old);
+            rc_new = sqlite3_step(new);
+        }
+    }
+    sqlite3_reset(old);
+    sqlite3_reset(new);
+    return rc_old != SQLITE_DONE || rc_new != SQLITE_DONE;
+}
+
+// Pair up the two sides' returns by name, in one pass over both lists
+static int diff_sides(sqlite3 *db, FILE *out, const DmReturnRefs *a, const DmReturnRefs *b,
+                      struct diff_counts *counts)
+{
+    sqlite3_stmt *old, *new;
+    size_t i = 0, j = 0;
+    int err = 0;
+
+    int rc = sqlite3_prepare_v2(db, diff_sql, -1, &old, NULL);
+    dm_sql_check_error(rc, db);
+    rc = sqlite3_prepare_v2(db, diff_sql, -1, &new, NULL);
+    dm_sql_check_error(rc, db);
+
+    if (!a->batch) {
+        // one return against another, whatever they're called
+        err = diff_pair(out, old, new, a->refs[0].id, b->refs[0].id, b->refs[0].name, counts);
+    } else {
+        while (!err && (i < a->count || j < b->count)) {
+            int c = i == a->count ? 1 : j == b->count ? -1 : strcmp(a->refs[i].name, b->refs[j].name);
+            if (c < 0) {
+                err = diff_pair(out, old, new, a->refs[i].id, 0, a->refs[i].name, counts);
+                i++;
+            } else if (c > 0) {
+                err = diff_pair(out, old, new, 0, b->refs[j].id, b->refs[j].name, counts);
+                j++;
+            } else {
+                err = diff_pair(out, old, new, a->refs[i].id, b->refs[j].id, b->refs[j].name, counts);
+                i++;
+                j++;
+            }
+        }
+    }
+    if (err)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(old);
+    sqlite3_finalize(new);
+    return err;
+}
+
+/* Write the differences between old_spec and new_spec, both imported
+ * against the datamap dm_name, to output_file ("-" for standard output).
+ * Unless quiet, a count of them goes to standard error.
+ *
+ * Returns 0 on success, 1 on failure. */
+extern int dm_diff(char *dm_name, const char *old_spec, const char *new_spec, const char *output_file, int quiet)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    DmReturnRefs a, b;
+    struct diff_counts counts = {0, 0, 0};
+    int64_t dm_id = 0;
+    int to_stdout = strcmp(output_file, "-") == 0;
+
+    int rc = sqlite3_open("test.db", &db);
+    dm_sql_check_error(rc, db);
+
+    rc = sqlite3_prepare_v2(db, "SELECT MAX(id) FROM datamap WHERE name = ?", -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_text(stmt, 1, dm_name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        dm_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (dm_id == 0) {
+        fprintf(stderr, "No datamap called '%s' found in the database.\n", dm_name);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    // the view and indexes the merge relies on, on an older database
+    if (dm_upgrade_return_data(db) || dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK) {
+        sqlite3_close(db);
+        return 1;
+    }
+
+    // one read transaction, so both sides come from the same state
+    dm_exec_sql_stmt("BEGIN TRANSACTION;", db);
+    if (load_side(db, dm_id, old_spec, &a)) {
+        dm_free_return_refs(&a);
+        dm_exec_sql_stmt("COMMIT;", db);
+        sqlite3_close(db);
+        return 1;
+    }
+    int err = load_side(db, dm_id, new_spec, &b);
+    if (!err && a.batch != b.batch) {
+        fprintf(stderr, "Compare a return with a return, or a batch with a batch.\n");
+        err = 1;
+    }
+    if (err) {
+        dm_free_return_refs(&a);
+        dm_free_return_refs(&b);
+        dm_exec_sql_stmt("COMMIT;", db);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    FILE *out = to_stdout ? stdout : fopen(output_file, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot write to %s\n", output_file);
+        err = 1;
+    } else {
+        fputs("return,key,status,old,new,delta\n", out);
+        err = diff_sides(db, out, &a, &b, &counts);
+        if (!to_stdout)
+            err |= fclose(out) != 0;
+        else
+            fflush(stdout);
+    }
+    dm_exec_sql_stmt("COMMIT;", db);
+
+    if (!err && !quiet)
+        fprintf(stderr, "%zu changed, %zu added, %zu removed.\n", counts.changed, counts.added, counts.removed);
+    dm_free_return_refs(&a);
+    dm_free_return_refs(&b);
+    sqlite3_close(db);
+    return err;
+}
@@ -0,0 +1,527 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "reader.h"
+
+/* -- Compiled datamap cache -----------------------------
+ *
+ * Building a DmDatamap from SQLite means a query, a copy of every key and a
+ * cell index per sheet. We do that once, when a datamap is imported (or
+ * when we notice it has changed), and write the result out as a flat image
+ * next to the database:
+ *
+ *   DmcHeader | DmcSheet[nsheets] | DmcLine[nlines] | DmCellSlot[...] | ranges
+ *             | DmcRule[nrules] | string pool
+ *
+ * Every section is 8-byte aligned and strings are NUL-terminated offsets
+ * into the pool. Loading is an mmap, a checksum, a check that every offset
+ * and index stays inside the image, and pointer fix-ups; the cell indexes
+ * are used straight out of the mapping.
+ *
+ * The header carries a stamp of the SQLite datamap it was built from. If
+ * the stamp no longer matches, the image is rebuilt.
+ */
+
+#define DMC_MAGIC "DMAPC\0\0\0"
+#define DMC_VERSION 5 // 2: range lines, 3: validation rules, 4: checksum covers the header,
+                      // 5: keys sharing a cell
+#define DMC_NO_STRING UINT64_MAX
+
+typedef struct DmcHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int64_t dm_id;
+    uint64_t stamp;
+    uint64_t nsheets;
+    uint64_t nlines;
+    uint64_t nslots;
+    uint64_t nranges;
+    uint64_t nvalues;
+    uint64_t sheets_off;
+    uint64_t lines_off;
+    uint64_t slots_off;
+    uint64_t ranges_off;
+    uint64_t nrules;
+    uint64_t rules_off;
+    uint64_t pool_off;
+    uint64_t file_size;
+    uint64_t checksum; // of the whole image, with this zeroed
+} DmcHeader;
+
+typedef struct DmcSheet {
+    uint64_t name_off;
+    uint64_t first_line;
+    uint64_t nlines;
+    uint64_t slots_first;
+    uint64_t index_bits;
+    uint64_t index_count;
+    uint64_t first_range;
+    uint64_t nranges;
+    uint32_t min_row, max_row;
+    uint32_t min_col, max_col;
+} DmcSheet;
+
+typedef struct DmcLine {
+    int64_t id;
+    uint64_t key_off;
+    uint32_t sheet;
+    uint32_t row;
+    uint32_t col;
+    uint32_t last_row;
+    uint32_t last_col;
+    uint32_t value;
+    uint32_t rule;
+    uint32_t next;
+} DmcLine;
+
+// A DmRule without its compiled pattern, which is made again on loading
+typedef struct DmcRule {
+    uint32_t types;
+    uint32_t flags;
+    double min;
+    double max;
+    uint64_t pattern_off; // or DMC_NO_STRING
+    uint64_t allowed_off;
+} DmcRule;
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~(uint64_t)7;
+}
+
+// FNV-1a. Plenty to spot a torn or stale file.
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+// The checksum of an image: all of it, as if its checksum field were zero
+static uint64_t image_checksum(const char *image, size_t size)
+{
+    const uint64_t zero = 0;
+    size_t at = offsetof(DmcHeader, checksum);
+    uint64_t h = fnv1a(FNV_OFFSET, image, at);
+
+    h = fnv1a(h, &zero, sizeof(zero));
+    at += sizeof(zero);
+    return fnv1a(h, image + at, size - at);
+}
+
+// Whether count items of size bytes at off fit in an image of file_size bytes
+static int section_fits(uint64_t off, uint64_t count, size_t size, uint64_t file_size)
+{
+    return off % 8 == 0 && off >= sizeof(DmcHeader) && off <= file_size
+        && count <= (file_size - off) / size;
+}
+
+// Whether off is the start of a string in a pool of pool_size bytes
+static int string_fits(uint64_t off, uint64_t pool_size)
+{
+    return off < pool_size;
+}
+
+/* Whether every offset and index in an image whose header has checked out
+ * stays inside it, so nothing we load from it can point outside the
+ * mapping. */
+static int image_fits(const char *image, uint64_t file_size)
+{
+    const DmcHeader *hdr = (const DmcHeader *)image;
+
+    if (!section_fits(hdr->sheets_off, hdr->nsheets, sizeof(DmcSheet), file_size)
+            || !section_fits(hdr->lines_off, hdr->nlines, sizeof(DmcLine), file_size)
+            || !section_fits(hdr->slots_off, hdr->nslots, sizeof(DmCellSlot), file_size)
+            || !section_fits(hdr->ranges_off, hdr->nranges, sizeof(uint32_t), file_size)
+            || !section_fits(hdr->rules_off, hdr->nrules, sizeof(DmcRule), file_size)
+            || !section_fits(hdr->pool_off, 0, 1, file_size)
+            || hdr->nlines > UINT32_MAX || hdr->nvalues > UINT32_MAX)
+        return 0;
+
+    const DmcSheet *sheets = (const DmcSheet *)(image + hdr->sheets_off);
+    const DmcLine *lines = (const DmcLine *)(image + hdr->lines_off);
+    const DmCellSlot *slots = (const DmCellSlot *)(image + hdr->slots_off);
+    const uint32_t *ranges = (const uint32_t *)(image + hdr->ranges_off);
+    const DmcRule *rules = (const DmcRule *)(image + hdr->rules_off);
+    uint64_t pool_size = file_size - hdr->pool_off;
+
+    // then any offset into the pool is a terminated string
+    if (pool_size > 0 && image[file_size - 1] != '\0')
+        return 0;
+    for (uint64_t i = 0; i < hdr->nsheets; i++) {
+        const DmcSheet *s = &sheets[i];
+        if (!string_fits(s->name_off, pool_size)
+                || s->first_line > hdr->nlines || s->nlines > hdr->nlines - s->first_line
+                || s->first_range > hdr->nranges || s->nranges > hdr->nranges - s->first_range
+                || s->index_bits < DM_INDEX_MIN_BITS || s->index_bits >= 32 || s->slots_first > hdr->nslots
+                || ((uint64_t)1 << s->index_bits) > hdr->nslots - s->slots_first)
+            return 0;
+        // a lookup stops at an empty slot, so there has to be one
+        uint64_t cap = (uint64_t)1 << s->index_bits, used = 0;
+        for (uint64_t j = 0; j < cap; j++) {
+            const DmCellSlot *slot = &slots[s->slots_first + j];
+            if (slot->cell == 0)
+                continue;
+            if (slot->line >= hdr->nlines)
+                return 0;
+            used++;
+        }
+        if (used == cap || used != s->index_count)
+            return 0;
+    }
+    for (uint64_t i = 0; i < hdr->nlines; i++) {
+        const DmcLine *l = &lines[i];
+        if (!string_fits(l->key_off, pool_size) || l->sheet >= hdr->nsheets
+                || l->last_row < l->row || l->last_col < l->col || l->rule > hdr->nrules
+                || l->next > hdr->nlines || (l->next && l->next <= i + 1) // chains only go forward
+                || l->value > hdr->nvalues
+                || (uint64_t)(l->last_row - l->row + 1) * (l->last_col - l->col + 1) > hdr->nvalues - l->value)
+            return 0;
+    }
+    for (uint64_t i = 0; i < hdr->nranges; i++) {
+        if (ranges[i] >= hdr->nlines)
+            return 0;
+    }
+    for (uint64_t i = 0; i < hdr->nrules; i++) {
+        if ((rules[i].pattern_off != DMC_NO_STRING && !string_fits(rules[i].pattern_off, pool_size))
+                || (rules[i].allowed_off != DMC_NO_STRING && !string_fits(rules[i].allowed_off, pool_size)))
+            return 0;
+    }
+    return 1;
+}
+
+// Copy s, which may be NULL, into the pool, returning where it went
+static uint64_t pool_add(char *pool, uint64_t *used, const char *s)
+{
+    if (s == NULL)
+        return DMC_NO_STRING;
+    uint64_t off = *used;
+    size_t len = strlen(s) + 1;
+    memcpy(pool + off, s, len);
+    *used += len;
+    return off;
+}
+
+// Where the image for dm_name lives
+extern void dm_cache_path(const char *dm_name, char *buf, size_t size)
+{
+    uint64_t h = fnv1a(FNV_OFFSET, dm_name, strlen(dm_name));
+    snprintf(buf, size, "test.db-%016llx.dmc", (unsigned long long)h);
+}
+
+/* Cheaply identify the current state of datamap dm_name in the database,
+ * without reading every line into memory. Added or removed lines change the
+ * counts; edited ones bump datamap.revision through a trigger. Returns 1 if
+ * there is no such datamap. */
+static int datamap_stamp(sqlite3 *db, const char *dm_name, int64_t *dm_id, uint64_t *stamp)
+{
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT datamap.id, datamap.date_created, datamap.revision, COUNT(datamap_line.id),"
+                      "       COALESCE(MAX(datamap_line.id), 0),"
+                      "       COALESCE(SUM(length(datamap_line.key) + length(datamap_line.sheet)"
+                      "                    + length(datamap_line.cellref)), 0)"
+                      "  FROM datamap LEFT JOIN datamap_line ON datamap_line.dm_id = datamap.id"
+                      " WHERE datamap.id = (SELECT MAX(id) FROM datamap WHERE name = ?)"
+                      " GROUP BY datamap.id";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_text(stmt, 1, dm_name, -1, SQLITE_TRANSIENT);
+
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        sqlite3_finalize(stmt);
+        return 1;
+    }
+    uint64_t h = FNV_OFFSET;
+    for (int i = 0; i < 6; i++) {
+        int64_t n = sqlite3_column_int64(stmt, i);
+        const unsigned char *text = sqlite3_column_text(stmt, i);
+        h = fnv1a(h, &n, sizeof(n));
+        if (text)
+            h = fnv1a(h, text, strlen((const char *)text));
+    }
+    *dm_id = sqlite3_column_int64(stmt, 0);
+    *stamp = h;
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+/* Write dm out as an image for dm_name. The file is written under a
+ * temporary name and renamed into place, so a concurrent reader sees
+ * either the old image or the new one. Returns 0 on success. */
+extern int dm_cache_write(const DmDatamap *dm, const char *dm_name, uint64_t stamp)
+{
+    DmcHeader hdr;
+    uint64_t nslots = 0, pool_size = 0;
+
+    for (size_t i = 0; i < dm->nsheets; i++) {
+        nslots += (uint64_t)1 << dm->sheets[i].index.bits;
+        pool_size += strlen(dm->sheets[i].name) + 1;
+    }
+    for (size_t i = 0; i < dm->nlines; i++)
+        pool_size += strlen(dm->lines[i].key) + 1;
+    for (size_t i = 0; i < dm->nrules; i++) {
+        if (dm->rules[i].pattern)
+            pool_size += strlen(dm->rules[i].pattern) + 1;
+        if (dm->rules[i].allowed)
+            pool_size += strlen(dm->rules[i].allowed) + 1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DMC_MAGIC, 8);
+    hdr.version = DMC_VERSION;
+    hdr.header_size = sizeof(DmcHeader);
+    hdr.dm_id = dm->id;
+    hdr.stamp = stamp;
+    hdr.nsheets = dm->nsheets;
+    hdr.nlines = dm->nlines;
+    hdr.nslots = nslots;
+    hdr.nranges = dm->nranges;
+    hdr.nvalues = dm->nvalues;
+    hdr.sheets_off = align8(sizeof(DmcHeader));
+    hdr.lines_off = align8(hdr.sheets_off + dm->nsheets * sizeof(DmcSheet));
+    hdr.slots_off = align8(hdr.lines_off + dm->nlines * sizeof(DmcLine));
+    hdr.ranges_off = align8(hdr.slots_off + nslots * sizeof(DmCellSlot));
+    hdr.nrules = dm->nrules;
+    hdr.rules_off = align8(hdr.ranges_off + dm->nranges * sizeof(uint32_t));
+    hdr.pool_off = align8(hdr.rules_off + dm->nrules * sizeof(DmcRule));
+    hdr.file_size = hdr.pool_off + pool_size;
+
+    char *image = calloc(1, hdr.file_size);
+    if (image == NULL)
+        return 1;
+
+    DmcSheet *sheets = (DmcSheet *)(image + hdr.sheets_off);
+    DmcLine *lines = (DmcLine *)(image + hdr.lines_off);
+    DmCellSlot *slots = (DmCellSlot *)(image + hdr.slots_off);
+    uint32_t *ranges = (uint32_t *)(image + hdr.ranges_off);
+    DmcRule *rules = (DmcRule *)(image + hdr.rules_off);
+    char *pool = image + hdr.pool_off;
+    uint64_t pool_used = 0, slots_used = 0;
+
+    for (size_t i = 0; i < dm->nsheets; i++) {
+        const DmSheet *s = &dm->sheets[i];
+        size_t len = strlen(s->name) + 1;
+        size_t cap = (size_t)1 << s->index.bits;
+
+        sheets[i].name_off = pool_used;
+        memcpy(pool + pool_used, s->name, len);
+        pool_used += len;
+        sheets[i].first_line = s->first_line;
+        sheets[i].nlines = s->nlines;
+        sheets[i].slots_first = slots_used;
+        sheets[i].index_bits = s->index.bits;
+        sheets[i].index_count = s->index.count;
+        sheets[i].first_range = s->first_range;
+        sheets[i].nranges = s->nranges;
+        sheets[i].min_row = s->min_row;
+        sheets[i].max_row = s->max_row;
+        sheets[i].min_col = s->min_col;
+        sheets[i].max_col = s->max_col;
+        // copy field by field so struct padding is always zero
+        for (size_t j = 0; j < cap; j++) {
+            slots[slots_used + j].cell = s->index.slots[j].cell;
+            slots[slots_used + j].line = s->index.slots[j].line;
+        }
+        slots_used += cap;
+    }
+    for (size_t i = 0; i < dm->nlines; i++) {
+        const DmLine *l = &dm->lines[i];
+        size_t len = strlen(l->key) + 1;
+
+        lines[i].id = l->id;
+        lines[i].key_off = pool_used;
+        memcpy(pool + pool_used, l->key, len);
+        pool_used += len;
+        lines[i].sheet = l->sheet;
+        lines[i].row = l->row;
+        lines[i].col = l->col;
+        lines[i].last_row = l->last_row;
+        lines[i].last_col = l->last_col;
+        lines[i].value = l->value;
+        lines[i].rule = l->rule;
+        lines[i].next = l->next;
+    }
+    if (dm->nranges)
+        memcpy(ranges, dm->ranges, dm->nranges * sizeof(uint32_t));
+    for (size_t i = 0; i < dm->nrules; i++) {
+        const DmRule *rule = &dm->rules[i];
+        rules[i].types = rule->types;
+        rules[i].flags = rule->flags;
+        rules[i].min = rule->min;
+        rules[i].max = rule->max;
+        rules[i].pattern_off = pool_add(pool, &pool_used, rule->pattern);
+        rules[i].allowed_off = pool_add(pool, &pool_used, rule->allowed);
+    }
+
+    memcpy(image, &hdr, sizeof(hdr));
+    hdr.checksum = image_checksum(image, hdr.file_size);
+    memcpy(image + offsetof(DmcHeader, checksum), &hdr.checksum, sizeof(hdr.checksum));
+
+    char path[512], tmp[540];
+    dm_cache_path(dm_name, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    int failed = f == NULL || fwrite(image, 1, hdr.file_size, f) != hdr.file_size;
+    if (f && fclose(f) != 0)
+        failed = 1;
+    free(image);
+    if (failed || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/* Map the image for dm_name and point dm into it. Returns 0 on success and
+ * 1 if there is no usable image with the expected stamp. */
+extern int dm_cache_read(const char *dm_name, uint64_t stamp, DmDatamap *dm)
+{
+    char path[512];
+    struct stat st;
+
+    dm_cache_path(dm_name, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DmcHeader)) {
+        close(fd);
+        return 1;
+    }
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return 1;
+
+    const DmcHeader *hdr = (const DmcHeader *)image;
+    if (memcmp(hdr->magic, DMC_MAGIC, 8) != 0 || hdr->version != DMC_VERSION
+            || hdr->header_size != sizeof(DmcHeader) || hdr->file_size != (uint64_t)st.st_size
+            || hdr->stamp != stamp
+            || hdr->checksum != image_checksum(image, st.st_size)
+            || !image_fits(image, st.st_size)) {
+        munmap(image, st.st_size);
+        return 1;
+    }
+
+    const DmcSheet *sheets = (const DmcSheet *)(image + hdr->sheets_off);
+    const DmcLine *lines = (const DmcLine *)(image + hdr->lines_off);
+    DmCellSlot *slots = (DmCellSlot *)(image + hdr->slots_off);
+    uint32_t *ranges = (uint32_t *)(image + hdr->ranges_off);
+    const DmcRule *rules = (const DmcRule *)(image + hdr->rules_off);
+    char *pool = image + hdr->pool_off;
+
+    memset(dm, 0, sizeof(DmDatamap));
+    dm->id = hdr->dm_id;
+    dm->nsheets = hdr->nsheets;
+    dm->nlines = hdr->nlines;
+    dm->ranges = ranges;
+    dm->nranges = hdr->nranges;
+    dm->nvalues = hdr->nvalues;
+    dm->nrules = hdr->nrules;
+    dm->sheets = calloc(hdr->nsheets ? hdr->nsheets : 1, sizeof(DmSheet));
+    dm->lines = calloc(hdr->nlines ? hdr->nlines : 1, sizeof(DmLine));
+    // the rules get compiled patterns, so they can't stay in the mapping
+    dm->rules = calloc(hdr->nrules ? hdr->nrules : 1, sizeof(DmRule));
+    dm->image = image;
+    dm->image_size = st.st_size;
+    if (dm->sheets == NULL || dm->lines == NULL || dm->rules == NULL) {
+        dm_datamap_free(dm);
+        return 1;
+    }
+
+    for (size_t i = 0; i < dm->nsheets; i++) {
+        DmSheet *s = &dm->sheets[i];
+        s->name = pool + sheets[i].name_off;
+        s->first_line = sheets[i].first_line;
+        s->nlines = sheets[i].nlines;
+        s->min_row = sheets[i].min_row;
+        s->max_row = sheets[i].max_row;
+        s->min_col = sheets[i].min_col;
+        s->max_col = sheets[i].max_col;
+        s->index.slots = slots + sheets[i].slots_first;
+        s->index.bits = sheets[i].index_bits;
+        s->index.count = sheets[i].index_count;
+        s->first_range = sheets[i].first_range;
+        s->nranges = sheets[i].nranges;
+    }
+    for (size_t i = 0; i < dm->nlines; i++) {
+        DmLine *l = &dm->lines[i];
+        l->id = lines[i].id;
+        l->key = pool + lines[i].key_off;
+        l->sheet = lines[i].sheet;
+        l->row = lines[i].row;
+        l->col = lines[i].col;
+        l->last_row = lines[i].last_row;
+        l->last_col = lines[i].last_col;
+        l->value = lines[i].value;
+        l->rule = lines[i].rule;
+        l->next = lines[i].next;
+    }
+    for (size_t i = 0; i < dm->nrules; i++) {
+        DmRule *rule = &dm->rules[i];
+        rule->types = rules[i].types;
+        rule->flags = rules[i].flags;
+        rule->min = rules[i].min;
+        rule->max = rules[i].max;
+        if (rules[i].pattern_off != DMC_NO_STRING)
+            rule->pattern = pool + rules[i].pattern_off;
+        if (rules[i].allowed_off != DMC_NO_STRING)
+            rule->allowed = pool + rules[i].allowed_off;
+    }
+    return 0;
+}
+
+/* Rebuild the image for dm_name from the database. Called after a datamap
+ * import so the first spreadsheet import finds it ready. */
+extern int dm_cache_rebuild(sqlite3 *db, char *dm_name)
+{
+    DmDatamap dm;
+    int64_t dm_id;
+    uint64_t stamp;
+
+    if (dm_upgrade_datamap_line(db) || datamap_stamp(db, dm_name, &dm_id, &stamp))
+        return 1;
+    if (get_all_sheet_and_cellrefs_from_datamap_in_sqlite3(db, dm_name, &dm))
+        return 1;
+    int rc = dm_cache_write(&dm, dm_name, stamp);
+    dm_datamap_free(&dm);
+    return rc;
+}
+
+/* Get datamap dm_name ready for extraction: from its image if that is
+ * current, otherwise from SQLite, refreshing the image as we go. */
+extern int dm_load_datamap(sqlite3 *db, char *dm_name, DmDatamap *dm)
+{
+    int64_t dm_id;
+    uint64_t stamp;
+
+    memset(dm, 0, sizeof(DmDatamap));
+    if (dm_upgrade_datamap_line(db))
+        return 1;
+    if (datamap_stamp(db, dm_name, &dm_id, &stamp)) {
+        fprintf(stderr, "No datamap called '%s' found in the database.\n", dm_name);
+        return 1;
+    }
+    if (dm_cache_read(dm_name, stamp, dm) != 0 || dm->id != dm_id) {
+        if (dm->image)
+            dm_datamap_free(dm);
+        if (get_all_sheet_and_cellrefs_from_datamap_in_sqlite3(db, dm_name, dm))
+            return 1;
+        if (dm_cache_write(dm, dm_name, stamp))
+            fprintf(stderr, "Unable to write compiled datamap for '%s'.\n", dm_name);
+    }
+    // patterns are compiled afresh every time, wherever the rules came from
+    if (dm_datamap_compile_rules(dm)) {
+        dm_datamap_free(dm);
+        return 1;
+    }
+    return 0;
+}
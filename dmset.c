@@ -0,0 +1,247 @@
+#include "reader.h"
+
+/* -- Datamap sets -----------------------------
+ *
+ * Applying several datamaps (this quarter's, last quarter's template, an
+ * ad-hoc analysis map) to the same returns shouldn't mean reading every
+ * workbook once per datamap. A DmDatamapSet merges them into one more
+ * DmDatamap, with a line for every distinct cell or range on a sheet that
+ * any of them wants, and records which merged line each datamap's lines come
+ * from. A workbook is extracted once against the merged datamap and
+ * dm_datamap_set_values() then hands each datamap its own values.
+ *
+ * The merged datamap's lines are not grouped by sheet (a sheet's cells
+ * arrive from each datamap in turn), so only its indexes, range lists and
+ * bounding boxes mean anything; it is for extracting with and nothing else.
+ *
+ * A merged line carries the rule of every datamap line it stands for,
+ * chained through DmRule.next, so a value is checked against each datamap's
+ * rule; dm_datamap_set_failures() sorts the failures out again.
+ *
+ * With a single datamap there is nothing to merge and it is extracted
+ * against directly.
+ */
+
+// The index of the merged sheet called name, adding it if it is new
+static int merged_sheet(DmDatamap *merged, size_t *size, const char *name, size_t *index)
+{
+    for (size_t i = 0; i < merged->nsheets; i++) {
+        if (strcmp(merged->sheets[i].name, name) == 0) {
+            *index = i;
+            return 0;
+        }
+    }
+    if (merged->nsheets == *size) {
+        *size = *size ? *size * 2 : 8;
+        DmSheet *sheets = realloc(merged->sheets, *size * sizeof(DmSheet));
+        if (sheets == NULL)
+            return 1;
+        merged->sheets = sheets;
+    }
+    DmSheet *sheet = &merged->sheets[merged->nsheets];
+    memset(sheet, 0, sizeof(DmSheet));
+    sheet->name = dm_arena_strdup(&merged->arena, name);
+    sheet->min_row = sheet->min_col = UINT32_MAX;
+    if (sheet->name == NULL || dm_index_init(&sheet->index, 64))
+        return 1;
+    *index = merged->nsheets++;
+    return 0;
+}
+
+// Chain datamap d's line i's rule onto merged line m's
+static void merge_rule(DmDatamapSet *set, size_t d, size_t i, uint32_t m)
+{
+    const DmDatamap *dm = &set->dms[d];
+    DmLine *cell = &set->merged.lines[m];
+
+    if (dm->lines[i].rule == 0)
+        return;
+    DmRule *rule = &set->merged.rules[set->merged.nrules];
+    // the compiled pattern stays with dm
+    *rule = dm->rules[dm->lines[i].rule - 1];
+    rule->owner = (uint32_t)d;
+    rule->owner_line = (uint32_t)i;
+    rule->next = cell->rule;
+    cell->rule = (uint32_t)++set->merged.nrules;
+}
+
+static int merge_datamaps(DmDatamapSet *set)
+{
+    DmDatamap *merged = &set->merged;
+    size_t sheets_size = 0, total = 0, nrules = 0;
+
+    for (size_t d = 0; d < set->ndms; d++) {
+        total += set->dms[d].nlines;
+        nrules += set->dms[d].nrules;
+    }
+    // there can't be more distinct cells than lines
+    merged->lines = calloc(total ? total : 1, sizeof(DmLine));
+    merged->rules = calloc(nrules ? nrules : 1, sizeof(DmRule));
+    set->merged_line = calloc(set->ndms, sizeof(uint32_t *));
+    if (merged->lines == NULL || merged->rules == NULL || set->merged_line == NULL)
+        return 1;
+
+    for (size_t d = 0; d < set->ndms; d++) {
+        const DmDatamap *dm = &set->dms[d];
+        uint32_t *map = calloc(dm->nlines ? dm->nlines : 1, sizeof(uint32_t));
+        if (map == NULL)
+            return 1;
+        set->merged_line[d] = map;
+
+        for (size_t s = 0; s < dm->nsheets; s++) {
+            size_t m;
+            if (merged_sheet(merged, &sheets_size, dm->sheets[s].name, &m))
+                return 1;
+            DmSheet *sheet = &merged->sheets[m];
+
+            size_t end = dm->sheets[s].first_line + dm->sheets[s].nlines;
+            for (size_t i = dm->sheets[s].first_line; i < end; i++) {
+                const DmLine *line = &dm->lines[i];
+                long found = -1;
+                if (DM_LINE_IS_RANGE(line)) {
+                    // the same table in another datamap
+                    for (size_t j = 0; j < merged->nlines && found < 0; j++) {
+                        const DmLine *l = &merged->lines[j];
+                        if (l->sheet == m && l->row == line->row && l->col == line->col
+                                && l->last_row == line->last_row && l->last_col == line->last_col)
+                            found = (long)j;
+                    }
+                } else {
+                    const DmCellSlot *slot = dm_index_find(&sheet->index, line->row, line->col);
+                    if (slot)
+                        found = slot->line;
+                }
+                if (found >= 0) {
+                    map[i] = (uint32_t)found;
+                    merge_rule(set, d, i, map[i]);
+                    continue;
+                }
+                // the first datamap to want a cell names it
+                DmLine *cell = &merged->lines[merged->nlines];
+                cell->id = 0;
+                cell->key = line->key;
+                cell->sheet = (uint32_t)m;
+                cell->row = line->row;
+                cell->col = line->col;
+                cell->last_row = line->last_row;
+                cell->last_col = line->last_col;
+                if (!DM_LINE_IS_RANGE(line)
+                        && dm_index_add(&sheet->index, line->row, line->col, (uint32_t)merged->nlines))
+                    return 1;
+                map[i] = (uint32_t)merged->nlines++;
+                merge_rule(set, d, i, map[i]);
+
+                if (line->row < sheet->min_row) sheet->min_row = line->row;
+                if (line->last_row > sheet->max_row) sheet->max_row = line->last_row;
+                if (line->col < sheet->min_col) sheet->min_col = line->col;
+                if (line->last_col > sheet->max_col) sheet->max_col = line->last_col;
+                sheet->nlines++;
+            }
+        }
+    }
+    return dm_datamap_layout(merged);
+}
+
+/* Load the datamaps called names[0..nnames) and merge them for extraction.
+ * set->extract points into set, so set must stay where it is.
+ *
+ * Returns 0 on success, 1 if any datamap could not be loaded. */
+extern int dm_load_datamap_set(sqlite3 *db, char **names, size_t nnames, DmDatamapSet *set)
+{
+    memset(set, 0, sizeof(DmDatamapSet));
+    set->dms = calloc(nnames ? nnames : 1, sizeof(DmDatamap));
+    if (set->dms == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for (size_t d = 0; d < nnames; d++) {
+        for (size_t e = 0; e < d; e++) {
+            if (strcmp(names[d], names[e]) == 0) {
+                fprintf(stderr, "Datamap '%s' is named more than once.\n", names[d]);
+                dm_datamap_set_free(set);
+                return 1;
+            }
+        }
+        if (dm_load_datamap(db, names[d], &set->dms[d])) {
+            dm_datamap_set_free(set);
+            return 1;
+        }
+        set->ndms++;
+    }
+
+    if (set->ndms == 1) {
+        set->extract = &set->dms[0];
+        return 0;
+    }
+    if (merge_datamaps(set)) {
+        fprintf(stderr, "Out of memory.\n");
+        dm_datamap_set_free(set);
+        return 1;
+    }
+    set->extract = &set->merged;
+    return 0;
+}
+
+/* Fill out (sized to set->dms[d].nvalues) with datamap d's share of values,
+ * which were extracted against set->extract. Returns how many are set. */
+extern size_t dm_datamap_set_values(const DmDatamapSet *set, size_t d, const char **values, const char **out)
+{
+    const DmDatamap *dm = &set->dms[d];
+    size_t nmatched = 0;
+
+    for (size_t i = 0; i < dm->nlines; i++) {
+        const DmLine *line = &dm->lines[i];
+        // a merged line covers exactly the same cells
+        uint32_t from = set->merged_line ? set->merged.lines[set->merged_line[d][i]].value : line->value;
+        for (uint32_t k = 0; k < DM_LINE_CELLS(line); k++) {
+            out[line->value + k] = values[from + k];
+            if (out[line->value + k])
+                nmatched++;
+        }
+    }
+    return nmatched;
+}
+
+/* Copy to out the failures, from extracting against set->extract, that
+ * belong to datamap d, with lines, slots and rules made its own. out must
+ * have room for n. Returns how many there are. */
+extern size_t dm_datamap_set_failures(const DmDatamapSet *set, size_t d, const DmCheckFailure *failures, size_t n,
+                                      DmCheckFailure *out)
+{
+    if (set->merged_line == NULL) {
+        if (n)
+            memcpy(out, failures, n * sizeof(DmCheckFailure));
+        return n;
+    }
+
+    const DmDatamap *dm = &set->dms[d];
+    size_t nout = 0;
+    for (size_t i = 0; i < n; i++) {
+        const DmRule *rule = &set->merged.rules[failures[i].rule];
+        if (rule->owner != d)
+            continue;
+        const DmLine *line = &dm->lines[rule->owner_line];
+        DmCheckFailure *f = &out[nout++];
+        f->line = rule->owner_line;
+        // the same cell in a range is the same distance in
+        f->slot = line->value + (failures[i].slot - set->merged.lines[failures[i].line].value);
+        f->rule = line->rule - 1;
+        f->why = failures[i].why;
+    }
+    return nout;
+}
+
+extern void dm_datamap_set_free(DmDatamapSet *set)
+{
+    if (set->merged_line) {
+        for (size_t d = 0; d < set->ndms; d++)
+            free(set->merged_line[d]);
+        free(set->merged_line);
+    }
+    // merged keys belong to the datamaps they came from
+    dm_datamap_free(&set->merged);
+    for (size_t d = 0; d < set->ndms; d++)
+        dm_datamap_free(&set->dms[d]);
+    free(set->dms);
+    memset(set, 0, sizeof(DmDatamapSet));
+}
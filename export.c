@@ -0,0 +1,264 @@
+#include <unistd.h>
+#include <xlsxio_write.h>
+#include "reader.h"
+
+/* -- Exporting a master -----------------------------
+ *
+ * A master is the datamap turned on its side: one row per datamap key,
+ * one column per return imported against it. A range line gets a row for
+ * each cell of its table that any return has a value for, labelled
+ * "key[row,col]" counting from 1. It is streamed straight out
+ * of SQLite, a row at a time, by walking a single query ordered by
+ * (line, cell, return) alongside the list of returns, which gives the column
+ * order. Only the list of return ids is held in memory, so the size of
+ * the master doesn't matter.
+ *
+ * Output is CSV, or xlsx (through xlsxio's writer) when the file name
+ * ends in .xlsx. In xlsx numbers are written as numbers; CSV gets every
+ * value as the text it was read as.
+ */
+
+struct master_out {
+    xlsxiowriter xlsx; // one of these two is set
+    FILE *csv;
+    int first_in_row;
+};
+
+// s as one CSV field, quoted if it needs to be
+extern void dm_csv_field(FILE *f, const char *s)
+{
+    if (strpbrk(s, ",\"\r\n") == NULL) {
+        fputs(s, f);
+        return;
+    }
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"')
+            fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void out_text(struct master_out *out, const char *s)
+{
+    if (out->xlsx) {
+        xlsxiowrite_add_cell_string(out->xlsx, s);
+        return;
+    }
+    if (!out->first_in_row)
+        fputc(',', out->csv);
+    out->first_in_row = 0;
+    if (s)
+        dm_csv_field(out->csv, s);
+}
+
+// The value column of a return_value row (value, vtype, text)
+static void out_value(struct master_out *out, sqlite3_stmt *stmt, int col)
+{
+    if (out->xlsx) {
+        switch (sqlite3_column_int(stmt, col + 1)) {
+            case DM_VALUE_INTEGER:
+                xlsxiowrite_add_cell_int(out->xlsx, sqlite3_column_int64(stmt, col));
+                return;
+            case DM_VALUE_REAL:
+                xlsxiowrite_add_cell_float(out->xlsx, sqlite3_column_double(stmt, col));
+                return;
+        }
+    }
+    out_text(out, (const char *)sqlite3_column_text(stmt, col + 2));
+}
+
+static void out_next_row(struct master_out *out)
+{
+    if (out->xlsx)
+        xlsxiowrite_next_row(out->xlsx);
+    else
+        fputc('\n', out->csv);
+    out->first_in_row = 1;
+}
+
+// The returns against dm_id, in id order, for the header and column order
+static int master_columns(sqlite3 *db, int64_t dm_id, struct master_out *out, int64_t **ids, size_t *nids)
+{
+    sqlite3_stmt *stmt;
+    size_t size = 0;
+    int rc;
+
+    *ids = NULL;
+    *nids = 0;
+    rc = sqlite3_prepare_v2(db, "SELECT id, file FROM return WHERE dm_id = ? ORDER BY id", -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_int64(stmt, 1, dm_id);
+
+    out_text(out, "key");
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (*nids == size) {
+            size = size ? size * 2 : 64;
+            int64_t *p = realloc(*ids, size * sizeof(int64_t));
+            if (p == NULL)
+                break;
+            *ids = p;
+        }
+        (*ids)[(*nids)++] = sqlite3_column_int64(stmt, 0);
+
+        const char *file = (const char *)sqlite3_column_text(stmt, 1);
+        const char *base = strrchr(file, '/');
+        out_text(out, base ? base + 1 : file);
+    }
+    sqlite3_finalize(stmt);
+    out_next_row(out);
+    return rc != SQLITE_DONE;
+}
+
+/* Every line, with its values (if any) by cell and in return order. The
+ * lines are read in id order (NOT INDEXED, or datamap_line_key would give
+ * them by key) and each one's values come from return_data_by_line in the
+ * order wanted, so rows stream out with nothing to sort. return_data is
+ * joined rather than return_value: LEFT JOINing that view, itself a LEFT
+ * JOIN, stops it being flattened and the whole view is built first. The
+ * value column is only read for numbers, which don't need the text. */
+const char *dm_sql_str_master_values = "SELECT l.id, l.key, d.range_row, d.range_col,"
+                                       "       d.return_id, d.value, d.vtype, " DM_SQL_RETURN_TEXT
+                                       "  FROM datamap_line AS l NOT INDEXED"
+                                       "  LEFT JOIN return_data AS d ON d.datamap_line_id = l.id"
+                                       "  LEFT JOIN value AS v ON v.id = d.value_id"
+                                       " WHERE l.dm_id = ?"
+                                       " ORDER BY l.id, d.range_row, d.range_col, d.return_id";
+
+static int write_master(sqlite3 *db, int64_t dm_id, struct master_out *out)
+{
+    sqlite3_stmt *stmt;
+    int64_t *ids;
+    size_t nids, col = 0;
+    int64_t line = 0, range_row = 0, range_col = 0;
+    int rc, started = 0;
+
+    if (master_columns(db, dm_id, out, &ids, &nids)) {
+        fprintf(stderr, "Unable to read the returns for this datamap.\n");
+        free(ids);
+        return 1;
+    }
+
+    rc = sqlite3_prepare_v2(db, dm_sql_str_master_values, -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_int64(stmt, 1, dm_id);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int64_t this_line = sqlite3_column_int64(stmt, 0);
+        int64_t this_row = sqlite3_column_int64(stmt, 2);
+        int64_t this_col = sqlite3_column_int64(stmt, 3);
+        if (!started || this_line != line || this_row != range_row || this_col != range_col) {
+            if (started) {
+                for (; col < nids; col++)
+                    out_text(out, NULL);
+                out_next_row(out);
+            }
+            started = 1;
+            line = this_line;
+            range_row = this_row;
+            range_col = this_col;
+            col = 0;
+            const char *key = (const char *)sqlite3_column_text(stmt, 1);
+            if (range_row) {
+                char *label = sqlite3_mprintf("%s[%lld,%lld]", key, (long long)range_row, (long long)range_col);
+                out_text(out, label ? label : key);
+                sqlite3_free(label);
+            } else {
+                out_text(out, key);
+            }
+        }
+        if (sqlite3_column_type(stmt, 4) == SQLITE_NULL)
+            continue; // a line nothing has a value for
+        int64_t return_id = sqlite3_column_int64(stmt, 4);
+        while (col < nids && ids[col] < return_id) {
+            out_text(out, NULL);
+            col++;
+        }
+        if (col < nids && ids[col] == return_id) {
+            out_value(out, stmt, 5);
+            col++;
+        }
+    }
+    if (started) {
+        for (; col < nids; col++)
+            out_text(out, NULL);
+        out_next_row(out);
+    }
+    sqlite3_finalize(stmt);
+    free(ids);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error #%d: %s\n", rc, sqlite3_errmsg(db));
+        return 1;
+    }
+    return 0;
+}
+
+static int ends_with(const char *s, const char *suffix)
+{
+    size_t len = strlen(s), slen = strlen(suffix);
+    return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+/* Export the master for the datamap dm_name to output_file: CSV, or xlsx
+ * if the name ends in .xlsx. "-" is CSV on standard output.
+ *
+ * Returns 0 on success, 1 on failure. */
+extern int dm_export_master(char *dm_name, const char *output_file)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    struct master_out out = {NULL, NULL, 1};
+    int64_t dm_id = 0;
+    int to_stdout = strcmp(output_file, "-") == 0;
+
+    int rc = sqlite3_open("test.db", &db);
+    dm_sql_check_error(rc, db);
+
+    rc = sqlite3_prepare_v2(db, "SELECT MAX(id) FROM datamap WHERE name = ?", -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_text(stmt, 1, dm_name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        dm_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (dm_id == 0) {
+        fprintf(stderr, "No datamap called '%s' found in the database.\n", dm_name);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    // the view and indexes the query relies on, on an older database
+    if (dm_upgrade_return_data(db) || dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK) {
+        sqlite3_close(db);
+        return 1;
+    }
+
+    if (!to_stdout && ends_with(output_file, ".xlsx")) {
+        unlink(output_file); // xlsxio won't write over a file
+        out.xlsx = xlsxiowrite_open(output_file, "Master");
+        if (out.xlsx)
+            xlsxiowrite_set_detection_rows(out.xlsx, 0); // don't hold rows back to size columns
+    } else {
+        out.csv = to_stdout ? stdout : fopen(output_file, "w");
+    }
+    if (out.xlsx == NULL && out.csv == NULL) {
+        fprintf(stderr, "Cannot write to %s\n", output_file);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    // one read transaction, so the header and the rows agree
+    dm_exec_sql_stmt("BEGIN TRANSACTION;", db);
+    int err = write_master(db, dm_id, &out);
+    dm_exec_sql_stmt("COMMIT;", db);
+
+    if (out.xlsx)
+        err |= xlsxiowrite_close(out.xlsx) != 0;
+    else if (!to_stdout)
+        err |= fclose(out.csv) != 0;
+    else
+        fflush(stdout);
+    sqlite3_close(db);
+    return err;
+}
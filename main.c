@@ -14,11 +14,13 @@ const char *argp_program_bug_address = "datamaps@twentyfoursoftware.com";
 static char doc[] = "datamaps -- extract data from spreadsheets using key values stored in CSV files! That is it.";
 
 // A description of the arguments we accept
-static char args_doc[] = "datamap|import";
+static char args_doc[] = "datamap|import|export|watch [DIR]|diff [OLD NEW]|query [KEY...]|snapshot FILE";
 
 // Keys for options without short options
 #define OPT_ABORT 1  // --abort
 
+#define MAX_DM_NAMES 16 // --name can be given this many times
+
 // https://stackoverflow.com/questions/47727755/gnu-argp-how-to-parse-option-with-only-long-name
 // We use enums for setting long-only options here. The first one is set to
 // 0x100 (256) - anything following doesn't need to be declared - they will go
@@ -29,6 +31,16 @@ enum datamap_options {
     DM_OVERWRITE, // we want to start again with this datamap (DROP TABLE first)
     DM_INITIAL, // this has the same effect as DM_OVERWRITE in that it creates the db tables for the first time
     DM_IMPORT_SPREADSHEETS, // we import spreadsheets!
+    DM_JOBS, // how many threads to extract with
+    DM_FORCE, // import spreadsheets even if they haven't changed
+    DM_STATS, // report where the import spent its time
+    DM_SHEET_THREADS, // how many threads to read one workbook's sheets with
+    DM_BUNDLE, // import the workbooks in a zip or tar file
+    DM_BULK, // stage the batch and publish it in one transaction
+    DM_RETURN, // the return to query
+    DM_FORMAT, // how to write query results
+    DM_READ, // read a snapshot rather than write one
+    DM_AS, // what a spreadsheet or bundle on stdin is stored as
 };
 
 //The options we understand
@@ -40,15 +52,31 @@ static struct argp_option options[] = {
 
     { 0,0,0,0, "Datamap options: (when calling 'datamaps datamap')." },
     {"import", DM_IMPORT, "PATH", 0, "PATH to datamap file to import."},
-    {"name", DM_NAME, "NAME", 0, "The name you want to give to the imported datamap."},
+    {"name", DM_NAME, "NAME", 0, "The name you want to give to the imported datamap. When importing or watching spreadsheets, give --name more than once to apply several datamaps in one pass."},
     {"overwrite", DM_OVERWRITE, 0, 0, "Start fresh with this datamap (erases existing datamap data)."},
     {"initial", DM_INITIAL, 0, 0, "This option must be used where no datamap table yet exists."},
 
     { 0,0,0,0, "Relating to importing spreadsheets" },
-    {"spreadsheet", DM_IMPORT_SPREADSHEETS, "PATH", 0, "PATH to spreadsheet to import."},
+    {"spreadsheet", DM_IMPORT_SPREADSHEETS, "PATH", 0, "PATH to spreadsheet to import. PATH can also be a directory, a quoted glob such as 'returns/*.xlsx', or - to read one spreadsheet from standard input (give it a name with --as)."},
+    {"bundle", DM_BUNDLE, "PATH", 0, "Import every spreadsheet in the zip, tar or .tar.gz file at PATH (- for standard input, with --as) without unpacking it."},
+    {"as", DM_AS, "NAME", 0, "Store the spreadsheet read from standard input as NAME, or a bundle's spreadsheets as NAME/member. A later import under the same NAME replaces it."},
+    {"jobs", DM_JOBS, "N", 0, "Extract with N threads (default: one per CPU)."},
+    {"sheet-threads", DM_SHEET_THREADS, "N", 0, "Read the sheets of each spreadsheet with N threads (default 1). Helps with one big spreadsheet; with many, use --jobs."},
+    {"bulk", DM_BULK, 0, 0, "Load the spreadsheets into a staging database without journaling or fsync, then publish them into the database in one transaction. Nothing is visible until the whole batch is in."},
+    {"force", DM_FORCE, 0, 0, "Re-import spreadsheets that have not changed since they were last imported."},
+    {"stats", DM_STATS, "FORMAT", OPTION_ARG_OPTIONAL, "Report timings and counters for each phase of the import on standard error, or in the --output file if one is given. FORMAT is 'text' (the default) or 'json'."},
+
+    { 0,0,0,0, "Comparing returns: 'datamaps diff OLD NEW', where each is a return id, a spreadsheet or the directory or bundle a batch was imported from. Use --name for the datamap." },
+
+    { 0,0,0,0, "Querying returns: 'datamaps query [KEY...]' looks up each KEY (- reads them one per line from standard input) in every return, or in the --return given; with no KEY, everything in that return. Use --name for the datamap." },
+    {"return", DM_RETURN, "RETURN", 0, "The return to query: a return id or a spreadsheet as it was imported. For snapshot, also the directory or bundle a batch was imported from."},
+    {"format", DM_FORMAT, "FORMAT", 0, "Write query results as 'csv' (the default) or 'json'."},
+
+    { 0,0,0,0, "Snapshots: 'datamaps snapshot FILE' writes the returns imported against --name (or only the --return given) to FILE as columns, to be mapped and scanned in place." },
+    {"read", DM_READ, 0, 0, "Map the snapshot FILE instead and write each key's type, count, sum, min and max to the --output file."},
 
     { 0,0,0,0, "The following options should be grouped together:" },
-    {"output", 'o', "FILE", 0, "Output to FILE instead of standard output."},
+    {"output", 'o', "FILE", 0, "Output to FILE instead of standard output (used by export, diff, query, snapshot --read and, instead of standard error, --stats). For export, a FILE ending in .xlsx gets a spreadsheet, anything else CSV."},
     {"repeat", 'r', "COUNT", OPTION_ARG_OPTIONAL, "Repeat the output COUNT (default 10) times."},
     {"abort", OPT_ABORT, 0, 0, "Abort before showing any output."},
     {0}
@@ -63,8 +91,20 @@ struct arguments
     char *output_file;
     char *datamap_path;
     char *spreadsheet_path;
+    char *bundle_path;
+    char *as_name; // for a spreadsheet or bundle on stdin
     char *dm_name;
+    char *dm_names[MAX_DM_NAMES];
+    size_t ndm_names;
     int dm_overwrite;
+    int jobs;
+    int force;
+    int bulk;
+    int sheet_threads;
+    char *stats; // NULL, "text" or "json"
+    char *return_spec; // for query
+    char *format; // "csv" or "json"
+    int read; // for snapshot
     int repeat;
     int abort;
 };
@@ -83,6 +123,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
             break;
         case 'v':
             arguments->verbose = 1;
+            break;
         case 'o':
             arguments->output_file = arg;
             break;
@@ -91,6 +132,9 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
             break;
         case DM_NAME:
             arguments->dm_name = arg;
+            if (arguments->ndm_names == MAX_DM_NAMES)
+                argp_error(state, "no more than %d datamaps at once", MAX_DM_NAMES);
+            arguments->dm_names[arguments->ndm_names++] = arg;
             break;
         case DM_OVERWRITE: case DM_INITIAL:
             arguments->dm_overwrite = 1;
@@ -98,6 +142,40 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
         case DM_IMPORT_SPREADSHEETS:
             arguments->spreadsheet_path = arg;
             break;
+        case DM_BUNDLE:
+            arguments->bundle_path = arg;
+            break;
+        case DM_AS:
+            arguments->as_name = arg;
+            break;
+        case DM_JOBS:
+            arguments->jobs = atoi(arg);
+            break;
+        case DM_FORCE:
+            arguments->force = 1;
+            break;
+        case DM_BULK:
+            arguments->bulk = 1;
+            break;
+        case DM_SHEET_THREADS:
+            arguments->sheet_threads = atoi(arg);
+            break;
+        case DM_STATS:
+            arguments->stats = arg ? arg : "text";
+            if (strcmp(arguments->stats, "text") != 0 && strcmp(arguments->stats, "json") != 0)
+                argp_error(state, "--stats FORMAT must be 'text' or 'json'");
+            break;
+        case DM_RETURN:
+            arguments->return_spec = arg;
+            break;
+        case DM_FORMAT:
+            if (strcmp(arg, "csv") != 0 && strcmp(arg, "json") != 0)
+                argp_error(state, "--format FORMAT must be 'csv' or 'json'");
+            arguments->format = arg;
+            break;
+        case DM_READ:
+            arguments->read = 1;
+            break;
         case 'r':
             arguments->repeat = arg ? atoi (arg) : 10;
             break;
@@ -130,6 +208,22 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 
 static struct argp argp = {options, parse_opt, args_doc, doc};
 
+// --stats output goes to standard error, keeping standard output for the
+// import's own messages, unless an --output file was given
+static void write_stats(const DmStats *stats, const char *output_file, const char *format)
+{
+    int to_stderr = strcmp(output_file, "-") == 0;
+    FILE *out = to_stderr ? stderr : fopen(output_file, "w");
+
+    if (out == NULL) {
+        fprintf(stderr, "Cannot write stats to %s\n", output_file);
+        exit(1);
+    }
+    dm_stats_print(stats, out, strcmp(format, "json") == 0);
+    if (!to_stderr)
+        fclose(out);
+}
+
 int main(int argc, char *argv[])
 {
     int i, j;
@@ -143,12 +237,25 @@ int main(int argc, char *argv[])
     arguments.abort = 0;
     arguments.datamap_path = "";
     arguments.spreadsheet_path = "";
+    arguments.bundle_path = NULL;
+    arguments.as_name = NULL;
     arguments.dm_name = "New datamap";
+    arguments.ndm_names = 0;
     arguments.dm_overwrite = 0;
+    arguments.jobs = 0;
+    arguments.force = 0;
+    arguments.bulk = 0;
+    arguments.sheet_threads = 1;
+    arguments.stats = NULL;
+    arguments.return_spec = NULL;
+    arguments.format = "csv";
+    arguments.read = 0;
 
     // Parse our arguments; every option seen by parse_opt will be
     // reflected in arguments.
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.ndm_names == 0)
+        arguments.dm_names[arguments.ndm_names++] = arguments.dm_name;
     
     // This should not be called here but it offers a nice message
     /* argp_help(&argp, stderr, ARGP_HELP_SEE, "datamaps"); */
@@ -163,10 +270,91 @@ int main(int argc, char *argv[])
     }
     else if (strcmp("import", arguments.operation) == 0) {
         printf("We are going to call an import() func here.\n");
-        if(strcmp("", arguments.spreadsheet_path) == 0) {
-            fprintf(stderr, "You probably need to use the --spreadsheet option here.\n");
+        if(strcmp("", arguments.spreadsheet_path) == 0 && arguments.bundle_path == NULL) {
+            fprintf(stderr, "You probably need to use the --spreadsheet or --bundle option here.\n");
+            exit(1);
+        }
+        const char *from = arguments.bundle_path ? arguments.bundle_path : arguments.spreadsheet_path;
+        if (arguments.as_name && strcmp(DM_STDIN_NAME, from) != 0) {
+            fprintf(stderr, "--as only names a spreadsheet or bundle read from standard input.\n");
+            exit(1);
+        }
+        DmStats stats;
+        DmImportOptions opts = {arguments.jobs, arguments.force, arguments.silent, NULL, arguments.sheet_threads,
+                                arguments.bulk};
+        if (arguments.stats)
+            opts.stats = &stats;
+        memset(&stats, 0, sizeof(DmStats));
+        int rc;
+        if (arguments.bundle_path) {
+            DmBundle bundle;
+            if (dm_bundle_open(arguments.bundle_path, arguments.as_name, &bundle))
+                exit(1);
+            if (bundle.nworkbooks == 0) {
+                fprintf(stderr, "No spreadsheets found in %s\n", arguments.bundle_path);
+                dm_bundle_close(&bundle);
+                exit(1);
+            }
+            rc = dm_import_workbooks(bundle.workbooks, bundle.nworkbooks, arguments.dm_names, arguments.ndm_names, &opts);
+            dm_bundle_close(&bundle);
+        } else if (strcmp(DM_STDIN_NAME, arguments.spreadsheet_path) == 0) {
+            rc = dm_import_stdin(arguments.as_name, arguments.dm_names, arguments.ndm_names, &opts);
+        } else {
+            char **paths;
+            size_t npaths;
+            if (dm_expand_paths(arguments.spreadsheet_path, &paths, &npaths)) {
+                fprintf(stderr, "No spreadsheets found at %s\n", arguments.spreadsheet_path);
+                exit(1);
+            }
+            rc = dm_import_batch(paths, npaths, arguments.dm_names, arguments.ndm_names, &opts);
+            dm_free_paths(paths, npaths);
+        }
+        if (arguments.stats)
+            write_stats(&stats, arguments.output_file, arguments.stats);
+        if (rc)
+            exit(rc);
+    }
+
+    else if (strcmp("export", arguments.operation) == 0) {
+        // the master goes to standard output unless -o says otherwise, so
+        // nothing else can be printed there
+        exit(dm_export_master(arguments.dm_name, arguments.output_file));
+    }
+    else if (strcmp("diff", arguments.operation) == 0) {
+        if (arguments.strings[0] == NULL || arguments.strings[1] == NULL) {
+            fprintf(stderr, "What to compare? Use 'datamaps diff OLD NEW'.\n");
+            exit(1);
+        }
+        exit(dm_diff(arguments.dm_name, arguments.strings[0], arguments.strings[1],
+                     arguments.output_file, arguments.silent));
+    }
+    else if (strcmp("query", arguments.operation) == 0) {
+        exit(dm_query(arguments.dm_name, arguments.return_spec, arguments.strings, arguments.output_file,
+                      strcmp(arguments.format, "json") == 0));
+    }
+    else if (strcmp("snapshot", arguments.operation) == 0) {
+        if (arguments.strings[0] == NULL) {
+            fprintf(stderr, "Which file? Use 'datamaps snapshot FILE'.\n");
+            exit(1);
+        }
+        if (arguments.read)
+            exit(dm_snapshot_summary(arguments.strings[0], arguments.output_file, arguments.silent));
+        exit(dm_snapshot_write(arguments.dm_name, arguments.return_spec, arguments.strings[0]));
+    }
+    else if (strcmp("watch", arguments.operation) == 0) {
+        if (arguments.strings[0] == NULL) {
+            fprintf(stderr, "Which directory? Use 'datamaps watch DIR'.\n");
+            exit(1);
         }
-        read_spreadsheet(arguments.spreadsheet_path);
+        DmStats stats;
+        DmImportOptions opts = {0, arguments.force, arguments.silent, NULL, arguments.sheet_threads};
+        if (arguments.stats)
+            opts.stats = &stats;
+        memset(&stats, 0, sizeof(DmStats));
+        int rc = dm_watch(arguments.strings[0], arguments.dm_names, arguments.ndm_names, &opts);
+        if (arguments.stats)
+            write_stats(&stats, arguments.output_file, arguments.stats);
+        exit(rc);
     }
 
     for (i = 0; i < arguments.repeat; ++i) {
@@ -0,0 +1,345 @@
+#include <stdint.h>
+#include "reader.h"
+
+/* -- Querying returns -----------------------------
+ *
+ * Looks values up in the database without building anything: a key in one
+ * return, a key across every return, or everything in one return, written
+ * to standard output as CSV
+ *
+ *   return,file,key,value
+ *
+ * or as a JSON array of objects with the same fields, numbers and booleans
+ * as themselves. A cell of a range line is called key[row,col], as in diff.
+ *
+ * Every lookup is an index search: the datamap by name, the key by
+ * datamap_line_key, the return by return_dm and the values by
+ * return_data_line or, for a key across returns, return_data_by_line. The
+ * statements are prepared once and kept in a DmStmtCache, so several keys
+ * given at once (or read one per line from standard input with "-") cost
+ * a bind and a step each.
+ */
+
+extern void dm_stmt_cache_init(DmStmtCache *cache, sqlite3 *db)
+{
+    memset(cache, 0, sizeof(DmStmtCache));
+    cache->db = db;
+}
+
+/* The statement for sql, prepared the first time it is asked for and reset,
+ * with its bindings cleared, every time after. Returns NULL if sql won't
+ * prepare. */
+extern sqlite3_stmt *dm_stmt_cache_get(DmStmtCache *cache, const char *sql)
+{
+    for (size_t i = 0; i < cache->count; i++) {
+        // the SQL is almost always the same string constant
+        if (cache->sql[i] == sql || strcmp(cache->sql[i], sql) == 0) {
+            sqlite3_reset(cache->stmt[i]);
+            sqlite3_clear_bindings(cache->stmt[i]);
+            return cache->stmt[i];
+        }
+    }
+
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v3(cache->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Error #%d: %s\n", rc, sqlite3_errmsg(cache->db));
+        return NULL;
+    }
+    size_t slot = cache->count;
+    if (slot == DM_STMT_CACHE_SIZE) {
+        slot = cache->next;
+        cache->next = (cache->next + 1) % DM_STMT_CACHE_SIZE;
+        sqlite3_finalize(cache->stmt[slot]);
+    } else {
+        cache->count++;
+    }
+    cache->sql[slot] = sql;
+    cache->stmt[slot] = stmt;
+    return stmt;
+}
+
+extern void dm_stmt_cache_free(DmStmtCache *cache)
+{
+    for (size_t i = 0; i < cache->count; i++)
+        sqlite3_finalize(cache->stmt[i]);
+    memset(cache, 0, sizeof(DmStmtCache));
+}
+
+// The columns every lookup gives back
+#define QUERY_COLUMNS "SELECT v.return_id, r.file, l.key, v.range_row, v.range_col, v.value, v.vtype, v.text"
+
+enum {COL_RETURN, COL_FILE, COL_KEY, COL_ROW, COL_COL, COL_VALUE, COL_VTYPE, COL_TEXT};
+
+static const char *datamap_sql = "SELECT MAX(id) FROM datamap WHERE name = ?";
+static const char *key_exists_sql = "SELECT 1 FROM datamap_line WHERE dm_id = ? AND key = ? LIMIT 1";
+
+// CROSS JOIN keeps the planner from reading the whole return and sorting
+// it: without statistics it can't tell a key is rarer than a return
+static const char *key_in_return_sql = QUERY_COLUMNS
+                                       "  FROM datamap_line AS l"
+                                       "  CROSS JOIN return_value AS v ON v.datamap_line_id = l.id"
+                                       "  JOIN return AS r ON r.id = v.return_id"
+                                       " WHERE l.dm_id = ?1 AND l.key = ?2 AND v.return_id = ?3"
+                                       " ORDER BY l.id, v.range_row, v.range_col";
+
+// return_data_by_line's order, so there is nothing to sort
+static const char *key_in_all_sql = QUERY_COLUMNS
+                                    "  FROM datamap_line AS l"
+                                    "  JOIN return_value AS v ON v.datamap_line_id = l.id"
+                                    "  JOIN return AS r ON r.id = v.return_id"
+                                    " WHERE l.dm_id = ?1 AND l.key = ?2"
+                                    " ORDER BY l.id, v.range_row, v.range_col, v.return_id";
+
+static const char *return_sql = QUERY_COLUMNS
+                                "  FROM return_value AS v"
+                                "  JOIN datamap_line AS l ON l.id = v.datamap_line_id"
+                                "  JOIN return AS r ON r.id = v.return_id"
+                                " WHERE v.return_id = ?1"
+                                " ORDER BY v.datamap_line_id, v.range_row, v.range_col";
+
+struct query_out {
+    FILE *f;
+    int json;
+    size_t rows;
+};
+
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c == '\r')
+            fputs("\\r", f);
+        else if (c == '\t')
+            fputs("\\t", f);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void json_value(FILE *f, sqlite3_stmt *stmt)
+{
+    switch (sqlite3_column_int(stmt, COL_VTYPE)) {
+        case DM_VALUE_INTEGER:
+            fprintf(f, "%lld", (long long)sqlite3_column_int64(stmt, COL_VALUE));
+            break;
+        case DM_VALUE_REAL: {
+            // "1." is a number to us but not to JSON, so print the double,
+            // as short as it will go and still read back the same
+            double r = sqlite3_column_double(stmt, COL_VALUE);
+            char buf[32];
+            for (int digits = 15; digits <= 17; digits++) {
+                snprintf(buf, sizeof(buf), "%.*g", digits, r);
+                if (strtod(buf, NULL) == r)
+                    break;
+            }
+            fputs(buf, f);
+            break;
+        }
+        case DM_VALUE_BOOLEAN:
+            fputs(sqlite3_column_int(stmt, COL_VALUE) ? "true" : "false", f);
+            break;
+        default:
+            json_string(f, (const char *)sqlite3_column_text(stmt, COL_TEXT));
+    }
+}
+
+// One value, the current row of stmt
+static void write_row(struct query_out *out, sqlite3_stmt *stmt)
+{
+    const char *key = (const char *)sqlite3_column_text(stmt, COL_KEY);
+    int64_t range_row = sqlite3_column_int64(stmt, COL_ROW);
+    char *label = NULL;
+
+    if (range_row)
+        label = sqlite3_mprintf("%s[%lld,%lld]", key, (long long)range_row,
+                                (long long)sqlite3_column_int64(stmt, COL_COL));
+    if (label)
+        key = label;
+
+    if (out->json) {
+        fprintf(out->f, "%s\n  {\"return\": %lld, \"file\": ", out->rows ? "," : "",
+                (long long)sqlite3_column_int64(stmt, COL_RETURN));
+        json_string(out->f, (const char *)sqlite3_column_text(stmt, COL_FILE));
+        fputs(", \"key\": ", out->f);
+        json_string(out->f, key);
+        fputs(", \"value\": ", out->f);
+        json_value(out->f, stmt);
+        fputc('}', out->f);
+    } else {
+        fprintf(out->f, "%lld,", (long long)sqlite3_column_int64(stmt, COL_RETURN));
+        dm_csv_field(out->f, (const char *)sqlite3_column_text(stmt, COL_FILE));
+        fputc(',', out->f);
+        dm_csv_field(out->f, key);
+        fputc(',', out->f);
+        dm_csv_field(out->f, (const char *)sqlite3_column_text(stmt, COL_TEXT));
+        fputc('\n', out->f);
+    }
+    out->rows++;
+    sqlite3_free(label);
+}
+
+// Write every row stmt gives. Returns 1 on a database error.
+static int write_rows(struct query_out *out, sqlite3_stmt *stmt)
+{
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        write_row(out, stmt);
+    sqlite3_reset(stmt);
+    return rc != SQLITE_DONE;
+}
+
+// The id of the return spec (a return id or a workbook as it was imported)
+// stands for, or 0 if there is none against datamap dm_id
+static int64_t find_return(sqlite3 *db, int64_t dm_id, const char *spec)
+{
+    DmReturnRefs refs;
+    int64_t id = 0;
+
+    if (dm_find_returns(db, dm_id, spec, 0, &refs) == 0 && refs.count > 0)
+        id = refs.refs[0].id;
+    dm_free_return_refs(&refs);
+    return id;
+}
+
+/* Write key's values, in return_id or, if that is 0, in every return.
+ * Returns 1 if the datamap has no such key or the lookup fails. */
+static int query_key(DmStmtCache *cache, struct query_out *out, int64_t dm_id, int64_t return_id, const char *key)
+{
+    sqlite3_stmt *stmt = dm_stmt_cache_get(cache, return_id ? key_in_return_sql : key_in_all_sql);
+    if (stmt == NULL)
+        return 1;
+    sqlite3_bind_int64(stmt, 1, dm_id);
+    sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+    if (return_id)
+        sqlite3_bind_int64(stmt, 3, return_id);
+    size_t rows = out->rows;
+    if (write_rows(out, stmt)) {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(cache->db));
+        return 1;
+    }
+    if (out->rows > rows)
+        return 0;
+
+    // nothing found: a key with no value is fine, a key that isn't there isn't
+    if ((stmt = dm_stmt_cache_get(cache, key_exists_sql)) == NULL)
+        return 1;
+    sqlite3_bind_int64(stmt, 1, dm_id);
+    sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+    int found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_reset(stmt);
+    if (!found)
+        fprintf(stderr, "No key '%s' in the datamap.\n", key);
+    return !found;
+}
+
+// Keys one per line from f, as when "-" is given
+static int query_keys_from(FILE *f, DmStmtCache *cache, struct query_out *out, int64_t dm_id, int64_t return_id)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int err = 0;
+
+    while ((len = getline(&line, &size, f)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len > 0)
+            err |= query_key(cache, out, dm_id, return_id, line);
+    }
+    free(line);
+    return err;
+}
+
+/* Look up keys (NULL-terminated; "-" reads them from standard input) in the
+ * return return_spec, or across every return if it is NULL, against the
+ * datamap dm_name. With no keys, everything in return_spec is written.
+ * Results go to output_file ("-" for standard output), as JSON if json is
+ * set and CSV if not.
+ *
+ * Returns 0 on success, 1 if anything could not be found or written. */
+extern int dm_query(char *dm_name, const char *return_spec, char **keys, const char *output_file, int json)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    DmStmtCache cache;
+    int64_t dm_id = 0, return_id = 0;
+    int to_stdout = strcmp(output_file, "-") == 0;
+    int err = 0;
+
+    if ((keys == NULL || keys[0] == NULL) && return_spec == NULL) {
+        fprintf(stderr, "What to look up? Give a KEY, --return, or both.\n");
+        return 1;
+    }
+
+    int rc = sqlite3_open("test.db", &db);
+    dm_sql_check_error(rc, db);
+
+    // the indexes and view the lookups rely on, on an older database
+    if (dm_upgrade_datamap_line(db) || dm_upgrade_return_data(db)
+            || dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK) {
+        sqlite3_close(db);
+        return 1;
+    }
+    dm_stmt_cache_init(&cache, db);
+
+    // one read transaction, so every lookup sees the same state
+    dm_exec_sql_stmt("BEGIN TRANSACTION;", db);
+    if ((stmt = dm_stmt_cache_get(&cache, datamap_sql)) != NULL) {
+        sqlite3_bind_text(stmt, 1, dm_name, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            dm_id = sqlite3_column_int64(stmt, 0);
+        sqlite3_reset(stmt);
+    }
+    if (dm_id == 0) {
+        fprintf(stderr, "No datamap called '%s' found in the database.\n", dm_name);
+        err = 1;
+    } else if (return_spec && (return_id = find_return(db, dm_id, return_spec)) == 0) {
+        fprintf(stderr, "No return for %s found against this datamap.\n", return_spec);
+        err = 1;
+    }
+
+    FILE *f = NULL;
+    if (!err && (f = to_stdout ? stdout : fopen(output_file, "w")) == NULL) {
+        fprintf(stderr, "Cannot write to %s\n", output_file);
+        err = 1;
+    }
+    if (f) {
+        struct query_out out = {f, json, 0};
+        fputs(json ? "[" : "return,file,key,value\n", f);
+        if (keys == NULL || keys[0] == NULL) {
+            if ((stmt = dm_stmt_cache_get(&cache, return_sql)) == NULL) {
+                err = 1;
+            } else {
+                sqlite3_bind_int64(stmt, 1, return_id);
+                if ((err = write_rows(&out, stmt)))
+                    fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+            }
+        }
+        for (size_t i = 0; keys && keys[i]; i++) {
+            if (strcmp(keys[i], "-") == 0)
+                err |= query_keys_from(stdin, &cache, &out, dm_id, return_id);
+            else
+                err |= query_key(&cache, &out, dm_id, return_id, keys[i]);
+        }
+        if (json)
+            fputs(out.rows ? "\n]\n" : "]\n", f);
+        if (!to_stdout)
+            err |= fclose(f) != 0;
+        else
+            fflush(stdout);
+    }
+    dm_exec_sql_stmt("COMMIT;", db);
+
+    dm_stmt_cache_free(&cache);
+    sqlite3_close(db);
+    return err;
+}
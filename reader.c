@@ -1,9 +1,17 @@
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "reader.h"
 
 /* -- Some SQL strings ----------------------------- */
 
 const char *dm_sql_str_create_table_datamap = "DROP TABLE IF EXISTS datamap;"
-                                              "CREATE TABLE datamap(id INTEGER PRIMARY KEY, name TEXT, date_created TEXT);";
+                                              "CREATE TABLE datamap(id INTEGER PRIMARY KEY, name TEXT, date_created TEXT,"
+                                              "revision INTEGER NOT NULL DEFAULT 0);";
 const char *dm_sql_str_create_table_datamapline = "DROP TABLE IF EXISTS datamap_line;"
                                                   "CREATE TABLE datamap_line("
                                                   "id INTEGER PRIMARY KEY,"
@@ -11,10 +19,99 @@ const char *dm_sql_str_create_table_datamapline = "DROP TABLE IF EXISTS datamap_
                                                   "key TEXT NOT NULL,"
                                                   "sheet TEXT NOT NULL,"
                                                   "cellref TEXT,"
+                                                  // optional checks on the line's values (see rules.c)
+                                                  "type TEXT,"
+                                                  "min REAL,"
+                                                  "max REAL,"
+                                                  "pattern TEXT,"
+                                                  "allowed TEXT,"
                                                   "FOREIGN KEY (dm_id)"
                                                   "   REFERENCES datamap(id)"
                                                   "   ON DELETE CASCADE"
                                                   ");";
+// Edits to a datamap's lines bump its revision, which tells us a compiled
+// datamap is stale
+const char *dm_sql_str_create_trigger_datamap = "CREATE TRIGGER IF NOT EXISTS datamap_line_updated"
+                                                "   AFTER UPDATE ON datamap_line BEGIN"
+                                                "   UPDATE datamap SET revision = revision + 1 WHERE id IN (OLD.dm_id, NEW.dm_id);"
+                                                "END;"
+                                                "CREATE TRIGGER IF NOT EXISTS datamap_line_deleted"
+                                                "   AFTER DELETE ON datamap_line BEGIN"
+                                                "   UPDATE datamap SET revision = revision + 1 WHERE id = OLD.dm_id;"
+                                                "END;";
+// Looking up a datamap by name and its lines by key (datamaps query) or
+// sheet (loading a datamap) without a scan; each index carries the rowid,
+// so the id is read straight from it.
+const char *dm_sql_str_create_index_datamap = "CREATE INDEX IF NOT EXISTS datamap_name ON datamap(name);"
+                                              "CREATE INDEX IF NOT EXISTS datamap_line_key ON datamap_line(dm_id, key);"
+                                              "CREATE INDEX IF NOT EXISTS datamap_line_sheet ON datamap_line(dm_id, sheet);";
+const char *dm_sql_str_drop_table_return = "DROP VIEW IF EXISTS return_value;"
+                                           "DROP TABLE IF EXISTS return_check;"
+                                           "DROP TABLE IF EXISTS return_data;"
+                                           "DROP TABLE IF EXISTS return;"
+                                           "DROP TABLE IF EXISTS value;";
+const char *dm_sql_str_create_table_return = "CREATE TABLE IF NOT EXISTS return("
+                                             "id INTEGER PRIMARY KEY,"
+                                             "file TEXT NOT NULL,"
+                                             "hash INTEGER,"
+                                             "imported TEXT NOT NULL,"
+                                             "dm_id INTEGER NOT NULL,"
+                                             "FOREIGN KEY (dm_id)"
+                                             "   REFERENCES datamap(id)"
+                                             "   ON DELETE CASCADE"
+                                             ");"
+                                             // every distinct text value, stored once however many
+                                             // returns have it
+                                             "CREATE TABLE IF NOT EXISTS value("
+                                             "id INTEGER PRIMARY KEY,"
+                                             "text TEXT NOT NULL UNIQUE"
+                                             ");"
+                                             "CREATE TABLE IF NOT EXISTS return_data("
+                                             "id INTEGER PRIMARY KEY,"
+                                             "return_id INTEGER NOT NULL,"
+                                             "datamap_line_id INTEGER NOT NULL,"
+                                             // no declared type, so numbers are stored as numbers;
+                                             // NULL for text, which is in value_id instead
+                                             "value,"
+                                             "vtype INTEGER NOT NULL DEFAULT 0," // DmValueType
+                                             "raw TEXT," // the text as read, where value doesn't reproduce it
+                                             // where in a range line's table the value is, counting
+                                             // from 1; 0 and 0 for a single cell
+                                             "range_row INTEGER NOT NULL DEFAULT 0,"
+                                             "range_col INTEGER NOT NULL DEFAULT 0,"
+                                             "value_id INTEGER REFERENCES value(id)," // a text value
+                                             "FOREIGN KEY (return_id)"
+                                             "   REFERENCES return(id)"
+                                             "   ON DELETE CASCADE,"
+                                             "FOREIGN KEY (datamap_line_id)"
+                                             "   REFERENCES datamap_line(id)"
+                                             "   ON DELETE CASCADE"
+                                             ");"
+                                             "CREATE UNIQUE INDEX IF NOT EXISTS return_data_line"
+                                             "   ON return_data(return_id, datamap_line_id, range_row, range_col);"
+                                             // a line's values in return order, for the master export
+                                             "CREATE INDEX IF NOT EXISTS return_data_by_line"
+                                             "   ON return_data(datamap_line_id, range_row, range_col, return_id);"
+                                             "CREATE INDEX IF NOT EXISTS return_dm ON return(dm_id, file);"
+                                             // the values in each return that broke their line's rule
+                                             "CREATE TABLE IF NOT EXISTS return_check("
+                                             "return_id INTEGER NOT NULL,"
+                                             "datamap_line_id INTEGER NOT NULL,"
+                                             "range_row INTEGER NOT NULL DEFAULT 0,"
+                                             "range_col INTEGER NOT NULL DEFAULT 0,"
+                                             "problem TEXT NOT NULL,"
+                                             "FOREIGN KEY (return_id)"
+                                             "   REFERENCES return(id)"
+                                             "   ON DELETE CASCADE"
+                                             ");"
+                                             "CREATE INDEX IF NOT EXISTS return_check_return ON return_check(return_id);"
+                                             // every value, with text looked up, and as the text it was read as
+                                             "CREATE VIEW IF NOT EXISTS return_value AS"
+                                             "   SELECT d.id, return_id, datamap_line_id, range_row, range_col,"
+                                             "          COALESCE(d.value, v.text) AS value, vtype,"
+                                             "          " DM_SQL_RETURN_TEXT " AS text"
+                                             "     FROM return_data AS d"
+                                             "     LEFT JOIN value AS v ON v.id = d.value_id;";
 
 /* -- HELPER FUNCS & CALLBACKS ----------------------------- */
 
@@ -33,17 +130,6 @@ extern void dm_sql_check_error(int rc, sqlite3 *db)
     }
 }
 
-static int get_fields(char *line, size_t len)
-{
-        /* Let's work out how many fields we've got from the first line */
-        int fieldcount = 0;
-        for (int i = 0; i < len; i++) {
-            if (line[i] == ',')
-                fieldcount++;
-        }
-        return fieldcount;
-}
-
 extern int dm_exec_sql_stmt(const char *stmt, sqlite3 *db)
 {
     char *err_msg;
@@ -58,96 +144,442 @@ extern int dm_exec_sql_stmt(const char *stmt, sqlite3 *db)
     return SQLITE_OK;
 }
 
-// This callback can be used as the third param in the sqlite3_exec() function
-// to get the output result of that call in a_param. It gets the first element
-// of the array and copies it in. Be careful with strings here.
-static int exec_callback(void *a_param, int argc, char **argv, char **column) {
-    strcpy(a_param, argv[0]);
-    for (int i=0; i<argc; i++)
-        printf("%s,\t", argv[i]);
-    printf("\n");
+
+/* -- CELL REFERENCES & CELL INDEX ----------------------------- */
+
+// Turn a cell reference such as "B12", "AB10" or "$C$9" into 1-based row and
+// column numbers. Trailing whitespace (e.g. the newline at the end of a
+// datamap line) is ignored. Returns 0 on success and 1 if ref is not a cell.
+extern int dm_parse_cellref(const char *ref, size_t *row, size_t *col)
+{
+    size_t r = 0, c = 0;
+    const char *p = ref;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '$')
+        p++;
+    for (; (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'); p++) {
+        c = c * 26 + ((*p & ~0x20) - 'A' + 1);
+        if (c > EXCEL_MAX_COLS)
+            return 1;
+    }
+    if (*p == '$')
+        p++;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        r = r * 10 + (*p - '0');
+        if (r > EXCEL_MAX_ROWS)
+            return 1;
+    }
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    if (*p != '\0' || r == 0 || c == 0)
+        return 1;
+    *row = r;
+    *col = c;
     return 0;
 }
 
+// The reverse of dm_parse_cellref(): 12, 28 -> "AB12".
+extern void dm_format_cellref(size_t row, size_t col, char *buf)
+{
+    char letters[4];
+    int n = 0;
 
-/* -- MAIN FUNCTIONS ----------------------------- */
+    while (col > 0 && n < 4) {
+        col--;
+        letters[n++] = 'A' + col % 26;
+        col /= 26;
+    }
+    for (int i = 0; i < n; i++)
+        buf[i] = letters[n - 1 - i];
+    sprintf(buf + n, "%zu", row);
+}
+
+// A range such as "AB10:AF200" - or a single cell, which is a range of one -
+// as the 1-based bounds of its top left and bottom right cells. The corners
+// can be given either way round. Returns 0 on success and 1 if ref is not a
+// cell or range, or covers more than DM_RANGE_MAX_CELLS cells.
+extern int dm_parse_range(const char *ref, size_t *row, size_t *col, size_t *last_row, size_t *last_col)
+{
+    char first[DM_CELLREF_MAX];
+    const char *colon = strchr(ref, ':');
+    size_t r1, c1, r2, c2;
+
+    if (colon == NULL) {
+        if (dm_parse_cellref(ref, row, col))
+            return 1;
+        *last_row = *row;
+        *last_col = *col;
+        return 0;
+    }
+    if ((size_t)(colon - ref) >= DM_CELLREF_MAX)
+        return 1;
+    memcpy(first, ref, colon - ref);
+    first[colon - ref] = '\0';
+    if (dm_parse_cellref(first, &r1, &c1) || dm_parse_cellref(colon + 1, &r2, &c2))
+        return 1;
+
+    *row = r1 < r2 ? r1 : r2;
+    *last_row = r1 < r2 ? r2 : r1;
+    *col = c1 < c2 ? c1 : c2;
+    *last_col = c1 < c2 ? c2 : c1;
+    return (*last_row - *row + 1) * (*last_col - *col + 1) > DM_RANGE_MAX_CELLS;
+}
+
+static size_t index_slot(uint64_t cell, size_t bits)
+{
+    // Fibonacci hashing - the high bits of the product are well mixed
+    return (size_t)((cell * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+// Size the index so that `expected` cells keep it at most half full.
+extern int dm_index_init(DmCellIndex *idx, size_t expected)
+{
+    idx->bits = DM_INDEX_MIN_BITS;
+    while (((size_t)1 << idx->bits) < expected * 2)
+        idx->bits++;
+    idx->count = 0;
+    idx->slots = calloc((size_t)1 << idx->bits, sizeof(DmCellSlot));
+    return idx->slots == NULL;
+}
+
+static int index_grow(DmCellIndex *idx)
+{
+    DmCellIndex bigger;
+    size_t old_cap = (size_t)1 << idx->bits;
 
-// Read the datamap file and populate a Datamapline struct with the data
-extern int populate_datamapLine(char *line, Datamapline *dml)
-{
-    int count = 1;
-    char *tok;
-    /* we don't want strtok to do more than commas */
-    for (tok = strtok(line, ",");
-            tok !=NULL;
-            tok = strtok(NULL, ","))
-    {
-        if (count == 1) {
-            dml->key = tok;
-            count++;
-        } else if (count == 2) {
-            strcpy(dml->sheet, tok);
-            count++;
-        } else if (count == 3) {
-            strcpy(dml->cellref, tok);
-            count++;
+    bigger.bits = idx->bits + 1;
+    bigger.count = 0;
+    bigger.slots = calloc((size_t)1 << bigger.bits, sizeof(DmCellSlot));
+    if (bigger.slots == NULL)
+        return 1;
+    for (size_t i = 0; i < old_cap; i++) {
+        DmCellSlot *s = &idx->slots[i];
+        if (s->cell) {
+            size_t mask = ((size_t)1 << bigger.bits) - 1;
+            size_t j = index_slot(s->cell, bigger.bits);
+            while (bigger.slots[j].cell)
+                j = (j + 1) & mask;
+            bigger.slots[j] = *s;
+            bigger.count++;
         }
     }
+    free(idx->slots);
+    *idx = bigger;
     return 0;
 }
 
-/* When xlsioreader traverses a sheet, it happens upon every cell in every row.
- * We only want to get values from cells which are contained in the datamap
- * - particularly a Datamapline.sheet/Datamapline.cellref combination.
- *
- * We don't want to do be doing a SQL SELECT statement every time, so a hash
- * function makes more sense.  e.g. We are on a particular cell on the
- * spreadsheet. We know what sheet we are on and what cell/col coordate we are
- * on (i.e. the cell reference). We want to check with that is in datamap. What
- * data structure do we want?
+// Map (row, col) to line. If the cell is already present the first mapping
+// wins and 0 is still returned; 1 means we ran out of memory.
+extern int dm_index_add(DmCellIndex *idx, size_t row, size_t col, uint32_t line)
+{
+    if ((idx->count + 1) * 2 > ((size_t)1 << idx->bits) && index_grow(idx))
+        return 1;
+
+    uint64_t cell = DM_CELL_PACK(row, col);
+    size_t mask = ((size_t)1 << idx->bits) - 1;
+    size_t i = index_slot(cell, idx->bits);
+
+    while (idx->slots[i].cell) {
+        if (idx->slots[i].cell == cell)
+            return 0;
+        i = (i + 1) & mask;
+    }
+    idx->slots[i].cell = cell;
+    idx->slots[i].line = line;
+    idx->count++;
+    return 0;
+}
+
+// Returns the slot for (row, col) or NULL if the datamap does not want it.
+extern const DmCellSlot *dm_index_find(const DmCellIndex *idx, size_t row, size_t col)
+{
+    uint64_t cell = DM_CELL_PACK(row, col);
+    size_t mask = ((size_t)1 << idx->bits) - 1;
+    size_t i = index_slot(cell, idx->bits);
+
+    while (idx->slots[i].cell) {
+        if (idx->slots[i].cell == cell)
+            return &idx->slots[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+extern void dm_index_free(DmCellIndex *idx)
+{
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->count = 0;
+}
+
+
+/* -- MAIN FUNCTIONS ----------------------------- */
+
+/* -- DATAMAP CSV PARSING -----------------------------
  *
- * A lookup table?
- * https://embeddedgurus.com/stack-overflow/2010/01/a-tutorial-on-lookup-tables-in-c/
- * To be effective, this has to be computed ahead of time... Wait, we already
- * have this in the database!
- *    - SELECT datamap_line.cellref from datamap_line where datamap_line.sheet = 'Introduction'
- * Returns the length of the array if good.
+ * Datamap files are parsed straight out of a private, writable mmap of the
+ * file. Fields come back as pointer/length pairs into the mapping, so there
+ * is no line buffer to overflow and no copying. Quoted fields (RFC 4180)
+ * may contain commas, newlines and doubled quotes; the doubled quotes are
+ * collapsed in place, which only touches our copy-on-write pages.
  */
-extern int populate_array_cellrefs_for_sheet(sqlite3 *db, char *sheetname, const char* *cellrefs)
+
+// Use a buffer the caller owns. It must be writable and outlive the DmCsv.
+extern void dm_csv_init(DmCsv *csv, char *data, size_t size)
+{
+    csv->data = data;
+    csv->size = size;
+    csv->pos = 0;
+    csv->lineno = 0;
+    csv->next_line = 1;
+    csv->mapped = 0;
+    // skip a UTF-8 byte order mark, as left by Excel's "CSV UTF-8"
+    if (size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0)
+        csv->pos = 3;
+}
+
+// Map the file at path. Returns 0 on success, 1 if it can't be read.
+extern int dm_csv_open(DmCsv *csv, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        dm_csv_init(csv, NULL, 0);
+        return 0;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 1;
+    dm_csv_init(csv, data, st.st_size);
+    csv->mapped = 1;
+    return 0;
+}
+
+extern void dm_csv_close(DmCsv *csv)
+{
+    if (csv->mapped)
+        munmap(csv->data, csv->size);
+    csv->data = NULL;
+    csv->size = 0;
+}
+
+/* Read the next record. Up to maxfields fields are stored in fields and the
+ * real number of fields in the record goes in *nfields. csv->lineno is the
+ * line the record started on.
+ *
+ * Returns 1 for a record, 0 at the end of the data and -1 if a quoted field
+ * is never closed. */
+extern int dm_csv_next(DmCsv *csv, DmCsvField *fields, size_t maxfields, size_t *nfields)
+{
+    char *p = csv->data + csv->pos;
+    char *end = csv->data + csv->size;
+    size_t n = 0;
+
+    if (p >= end)
+        return 0;
+    csv->lineno = csv->next_line;
+    size_t lines = 0; // newlines inside quoted fields
+
+    for (;;) {
+        DmCsvField f;
+
+        if (p < end && *p == '"') {
+            char *out = ++p;
+            f.str = out;
+            for (;;) {
+                if (p >= end)
+                    return -1;
+                if (*p == '"') {
+                    if (p + 1 < end && p[1] == '"') {
+                        *out++ = '"';
+                        p += 2;
+                        continue;
+                    }
+                    p++;
+                    break;
+                }
+                if (*p == '\n')
+                    lines++;
+                if (out != p) // only write (and copy the page) once we've had an escape
+                    *out = *p;
+                out++;
+                p++;
+            }
+            f.len = out - f.str;
+            // be lenient about junk between the closing quote and the delimiter
+            while (p < end && *p != ',' && *p != '\n' && *p != '\r')
+                p++;
+        } else {
+            f.str = p;
+            while (p < end && *p != ',' && *p != '\n')
+                p++;
+            f.len = p - f.str;
+            if (f.len > 0 && f.str[f.len - 1] == '\r')
+                f.len--;
+        }
+
+        if (n < maxfields)
+            fields[n] = f;
+        n++;
+
+        if (p < end && *p == ',') {
+            p++;
+            continue;
+        }
+        if (p < end && *p == '\r')
+            p++;
+        if (p < end && *p == '\n')
+            p++;
+        break;
+    }
+    csv->pos = p - csv->data;
+    *nfields = n;
+    csv->next_line = csv->lineno + lines + 1;
+    return 1;
+}
+
+// Point a Datamapline at the key, sheet and cellref fields of a record
+extern int dm_populate_datamapLine(const DmCsvField *fields, size_t nfields, Datamapline *dml)
+{
+    if (nfields < 3)
+        return 1;
+    dml->key = fields[0];
+    dml->sheet = fields[1];
+    dml->cellref = fields[2];
+    return 0;
+}
+
+
+// Whether table has a column called column; -1 if there's no such table
+static int has_column(sqlite3 *db, const char *table, const char *column)
 {
-    // Example: https://www.lemoda.net/c/sqlite-select/
-    int count = 0;
     sqlite3_stmt *stmt;
-    
-    const char *sql = "SELECT datamap_line.cellref FROM datamap_line WHERE datamap_line.sheet = ?";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int found = -1;
+
+    int rc = sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info(?)", -1, &stmt, NULL);
     dm_sql_check_error(rc, db);
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (found < 0)
+            found = 0;
+        found |= strcmp((const char *)sqlite3_column_text(stmt, 0), column) == 0;
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
 
-    sqlite3_bind_text(stmt, 1, sheetname, -1, SQLITE_TRANSIENT);
-
-    while(1) {
-        int s;
-        s = sqlite3_step(stmt);
-        if (s == SQLITE_ROW) {
-            const unsigned char *cellref_text;
-            cellref_text = sqlite3_column_text(stmt, 0);
-            printf("Cellref: %s\n", cellref_text);
-           
-            cellrefs[count] = malloc(strlen((char *)cellref_text+1));
-            strcpy(cellrefs[count], cellref_text);
-            count++;
-        }
-        else if (s == SQLITE_DONE) {
-            break;
+/* Bring datamap tables from an older database up to date: the datamap's
+ * revision and the triggers that bump it, datamap_line's columns for
+ * validation rules, and the indexes. Returns 0 if there is nothing to do
+ * or it worked. */
+extern int dm_upgrade_datamap_line(sqlite3 *db)
+{
+    int has_rules = has_column(db, "datamap_line", "pattern");
+    int has_revision = has_column(db, "datamap", "revision");
+
+    if (has_rules < 0 || has_revision < 0)
+        return 0;
+    if (has_rules && has_revision)
+        return dm_exec_sql_stmt(dm_sql_str_create_index_datamap, db) != SQLITE_OK;
+    if (dm_exec_sql_stmt("BEGIN TRANSACTION;", db) != SQLITE_OK)
+        return 1;
+    if ((!has_revision && dm_exec_sql_stmt("ALTER TABLE datamap ADD COLUMN revision INTEGER NOT NULL DEFAULT 0;",
+                                           db) != SQLITE_OK)
+            || (!has_rules && dm_exec_sql_stmt("ALTER TABLE datamap_line ADD COLUMN type TEXT;"
+                                               "ALTER TABLE datamap_line ADD COLUMN min REAL;"
+                                               "ALTER TABLE datamap_line ADD COLUMN max REAL;"
+                                               "ALTER TABLE datamap_line ADD COLUMN pattern TEXT;"
+                                               "ALTER TABLE datamap_line ADD COLUMN allowed TEXT;", db) != SQLITE_OK)
+            || dm_exec_sql_stmt(dm_sql_str_create_trigger_datamap, db) != SQLITE_OK
+            || dm_exec_sql_stmt(dm_sql_str_create_index_datamap, db) != SQLITE_OK) {
+        dm_exec_sql_stmt("ROLLBACK;", db);
+        return 1;
+    }
+    return dm_exec_sql_stmt("COMMIT;", db) != SQLITE_OK;
+}
+
+// The optional rule columns of a datamap file, in the order they are stored
+enum {RULE_TYPE, RULE_MIN, RULE_MAX, RULE_PATTERN, RULE_ALLOWED, NRULE_COLUMNS};
+static const char *rule_columns[NRULE_COLUMNS] = {"type", "min", "max", "pattern", "allowed"};
+
+/* Which field of each record holds each rule column, from the header; -1 if
+ * none does. Only the first DM_CSV_MAX_FIELDS were kept, so a rule column
+ * past those is ignored. */
+static void find_rule_columns(const DmCsvField *header, size_t nfields, int *cols)
+{
+    size_t kept = nfields < DM_CSV_MAX_FIELDS ? nfields : DM_CSV_MAX_FIELDS;
+
+    for (int c = 0; c < NRULE_COLUMNS; c++) {
+        cols[c] = -1;
+        for (size_t f = 3; f < kept; f++) {
+            if (header[f].len == strlen(rule_columns[c])
+                    && strncasecmp(header[f].str, rule_columns[c], header[f].len) == 0)
+                cols[c] = (int)f;
         }
-        else {
-            fprintf(stderr, "Failed.\n");
-            exit(-1);
+    }
+}
+
+/* Check a line's rule columns and fill in rule from them. Each is copied
+ * into text[c], NULL where it is empty, which the caller frees; rule's
+ * pattern and allowed are left to the caller. Returns 1, with a message,
+ * if the rule is no good. */
+static int read_rule(const DmCsvField *fields, const int *cols, char **text, size_t lineno, DmRule *rule)
+{
+    regex_t re;
+
+    for (int c = 0; c < NRULE_COLUMNS; c++)
+        text[c] = NULL;
+    for (int c = 0; c < NRULE_COLUMNS; c++) {
+        if (cols[c] < 0 || fields[cols[c]].len == 0)
+            continue;
+        if ((text[c] = malloc(fields[cols[c]].len + 1)) == NULL)
+            return 1;
+        memcpy(text[c], fields[cols[c]].str, fields[cols[c]].len);
+        text[c][fields[cols[c]].len] = '\0';
+    }
+    if (dm_rule_parse(text[RULE_TYPE], text[RULE_MIN], text[RULE_MAX], rule)) {
+        fprintf(stderr, "Line %zu: type must be text, integer, real, number or boolean,"
+                        " and min and max numbers. Skipping.\n", lineno);
+        return 1;
+    }
+    if (text[RULE_PATTERN]) {
+        if (dm_rule_compile(text[RULE_PATTERN], &re)) {
+            fprintf(stderr, "Line %zu: '%s' is not a regular expression. Skipping.\n", lineno, text[RULE_PATTERN]);
+            return 1;
         }
+        regfree(&re);
     }
-    return count;
+    return 0;
 }
 
+// As read_rule(), binding the rule columns to the insert, as NULL where they are empty
+static int bind_rule(sqlite3_stmt *stmt, const DmCsvField *fields, const int *cols, char **text, size_t lineno)
+{
+    DmRule rule;
+
+    if (read_rule(fields, cols, text, lineno, &rule))
+        return 1;
+    for (int c = 0; c < NRULE_COLUMNS; c++) {
+        if (text[c] == NULL)
+            sqlite3_bind_null(stmt, 6 + c);
+        else if (c == RULE_MIN || c == RULE_MAX)
+            sqlite3_bind_double(stmt, 6 + c, c == RULE_MIN ? rule.min : rule.max);
+        else
+            sqlite3_bind_text(stmt, 6 + c, text[c], -1, SQLITE_STATIC);
+    }
+    return 0;
+}
 
 /* Import a datamap file into the database */
 /* dm_name is a name a user can add - CHECK THIS */
@@ -155,6 +587,13 @@ extern int populate_array_cellrefs_for_sheet(sqlite3 *db, char *sheetname, const
 extern int dm_import_dm(char *dm_path, char *dm_name, int dm_overwrite)
 {
     sqlite3 *db;
+    DmCsv csv;
+
+    /* Let's get on with opening the file before we touch the database. */
+    if (dm_csv_open(&csv, dm_path)) {
+        fprintf(stderr, "Cannot open datamap file %s\n", dm_path);
+        return 1;
+    }
 
     // returns a return code
     int rc = sqlite3_open("test.db", &db);
@@ -166,229 +605,1386 @@ extern int dm_import_dm(char *dm_path, char *dm_name, int dm_overwrite)
     // SQL to create the tables
     if(dm_overwrite) {
         fprintf(stdout, "Creating new tables in database.\n");
+        rc = dm_exec_sql_stmt(dm_sql_str_drop_table_return, db);
         rc = dm_exec_sql_stmt(dm_sql_str_create_table_datamap, db);
         rc = dm_exec_sql_stmt(dm_sql_str_create_table_datamapline, db);
+        rc = dm_exec_sql_stmt(dm_sql_str_create_trigger_datamap, db);
+        rc = dm_exec_sql_stmt(dm_sql_str_create_index_datamap, db);
+        rc = dm_exec_sql_stmt(dm_sql_str_create_table_return, db);
+    } else if (dm_upgrade_datamap_line(db)) {
+        dm_csv_close(&csv);
+        sqlite3_close(db);
+        return 1;
     }
 
+    dm_exec_sql_stmt("BEGIN TRANSACTION;", db);
+
     // prep datamap create sql
     sqlite3_stmt *dm_create_stmt;
-    const char *dm_sql = "INSERT INTO datamap VALUES (?,?,?)";
+    const char *dm_sql = "INSERT INTO datamap(id, name, date_created) VALUES (?,?,datetime('now', 'localtime'))";
     rc = sqlite3_prepare_v2(db, dm_sql, -1, &dm_create_stmt, NULL);
     dm_sql_check_error(rc, db);
 
-    // prep date sql to be used in datamap entry
-    const char *date_sql = "SELECT datetime('now', 'localtime')";
-    char date_str[23]; // the output of SELECT datetime() is 23 chars
-    rc = sqlite3_exec(db, date_sql, exec_callback, &date_str, NULL);
-    dm_sql_check_error(rc, db);
-
     // bind params
     sqlite3_bind_text(dm_create_stmt, 2, dm_name, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(dm_create_stmt, 3, date_str, -1, SQLITE_TRANSIENT);
 
     // now execute the command to create the datamap entry
     rc = sqlite3_step(dm_create_stmt);
+    sqlite3_finalize(dm_create_stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error #%d: %s\n", rc, sqlite3_errmsg(db));
+        goto fail;
+    }
 
-    int last_id = sqlite3_last_insert_rowid(db);
-
-    /* Let's get on with opening the file and reading the stuff in. */ 
-    FILE *stream = fopen(dm_path, "r");
-    
-    int lineno = 1;
-    char line[1024];
-    int expected_fields = 0;
-    int fields;
+    sqlite3_int64 last_id = sqlite3_last_insert_rowid(db);
 
+    // One statement, prepared once and rebound for every line
     sqlite3_stmt *compiled_statement;
+    const char *insert_sql = "INSERT INTO datamap_line(id, dm_id, key, sheet, cellref, type, min, max, pattern, allowed)"
+                             " VALUES(?,?,?,?,?,?,?,?,?,?);";
+    rc = sqlite3_prepare_v2(db, insert_sql, -1, &compiled_statement, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_int64(compiled_statement, 2, last_id);
 
-    const char *insert_sql = "INSERT INTO datamap_line VALUES(?,?,?,?,?);";
-    
-    char *err_msg;
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &err_msg);
-
-    while (fgets(line, 1024, stream))
-    {
-        char tmp[1024];
-        strcpy(tmp, line);
-
-        if (lineno == 1) {
-            expected_fields = get_fields(line, strlen(tmp));
-            // we want to increment lineno here but we delay this
-            // until after we have called get_fields()
-        } 
-        
-        fields = get_fields(line, strlen(tmp));
-        if (fields != expected_fields) {
-            printf("Incorrect fields in line %s", tmp);
-            printf("We do not allow narrative-style keys.\n");     
+    DmCsvField fields[DM_CSV_MAX_FIELDS];
+    size_t nfields;
+    size_t expected_fields = 0;
+    size_t imported = 0;
+    int rule_cols[NRULE_COLUMNS];
+    int got;
+
+    while ((got = dm_csv_next(&csv, fields, DM_CSV_MAX_FIELDS, &nfields)) == 1) {
+        Datamapline dml;
+        size_t row, col;
+
+        // skip blank lines
+        if (nfields == 1 && fields[0].len == 0)
+            continue;
+
+        // The first record is the header: it tells us how many fields to expect
+        if (expected_fields == 0) {
+            expected_fields = nfields;
+            find_rule_columns(fields, nfields, rule_cols);
             continue;
         }
-        
-        // We use lineno for two purposes: to get header row
-        // using get_fields() and for skipping the header row
-        // when we import into database.
-        if (lineno == 1) {
-            lineno++;
+        if (nfields != expected_fields || dm_populate_datamapLine(fields, nfields, &dml)) {
+            fprintf(stderr, "Line %zu: expected %zu fields, found %zu. Skipping.\n",
+                    csv.lineno, expected_fields, nfields);
             continue;
         }
 
-        /* We pass in a shell of a struct to be populatum */
-        Datamapline *dml = malloc(sizeof(Datamapline));
-        if (populate_datamapLine(line, dml) == 1) {
-            printf("Something went very wrong\n");
-            return 1;
+        // the cellref has to be something we'll be able to find in a sheet
+        char cellref[DM_RANGEREF_MAX] = "";
+        size_t last_row, last_col;
+        if (dml.cellref.len < DM_RANGEREF_MAX) {
+            memcpy(cellref, dml.cellref.str, dml.cellref.len);
+            cellref[dml.cellref.len] = '\0';
+        }
+        if (dm_parse_range(cellref, &row, &col, &last_row, &last_col)) {
+            fprintf(stderr, "Line %zu: '%.*s' is not a cell reference or range. Skipping.\n",
+                    csv.lineno, (int)dml.cellref.len, dml.cellref.str);
+            continue;
         }
-    
-        rc = sqlite3_prepare_v2(db, insert_sql, -1, &compiled_statement, NULL);
-        dm_sql_check_error(rc, db);
-        
-        sqlite3_bind_int64(compiled_statement, 2, last_id);
-        sqlite3_bind_text(compiled_statement, 3, dml->key, strlen(dml->key),SQLITE_TRANSIENT);
-        sqlite3_bind_text(compiled_statement, 4, dml->sheet, strlen(dml->sheet),SQLITE_TRANSIENT);
-        sqlite3_bind_text(compiled_statement, 5, dml->cellref, strlen(dml->cellref),SQLITE_TRANSIENT);
 
-        rc = sqlite3_step(compiled_statement);
+        sqlite3_bind_text(compiled_statement, 3, dml.key.str, (int)dml.key.len, SQLITE_STATIC);
+        sqlite3_bind_text(compiled_statement, 4, dml.sheet.str, (int)dml.sheet.len, SQLITE_STATIC);
+        sqlite3_bind_text(compiled_statement, 5, dml.cellref.str, (int)dml.cellref.len, SQLITE_STATIC);
+
+        char *rule_text[NRULE_COLUMNS];
+        int bad_rule = bind_rule(compiled_statement, fields, rule_cols, rule_text, csv.lineno);
+        if (!bad_rule) {
+            rc = sqlite3_step(compiled_statement);
+            sqlite3_reset(compiled_statement);
+        }
+        for (int c = 0; c < NRULE_COLUMNS; c++)
+            free(rule_text[c]);
+        if (bad_rule)
+            continue;
 
         if(rc != SQLITE_DONE) {
             fprintf(stderr, "Error #%d: %s\n", rc, sqlite3_errmsg(db));
-            sqlite3_close(db);
-            return rc;
+            sqlite3_finalize(compiled_statement);
+            goto fail;
         }
+        imported++;
+    }
+    sqlite3_finalize(compiled_statement);
 
-        /* sqlite3_finalize(compiled_statement); */
-        /* sqlite3_clear_bindings(compiled_statement); */
-        /* sqlite3_reset(compiled_statement); */
+    if (got < 0) {
+        fprintf(stderr, "Line %zu: quoted field is never closed.\n", csv.lineno);
+        goto fail;
+    }
 
-        /* printf("%-10s %s\n", "Key:",  dml->key); */
-        /* printf("%-10s %s\n", "Sheet:",  dml->sheet); */
-        /* printf("%-10s %s\n", "Cellref:", dml->cellref); */
+    dm_exec_sql_stmt("COMMIT;", db);
+    printf("Imported %zu datamap lines as '%s'.\n", imported, dm_name);
 
-        free(dml);
-        sqlite3_clear_bindings(compiled_statement);
-        sqlite3_reset(compiled_statement);
-        sqlite3_finalize(compiled_statement);
-    }
-        sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &err_msg);
+    // compile it now so spreadsheet imports can just map it
+    if (imported > 0 && dm_cache_rebuild(db, dm_name))
+        fprintf(stderr, "Unable to write compiled datamap for '%s'.\n", dm_name);
 
-        sqlite3_close(db);
-        return 0;
+    dm_csv_close(&csv);
+    sqlite3_close(db);
+    return 0;
+
+fail:
+    dm_exec_sql_stmt("ROLLBACK;", db);
+    dm_csv_close(&csv);
+    sqlite3_close(db);
+    return 1;
 }
 
 /* -- ccompiler-engine code --------------------------------*/
 
 
-unsigned count = 0;
+// The sheets found in a workbook, filled in by list_sheets_callback
+struct sheet_list {
+    const char **names;
+    size_t count;
+    size_t size;
+    DmArena *arena; // names, and the array of them, live here
+};
 
 int list_sheets_callback(const char *sheetname, void *callbackdata) {
-    char **d = (char **)callbackdata;
-    strcpy(d[count], sheetname); // CRUCIAL - I was mistakenly doing d[count] = sheetname here. WRONG.
-    printf("Sheetname in sheets array is: %s\n", d[count]);
-    count++;
+    struct sheet_list *d = (struct sheet_list *)callbackdata;
+    if (d->count == d->size) {
+        size_t size = d->size ? d->size * 2 : 16;
+        const char **names = dm_arena_alloc(d->arena, size * sizeof(char *));
+        if (names == NULL)
+            return 1;
+        if (d->count)
+            memcpy(names, d->names, d->count * sizeof(char *));
+        d->names = names;
+        d->size = size;
+    }
+    d->names[d->count] = dm_arena_strdup(d->arena, sheetname); // CRUCIAL - we need our own copy, not xlsxio's pointer
+    if (d->names[d->count] == NULL)
+        return 1;
+    d->count++;
     return 0;
 }
 
+static int sheet_list_contains(const struct sheet_list *d, const char *sheetname) {
+    for (size_t i = 0; i < d->count; i++) {
+        if (strcmp(d->names[i], sheetname) == 0)
+            return 1;
+    }
+    return 0;
+}
 
 //callback data structure
 struct xlsx_callback_data {
-    char *sheetname;
-    const char ** cellrefs_arry;
-    size_t cellrefs_size;
+    const DmDatamap *dm;
+    const DmSheet *sheet; // the datamap's view of the sheet being processed
+    DmReturn *ret;        // where matched values go
+    // the sheet's range lines that the current row runs through
+    uint32_t *active;
+    size_t nactive;
+    size_t next_range; // the first of the sheet's ranges not reached yet
+    size_t row;        // the row active is for
 };
 
 
+// Called at the end of every row. Once the last row the datamap wants from
+// this sheet is done we return non-zero, which makes xlsxio stop reading the
+// sheet rather than walk the formatted-but-empty rows to the bottom.
 int rowcallback(size_t row, size_t maxcol, void* callbackdata) {
-    /* printf("In rowcallback BUT THIS IS SELDOM USED!\n"); */
-    return 0;
+    struct xlsx_callback_data *data = (struct xlsx_callback_data *) callbackdata;
+    data->ret->stats.rows++;
+    return row >= data->sheet->max_row;
 }
 
 
-int get_all_sheet_and_cellrefs_from_datamap_in_sqlite3(sqlite3 *dm, char *dm_name) {
-    // this needs to call this SQL:
-    // select datamap_line.sheet, datamap_line.cellref from datamap join datamap_line where datamap.name = (?);
-    // value here needs to dm_name obviously
+/* Give line, just added to dm, a copy of rule. Returns 1 if out of memory. */
+static int add_rule(DmDatamap *dm, size_t *size, DmLine *line, const DmRule *rule)
+{
+    if (dm->nrules == *size) {
+        *size = *size ? *size * 2 : 32;
+        DmRule *rules = realloc(dm->rules, *size * sizeof(DmRule));
+        if (rules == NULL)
+            return 1;
+        dm->rules = rules;
+    }
+    DmRule *copy = &dm->rules[dm->nrules];
+    *copy = *rule;
+    if (rule->pattern && (copy->pattern = dm_arena_strdup(&dm->arena, rule->pattern)) == NULL)
+        return 1;
+    if (rule->allowed && (copy->allowed = dm_arena_strdup(&dm->arena, rule->allowed)) == NULL)
+        return 1;
+    line->rule = (uint32_t)++dm->nrules;
     return 0;
 }
 
+/* Columns 5 to 9 of a datamap_line row are its rule. If it has one, add it
+ * to dm->rules and point line at it. Returns 1 if out of memory. */
+static int line_rule(sqlite3_stmt *stmt, DmDatamap *dm, size_t *size, DmLine *line)
+{
+    DmRule rule;
+    int any = 0;
 
-int sheet_cell_callback(size_t row, size_t maxcol, const char* value,  void* callbackdata) {
-    struct xlsx_callback_data *data = (struct xlsx_callback_data *) callbackdata;
+    for (int c = 5; c <= 9; c++)
+        any |= sqlite3_column_type(stmt, c) != SQLITE_NULL;
+    if (!any)
+        return 0;
 
-    int in = 0; // counter, for iterating through the array
+    // the import checked it, so only an edit could spoil it
+    if (dm_rule_parse((const char *)sqlite3_column_text(stmt, 5), NULL, NULL, &rule))
+        fprintf(stderr, "Ignoring bad type '%s' for key %s\n", sqlite3_column_text(stmt, 5), line->key);
+    if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
+        rule.min = sqlite3_column_double(stmt, 6);
+        rule.flags |= DM_RULE_MIN;
+    }
+    if (sqlite3_column_type(stmt, 7) != SQLITE_NULL) {
+        rule.max = sqlite3_column_double(stmt, 7);
+        rule.flags |= DM_RULE_MAX;
+    }
+    rule.pattern = (char *)sqlite3_column_text(stmt, 8);
+    rule.allowed = (char *)sqlite3_column_text(stmt, 9);
+    return add_rule(dm, size, line, &rule);
+}
 
-    char row_s[5];
-    sprintf(row_s, "%d", (int)row);
+/* Add a line to dm, which is built a sheet at a time: a sheetname other
+ * than the last line's starts a new DmSheet. Returns the line, or NULL if
+ * out of memory. */
+static DmLine *add_line(DmDatamap *dm, size_t *lines_size, size_t *sheets_size, int64_t id, const char *key,
+                        const char *sheetname, size_t row, size_t col, size_t last_row, size_t last_col)
+{
+    if (dm->nsheets == 0 || strcmp(dm->sheets[dm->nsheets - 1].name, sheetname) != 0) {
+        if (dm->nsheets == *sheets_size) {
+            *sheets_size = *sheets_size ? *sheets_size * 2 : 8;
+            DmSheet *sheets = realloc(dm->sheets, *sheets_size * sizeof(DmSheet));
+            if (sheets == NULL)
+                return NULL;
+            dm->sheets = sheets;
+        }
+        DmSheet *sheet = &dm->sheets[dm->nsheets];
+        sheet->name = dm_arena_strdup(&dm->arena, sheetname);
+        sheet->first_line = dm->nlines;
+        sheet->nlines = 0;
+        sheet->min_row = sheet->min_col = UINT32_MAX;
+        sheet->max_row = sheet->max_col = 0;
+        if (sheet->name == NULL || dm_index_init(&sheet->index, 64))
+            return NULL;
+        dm->nsheets++;
+    }
 
-    char column_s[5];
-    sprintf(column_s, "%c", (char)(maxcol+64));
+    if (dm->nlines == *lines_size) {
+        *lines_size = *lines_size ? *lines_size * 2 : 256;
+        DmLine *lines = realloc(dm->lines, *lines_size * sizeof(DmLine));
+        if (lines == NULL)
+            return NULL;
+        dm->lines = lines;
+    }
+    DmLine *line = &dm->lines[dm->nlines];
+    line->id = id;
+    line->key = dm_arena_strdup(&dm->arena, key);
+    line->sheet = (uint32_t)(dm->nsheets - 1);
+    line->row = (uint32_t)row;
+    line->col = (uint32_t)col;
+    line->last_row = (uint32_t)last_row;
+    line->last_col = (uint32_t)last_col;
+    line->rule = 0;
+    line->next = 0;
+    if (line->key == NULL)
+        return NULL;
+
+    // ranges are found by dm_datamap_layout(), not by hashing. A cell that
+    // another key already wants gets this line chained on after it.
+    DmSheet *sheet = &dm->sheets[dm->nsheets - 1];
+    const DmCellSlot *slot;
+    if (!DM_LINE_IS_RANGE(line)) {
+        if ((slot = dm_index_find(&sheet->index, row, col)) != NULL) {
+            uint32_t l = slot->line;
+            while (dm->lines[l].next)
+                l = dm->lines[l].next - 1;
+            dm->lines[l].next = (uint32_t)dm->nlines + 1;
+        } else if (dm_index_add(&sheet->index, row, col, (uint32_t)dm->nlines)) {
+            return NULL;
+        }
+    }
+    if (line->row < sheet->min_row) sheet->min_row = line->row;
+    if (line->last_row > sheet->max_row) sheet->max_row = line->last_row;
+    if (line->col < sheet->min_col) sheet->min_col = line->col;
+    if (line->last_col > sheet->max_col) sheet->max_col = line->last_col;
+    sheet->nlines++;
+    dm->nlines++;
+    return line;
+}
 
+/* When xlsioreader traverses a sheet, it happens upon every cell in every row.
+ * We only want to get values from cells which are contained in the datamap
+ * - particularly a Datamapline.sheet/Datamapline.cellref combination.
+ *
+ * We don't want to do be doing a SQL SELECT statement every time, or compare
+ * strings for every cell, so the whole datamap is pulled with one query,
+ * grouped by sheet, and each cellref is decoded once into a packed (row, col)
+ * key in its sheet's DmCellIndex. The sheet callback then does a single hash
+ * probe per cell. Lines whose cellref is a range (a table such as
+ * "AB10:AF200") are kept as their bounds instead and found by a sweep down
+ * the sheet; see advance_ranges(). Where more than one datamap shares
+ * dm_name, the most recently imported one wins.
+ *
+ * Returns 0 on success, 1 if the datamap could not be loaded.
+ */
+extern int get_all_sheet_and_cellrefs_from_datamap_in_sqlite3(sqlite3 *db, char *dm_name, DmDatamap *dm)
+{
+    sqlite3_stmt *stmt;
+    size_t lines_size = 0, sheets_size = 0, rules_size = 0;
 
-    char *cref = strcat(column_s, row_s); // cref is cellref that xlsxreader is on in the loop
+    memset(dm, 0, sizeof(DmDatamap));
 
-    for (int x=0; x < data->cellrefs_size; x++) {
-        if(strcmp(cref, data->cellrefs_arry[x]) == 0) {
-            in = 1;
-            break;
+    const char *sql = "SELECT datamap_line.dm_id, datamap_line.id, datamap_line.key,"
+                      "       datamap_line.sheet, datamap_line.cellref,"
+                      "       datamap_line.type, datamap_line.min, datamap_line.max,"
+                      "       datamap_line.pattern, datamap_line.allowed"
+                      "  FROM datamap_line"
+                      " WHERE datamap_line.dm_id = (SELECT MAX(id) FROM datamap WHERE name = ?)"
+                      " ORDER BY datamap_line.sheet, datamap_line.id";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+
+    sqlite3_bind_text(stmt, 1, dm_name, -1, SQLITE_TRANSIENT);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *key = (const char *)sqlite3_column_text(stmt, 2);
+        const char *sheetname = (const char *)sqlite3_column_text(stmt, 3);
+        const char *cellref = (const char *)sqlite3_column_text(stmt, 4);
+        size_t row, col, last_row, last_col;
+
+        if (cellref == NULL || dm_parse_range(cellref, &row, &col, &last_row, &last_col)) {
+            fprintf(stderr, "Ignoring bad cellref '%s' for key %s\n", cellref ? cellref : "", key);
+            continue;
         }
+
+        dm->id = sqlite3_column_int64(stmt, 0);
+
+        // rows arrive ordered by sheet
+        DmLine *line = add_line(dm, &lines_size, &sheets_size, sqlite3_column_int64(stmt, 1), key, sheetname,
+                                row, col, last_row, last_col);
+        if (line == NULL || line_rule(stmt, dm, &rules_size, line))
+            goto oom;
     }
-    if (in == 1) {
-        if(strcmp(data->sheetname, "Introduction") == 0) {
-            printf("Sheet: %-10s Row: %-6ld Col: %-10c Value: %s\n", data->sheetname, row, (char)maxcol+64, value);
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error #%d: %s\n", rc, sqlite3_errmsg(db));
+        dm_datamap_free(dm);
+        return 1;
+    }
+    if (dm->nlines == 0) {
+        fprintf(stderr, "No datamap called '%s' found in the database.\n", dm_name);
+        return 1;
+    }
+    if (dm_datamap_layout(dm)) {
+        fprintf(stderr, "Out of memory.\n");
+        dm_datamap_free(dm);
+        return 1;
+    }
+    return 0;
+
+oom:
+    fprintf(stderr, "Out of memory.\n");
+    sqlite3_finalize(stmt);
+    dm_datamap_free(dm);
+    return 1;
+}
+
+// A datamap CSV line waiting for the others on its sheet
+struct csv_line {
+    size_t lineno;
+    char *key;
+    char *sheet;
+    size_t row, col, last_row, last_col;
+    int has_rule;
+    DmRule rule;
+};
+
+// By sheet and then by where they were in the file
+static int compare_csv_lines(const void *a, const void *b)
+{
+    const struct csv_line *x = a, *y = b;
+    int c = strcmp(x->sheet, y->sheet);
+    if (c != 0)
+        return c;
+    return x->lineno < y->lineno ? -1 : x->lineno > y->lineno;
+}
+
+static char *field_strdup(DmArena *arena, const DmCsvField *f)
+{
+    char *s = dm_arena_alloc(arena, f->len + 1);
+    if (s) {
+        memcpy(s, f->str, f->len);
+        s[f->len] = '\0';
+    }
+    return s;
+}
+
+/* Compile the datamap CSV file at path into dm without going near the
+ * database, as dm_import_dm() and then dm_load_datamap() would, rules
+ * included. Lines are numbered (DmLine.id) by where they are in the file.
+ * Bad lines are skipped with a message, as dm_import_dm() does.
+ *
+ * Returns 0 on success, 1 if the file can't be read or has no usable lines. */
+extern int dm_datamap_compile_csv(const char *path, DmDatamap *dm)
+{
+    DmCsv csv;
+    DmCsvField fields[DM_CSV_MAX_FIELDS];
+    DmArena scratch = {0};
+    struct csv_line *pending = NULL;
+    size_t npending = 0, pending_size = 0, nfields, expected_fields = 0;
+    size_t lines_size = 0, sheets_size = 0, rules_size = 0;
+    int rule_cols[NRULE_COLUMNS];
+    int got, err = 0;
+
+    memset(dm, 0, sizeof(DmDatamap));
+    if (dm_csv_open(&csv, path)) {
+        fprintf(stderr, "Cannot open datamap file %s\n", path);
+        return 1;
+    }
+
+    while (!err && (got = dm_csv_next(&csv, fields, DM_CSV_MAX_FIELDS, &nfields)) == 1) {
+        Datamapline dml;
+        char cellref[DM_RANGEREF_MAX] = "";
+        char *rule_text[NRULE_COLUMNS];
+
+        if (nfields == 1 && fields[0].len == 0)
+            continue;
+        if (expected_fields == 0) {
+            expected_fields = nfields;
+            find_rule_columns(fields, nfields, rule_cols);
+            continue;
+        }
+        if (nfields != expected_fields || dm_populate_datamapLine(fields, nfields, &dml)) {
+            fprintf(stderr, "Line %zu: expected %zu fields, found %zu. Skipping.\n",
+                    csv.lineno, expected_fields, nfields);
+            continue;
+        }
+        if (pending_size == npending) {
+            pending_size = pending_size ? pending_size * 2 : 256;
+            struct csv_line *p = realloc(pending, pending_size * sizeof(struct csv_line));
+            if (p == NULL) {
+                err = 1;
+                break;
+            }
+            pending = p;
         }
+        struct csv_line *l = &pending[npending];
+        if (dml.cellref.len < DM_RANGEREF_MAX) {
+            memcpy(cellref, dml.cellref.str, dml.cellref.len);
+            cellref[dml.cellref.len] = '\0';
+        }
+        if (dm_parse_range(cellref, &l->row, &l->col, &l->last_row, &l->last_col)) {
+            fprintf(stderr, "Line %zu: '%.*s' is not a cell reference or range. Skipping.\n",
+                    csv.lineno, (int)dml.cellref.len, dml.cellref.str);
+            continue;
+        }
+        int bad_rule = read_rule(fields, rule_cols, rule_text, csv.lineno, &l->rule);
+        l->has_rule = 0;
+        for (int c = 0; c < NRULE_COLUMNS; c++)
+            l->has_rule |= rule_text[c] != NULL;
+        // copied again into dm by add_rule()
+        l->rule.pattern = rule_text[RULE_PATTERN] ? dm_arena_strdup(&scratch, rule_text[RULE_PATTERN]) : NULL;
+        l->rule.allowed = rule_text[RULE_ALLOWED] ? dm_arena_strdup(&scratch, rule_text[RULE_ALLOWED]) : NULL;
+        for (int c = 0; c < NRULE_COLUMNS; c++)
+            free(rule_text[c]);
+        if (bad_rule)
+            continue;
+        l->lineno = csv.lineno;
+        l->key = field_strdup(&scratch, &dml.key);
+        l->sheet = field_strdup(&scratch, &dml.sheet);
+        if (l->key == NULL || l->sheet == NULL)
+            err = 1;
+        npending++;
+    }
+    dm_csv_close(&csv);
+    if (!err && got < 0) {
+        fprintf(stderr, "Line %zu: quoted field is never closed.\n", csv.lineno);
+        err = 1;
+    }
+
+    // lines have to be grouped by sheet, as they are coming out of SQLite
+    if (npending)
+        qsort(pending, npending, sizeof(struct csv_line), compare_csv_lines);
+    for (size_t i = 0; !err && i < npending; i++) {
+        const struct csv_line *l = &pending[i];
+        DmLine *line = add_line(dm, &lines_size, &sheets_size, (int64_t)l->lineno, l->key, l->sheet,
+                                l->row, l->col, l->last_row, l->last_col);
+        if (line == NULL || (l->has_rule && add_rule(dm, &rules_size, line, &l->rule))) {
+            fprintf(stderr, "Out of memory.\n");
+            err = 1;
+        }
+    }
+    free(pending);
+    dm_arena_free(&scratch);
+
+    if (!err && dm->nlines == 0) {
+        fprintf(stderr, "No usable lines in datamap file %s\n", path);
+        err = 1;
+    }
+    if (!err && dm_datamap_layout(dm)) {
+        fprintf(stderr, "Out of memory.\n");
+        err = 1;
+    }
+    if (err)
+        dm_datamap_free(dm);
+    return err;
+}
+
+/* Give every line its value slots, in line order, and list each sheet's
+ * range lines in dm->ranges ordered by first row, which is the order the
+ * sheet callback comes across them. Lines must already carry their sheet
+ * and bounds. Returns 0 on success, 1 if out of memory. */
+extern int dm_datamap_layout(DmDatamap *dm)
+{
+    size_t nranges = 0;
+
+    dm->nvalues = 0;
+    for (size_t i = 0; i < dm->nlines; i++) {
+        dm->lines[i].value = (uint32_t)dm->nvalues;
+        dm->nvalues += DM_LINE_CELLS(&dm->lines[i]);
+        if (DM_LINE_IS_RANGE(&dm->lines[i]))
+            nranges++;
+    }
+
+    free(dm->ranges);
+    dm->ranges = NULL;
+    dm->nranges = 0;
+    if (nranges && (dm->ranges = malloc(nranges * sizeof(uint32_t))) == NULL)
+        return 1;
+    for (size_t s = 0; s < dm->nsheets; s++) {
+        DmSheet *sheet = &dm->sheets[s];
+        sheet->first_range = dm->nranges;
+        sheet->nranges = 0;
+        for (size_t i = 0; i < dm->nlines; i++) {
+            const DmLine *line = &dm->lines[i];
+            if (line->sheet != s || !DM_LINE_IS_RANGE(line))
+                continue;
+            // insertion sort: a sheet has a handful of tables, not thousands
+            uint32_t *r = &dm->ranges[sheet->first_range];
+            size_t j = sheet->nranges++;
+            for (; j > 0 && dm->lines[r[j - 1]].row > line->row; j--)
+                r[j] = r[j - 1];
+            r[j] = (uint32_t)i;
+        }
+        dm->nranges += sheet->nranges;
+    }
+    return 0;
+}
+
+extern void dm_datamap_free(DmDatamap *dm)
+{
+    if (dm->image) {
+        // names, keys, index slots and ranges all point into the image
+        munmap(dm->image, dm->image_size);
     } else {
+        for (size_t i = 0; i < dm->nsheets; i++)
+            dm_index_free(&dm->sheets[i].index);
+        free(dm->ranges);
+    }
+    for (size_t i = 0; i < dm->nregexes; i++)
+        regfree(&dm->regexes[i]);
+    free(dm->regexes);
+    free(dm->rules);
+    dm_arena_free(&dm->arena);
+    free(dm->sheets);
+    free(dm->lines);
+    memset(dm, 0, sizeof(DmDatamap));
+}
+
+
+// Note that the value in slot broke rule, one of dm's
+static int fail_check(DmReturn *ret, uint32_t line, uint32_t slot, uint32_t rule, DmCheck why)
+{
+    if (ret->nfailures == ret->failures_size) {
+        size_t size = ret->failures_size ? ret->failures_size * 2 : 16;
+        DmCheckFailure *failures = dm_arena_alloc(&ret->arena, size * sizeof(DmCheckFailure));
+        if (failures == NULL)
+            return 1;
+        if (ret->nfailures)
+            memcpy(failures, ret->failures, ret->nfailures * sizeof(DmCheckFailure));
+        ret->failures = failures;
+        ret->failures_size = size;
+    }
+    DmCheckFailure *f = &ret->failures[ret->nfailures++];
+    f->line = line;
+    f->slot = slot;
+    f->rule = rule;
+    f->why = why;
+    ret->stats.checks_failed++;
+    return 0;
+}
+
+/* Keep value in the value slot i of dm's line l, unless it already has
+ * one, and check it against the line's rules as it goes in. */
+static int keep_value(const DmDatamap *dm, DmReturn *ret, uint32_t l, uint32_t i, const char *value)
+{
+    if (ret->values[i] != NULL)
         return 0;
+    // the same few strings ("N/A", "Green") turn up again and again
+    if ((ret->values[i] = dm_arena_intern(&ret->arena, value)) == NULL)
+        return 1;
+    ret->nmatched++;
+    ret->stats.matched++;
+
+    // a merged datamap's cell can have a rule from each datamap
+    for (uint32_t r = dm->lines[l].rule; r; r = dm->rules[r - 1].next) {
+        DmCheck why = dm_rule_check(&dm->rules[r - 1], value);
+        if (why != DM_CHECK_OK && fail_check(ret, l, i, r - 1, why))
+            return 1;
     }
     return 0;
 }
 
+/* Bring data->active up to date for row. Rows only ever go down the sheet,
+ * so this is a sweep: ranges join as their first row is reached (they are
+ * ordered by it) and leave once their last row is passed. */
+static void advance_ranges(struct xlsx_callback_data *data, size_t row)
+{
+    const DmLine *lines = data->dm->lines;
+    const uint32_t *ranges = data->dm->ranges + data->sheet->first_range;
+    size_t n = 0;
 
-extern int read_spreadsheet(char *filepath) {
-    char **sheets = malloc(sizeof(char*) * 40);  // we need to be more flexible here about amount of sheets we can handle
+    for (size_t i = 0; i < data->nactive; i++) {
+        if (lines[data->active[i]].last_row >= row)
+            data->active[n++] = data->active[i];
+    }
+    for (; data->next_range < data->sheet->nranges; data->next_range++) {
+        const DmLine *line = &lines[ranges[data->next_range]];
+        if (line->row > row)
+            break;
+        if (line->last_row >= row)
+            data->active[n++] = ranges[data->next_range];
+    }
+    data->nactive = n;
+    data->row = row;
+}
 
-    sqlite3 *db;
+int sheet_cell_callback(size_t row, size_t col, const char* value,  void* callbackdata) {
+    struct xlsx_callback_data *data = (struct xlsx_callback_data *) callbackdata;
+    const DmSheet *sheet = data->sheet;
+    const DmCellSlot *slot;
 
+    data->ret->stats.cells++;
+    // past the bottom of the datamap's bounding box - stop reading the sheet
+    if (row > sheet->max_row)
+        return 1;
+    // outside the box - no need to hash
+    if (row < sheet->min_row || col < sheet->min_col || col > sheet->max_col || value == NULL)
+        return 0;
+    if ((slot = dm_index_find(&sheet->index, row, col)) != NULL) {
+        // every key on the cell gets the value
+        for (uint32_t l = slot->line + 1; l; l = data->dm->lines[l - 1].next) {
+            if (keep_value(data->dm, data->ret, l - 1, data->dm->lines[l - 1].value, value))
+                return 1;
+        }
+    }
 
-    /********************************************************/
-    /* HERE WE ARE PULLING ALL CELLREFS FROM THIS DATAMAP
-        * Question is - should we be doing that here?? No! This is needed
-        * when we read from a populated spreadsheet */
+    // a cell can be in any number of ranges, as well as being a line itself
+    if (sheet->nranges == 0)
+        return 0;
+    if (row != data->row)
+        advance_ranges(data, row);
+    for (size_t i = 0; i < data->nactive; i++) {
+        const DmLine *line = &data->dm->lines[data->active[i]];
+        if (col < line->col || col > line->last_col)
+            continue;
+        uint32_t offset = (uint32_t)((row - line->row) * DM_LINE_WIDTH(line) + (col - line->col));
+        if (keep_value(data->dm, data->ret, data->active[i], line->value + offset, value))
+            return 1;
+    }
+    return 0;
+}
 
 
+// Read one datamap sheet of an open workbook into ret
+static void extract_sheet(xlsxioreader reader, const DmDatamap *dm, const DmSheet *sheet, DmReturn *ret)
+{
+    struct xlsx_callback_data callbackdata;
+    double t = dm_now();
+
+    memset(&callbackdata, 0, sizeof(callbackdata));
+    callbackdata.dm = dm;
+    callbackdata.sheet = sheet;
+    callbackdata.ret = ret;
+    if (sheet->nranges) {
+        callbackdata.active = dm_arena_alloc(&ret->arena, sheet->nranges * sizeof(uint32_t));
+        if (callbackdata.active == NULL)
+            return;
+    }
+    // sheet_cell_callback() - where we want to do our filtering
+    // empty cells can never yield a value, so don't have xlsxio report them
+    xlsxioread_process(reader, sheet->name, XLSXIOREAD_SKIP_ALL_EMPTY, sheet_cell_callback, rowcallback, &callbackdata);
+    ret->stats.sheet_time += dm_now() - t;
+    ret->stats.sheets_opened++;
+}
 
-    // returns a return code
-    int rc = sqlite3_open("test.db", &db);
-    // handle error if this fails - we use this all over the place
-    dm_sql_check_error(rc, db);
+/* Reading one workbook's sheets on several threads. Each thread has its
+ * own xlsxioreader on the file and takes the next unread sheet from todo
+ * until there are none left. Every datamap line belongs to exactly one
+ * sheet, so the threads write to different slots of the same values
+ * array; strings, counts and stats go into a per-thread part and are
+ * merged into the DmReturn at the end. */
+struct sheet_work {
+    const DmDatamap *dm;
+    const char *filepath;
+    const void *data; // the workbook's bytes, if it isn't read from filepath
+    size_t size;
+    const size_t *todo; // indexes into dm->sheets, all present in the workbook
+    size_t ntodo;
+    size_t next;        // guarded by lock
+    pthread_mutex_t lock;
+};
 
-    rc = dm_exec_sql_stmt("PRAGMA foreign_keys = ON;",  db); // we have to do this every call
-    /* We need to do something with cellrefs here before freeing the memory
-        * This is the index of cellrefs that we want to pull */
+struct sheet_worker {
+    struct sheet_work *work;
+    xlsxioreader reader;
+    DmReturn part; // shares values with the real DmReturn
+    pthread_t thread;
+};
 
-    /* END OF CELLREF PULLING */
+static void extract_sheets(struct sheet_worker *w)
+{
+    for (;;) {
+        pthread_mutex_lock(&w->work->lock);
+        size_t i = w->work->next++;
+        pthread_mutex_unlock(&w->work->lock);
+        if (i >= w->work->ntodo)
+            break;
+        extract_sheet(w->reader, w->work->dm, &w->work->dm->sheets[w->work->todo[i]], &w->part);
+    }
+}
+
+// A reader of our own on the workbook. One in memory is only read, so
+// every thread can have a reader on the same bytes.
+static xlsxioreader open_workbook(const char *filepath, const void *data, size_t size)
+{
+    if (data)
+        return xlsxioread_open_memory((void *)data, size, 0);
+    return xlsxioread_open(filepath);
+}
+
+static void *sheet_thread(void *arg)
+{
+    struct sheet_worker *w = (struct sheet_worker *)arg;
+    double t = dm_now();
+
+    // if we can't have a reader the other threads take our share
+    if ((w->reader = open_workbook(w->work->filepath, w->work->data, w->work->size)) == NULL)
+        return NULL;
+    w->part.stats.open_time = dm_now() - t;
+    extract_sheets(w);
+    xlsxioread_close(w->reader);
+    return NULL;
+}
+
+/* Extract the values dm wants from the workbook at filepath into ret. Only
+ * the sheets named in the datamap are processed; every other sheet in the
+ * workbook is never decompressed or parsed.
+ *
+ * This opens its own xlsxioreader and only reads dm, so any number of
+ * threads can call it at once against the same datamap. Everything put in
+ * ret comes from ret->arena and goes with dm_return_free().
+ *
+ * Returns 0 on success. On failure ret->error says why. */
+extern int dm_extract_workbook(const DmDatamap *dm, const char *filepath, DmReturn *ret)
+{
+    return dm_extract_workbook_parallel(dm, filepath, ret, 1);
+}
+
+/* As dm_extract_workbook(), but the workbook's datamap sheets are shared
+ * out between up to nthreads threads, the calling thread being one of
+ * them. Worth it for a single big workbook with many sheets; in a batch,
+ * the workbooks themselves are already spread over threads. */
+extern int dm_extract_workbook_parallel(const DmDatamap *dm, const char *filepath, DmReturn *ret, int nthreads)
+{
+    return dm_extract_workbook_buffer(dm, filepath, NULL, 0, ret, nthreads);
+}
 
-    for (int i = 0; i < 40; i++) {
-        sheets[i] = malloc((20+1) * sizeof(char));
+/* As dm_extract_workbook_parallel(), but if data is not NULL the workbook
+ * is the size bytes there (read from stdin, or a member of a bundle) and
+ * filepath is only what the return is called. data is not copied and must
+ * stay put until this returns. */
+extern int dm_extract_workbook_buffer(const DmDatamap *dm, const char *filepath, const void *data, size_t size,
+                                      DmReturn *ret, int nthreads)
+{
+    memset(ret, 0, sizeof(DmReturn));
+    ret->filepath = dm_arena_strdup(&ret->arena, filepath);
+    ret->values = dm_arena_calloc(&ret->arena, dm->nvalues ? dm->nvalues : 1, sizeof(char *));
+    if (ret->filepath == NULL || ret->values == NULL) {
+        ret->error = "out of memory";
+        return 1;
     }
 
     xlsxioreader reader;
-    if ((reader = xlsxioread_open(filepath)) == NULL) {
-        fprintf(stderr, "Cannot open file.\n");
-        return 1;
-    }
-    xlsxioread_list_sheets(reader, list_sheets_callback, sheets);
-    printf("First entry in sheets in main after xlsxioread_list_sheets is %s\n", sheets[0]);
-    const char **cellrefs;
-    cellrefs = malloc(1024*sizeof(const char*)); /* A poor guess at the length we need */
-    for (int i=0; i < 5; i++) { // 5 is wrong here
-        int ret_val = populate_array_cellrefs_for_sheet(db, sheets[i], cellrefs);
-        printf("%s\n", sheets[i]);
-        struct xlsx_callback_data callbackdata;
-        callbackdata.sheetname = sheets[i];
-        callbackdata.cellrefs_arry = cellrefs;
-        callbackdata.cellrefs_size = ret_val;
-        // sheet_cell_callback() - where we want to do our filtering
-        xlsxioread_process(reader, sheets[i], XLSXIOREAD_SKIP_EMPTY_ROWS, sheet_cell_callback, rowcallback, &callbackdata);
-    }
-    free(cellrefs);
+    double t = dm_now();
+    if ((reader = open_workbook(filepath, data, size)) == NULL) {
+        ret->error = data ? "not a workbook" : "cannot open file";
+        return 1;
+    }
+
+    // listing sheets only reads the workbook part, not the sheets themselves
+    struct sheet_list sheets = {NULL, 0, 0, &ret->arena};
+    xlsxioread_list_sheets(reader, list_sheets_callback, &sheets);
+    ret->stats.open_time = dm_now() - t;
+
+    size_t *todo = dm_arena_alloc(&ret->arena, (dm->nsheets ? dm->nsheets : 1) * sizeof(size_t));
+    size_t ntodo = 0;
+    if (todo == NULL) {
+        xlsxioread_close(reader);
+        ret->error = "out of memory";
+        return 1;
+    }
+    for (size_t i = 0; i < dm->nsheets; i++) {
+        if (sheet_list_contains(&sheets, dm->sheets[i].name))
+            todo[ntodo++] = i;
+        else
+            fprintf(stderr, "Sheet '%s' is in the datamap but not in %s\n", dm->sheets[i].name, filepath);
+    }
+
+    if (nthreads > (int)ntodo)
+        nthreads = (int)ntodo;
+    struct sheet_worker *workers = NULL;
+    if (nthreads > 1)
+        workers = calloc(nthreads, sizeof(struct sheet_worker));
+    if (workers == NULL) {
+        // one thread: no need for any of the machinery
+        for (size_t i = 0; i < ntodo; i++)
+            extract_sheet(reader, dm, &dm->sheets[todo[i]], ret);
+        xlsxioread_close(reader);
+        return 0;
+    }
+
+    struct sheet_work work = {dm, filepath, data, size, todo, ntodo, 0};
+    pthread_mutex_init(&work.lock, NULL);
+    int started = 1;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].work = &work;
+        workers[i].part.values = ret->values;
+    }
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, sheet_thread, &workers[i]) != 0)
+            break;
+        started++;
+    }
+    // this thread makes do with the reader it already has
+    workers[0].reader = reader;
+    extract_sheets(&workers[0]);
+    xlsxioread_close(reader);
+
+    size_t nfailures = 0;
+    for (int i = 0; i < nthreads; i++) {
+        if (i > 0 && i < started)
+            pthread_join(workers[i].thread, NULL);
+        ret->nmatched += workers[i].part.nmatched;
+        nfailures += workers[i].part.nfailures;
+        dm_stats_add(&ret->stats, &workers[i].part.stats);
+    }
+    // the threads' failed checks, one after another
+    if (nfailures && (ret->failures = dm_arena_alloc(&ret->arena, nfailures * sizeof(DmCheckFailure))) == NULL)
+        ret->error = "out of memory";
+    for (int i = 0; i < nthreads; i++) {
+        if (ret->failures && workers[i].part.nfailures) {
+            memcpy(ret->failures + ret->nfailures, workers[i].part.failures,
+                   workers[i].part.nfailures * sizeof(DmCheckFailure));
+            ret->nfailures += workers[i].part.nfailures;
+        }
+        dm_arena_adopt(&ret->arena, &workers[i].part.arena);
+    }
+    ret->failures_size = ret->nfailures;
+    pthread_mutex_destroy(&work.lock);
+    free(workers);
+    return 0;
+}
+
+// Everything ret holds is in its arena, so this is one release
+extern void dm_return_free(DmReturn *ret)
+{
+    dm_arena_free(&ret->arena);
+    memset(ret, 0, sizeof(DmReturn));
+}
+
+
+/* -- Library stuff (see datamaps.h) -----------------------------
+ *
+ * The same matching as the sheet callbacks above, turned inside out: the
+ * cursor pulls rows and cells from xlsxio's sheet reader and stops at each
+ * value the datamap wants. A cell can be a line and part of any number of
+ * ranges, so one value can make several records; match says which of its
+ * candidates comes next.
+ */
+
+struct DmExtractor {
+    DmDatamap dm;
+};
+
+struct DmCursor {
+    const DmDatamap *dm;
+    xlsxioreader reader;
+    xlsxioreadersheet sheet;        // being read, or NULL between sheets
+    struct sheet_list present;      // the sheets the workbook has
+    DmArena arena;                  // present's names and ranges.active
+    size_t next_sheet;              // in dm->sheets
+    struct xlsx_callback_data ranges; // for advance_ranges(); sheet is the one being read
+    size_t row, col;
+    int in_row;
+    char *value;                    // the cell being matched, from xlsxio
+    size_t match;                   // 0 for its index slot, then 1 + its place in ranges.active
+    uint32_t same_cell;             // the next line on the cell to hand back + 1, as DmLine.next
+    char cellref[DM_CELLREF_MAX];
+    char problem[128];
+    DmRecord record;
+    const char *error;
+};
+
+extern DmExtractor *dm_extractor_compile(const char *path)
+{
+    DmExtractor *ex = malloc(sizeof(DmExtractor));
+
+    if (ex == NULL)
+        return NULL;
+    if (dm_datamap_compile_csv(path, &ex->dm)) {
+        free(ex);
+        return NULL;
+    }
+    if (dm_datamap_compile_rules(&ex->dm)) {
+        dm_extractor_free(ex);
+        return NULL;
+    }
+    return ex;
+}
+
+/* Straight from SQLite: the datamap cache belongs to the CLI's database.
+ * dm_sql_check_error() exits, so make sure the tables are there first. */
+extern DmExtractor *dm_extractor_load(const char *db_path, const char *dm_name)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    DmExtractor *ex = NULL;
+    int ntables = 0;
+
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM sqlite_master"
+                               " WHERE type = 'table' AND name IN ('datamap', 'datamap_line')",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            ntables = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    if (ntables != 2) {
+        fprintf(stderr, "No datamaps in %s\n", db_path);
+    } else if (dm_upgrade_datamap_line(db) == 0 && (ex = malloc(sizeof(DmExtractor))) != NULL) {
+        if (get_all_sheet_and_cellrefs_from_datamap_in_sqlite3(db, (char *)dm_name, &ex->dm)) {
+            free(ex);
+            ex = NULL;
+        } else if (dm_datamap_compile_rules(&ex->dm)) {
+            dm_extractor_free(ex);
+            ex = NULL;
+        }
+    }
+    sqlite3_close(db);
+    return ex;
+}
+
+extern void dm_extractor_free(DmExtractor *ex)
+{
+    if (ex == NULL)
+        return;
+    dm_datamap_free(&ex->dm);
+    free(ex);
+}
+
+static DmCursor *cursor_open(const DmExtractor *ex, const char *path, const void *data, size_t size)
+{
+    DmCursor *c = calloc(1, sizeof(DmCursor));
+    size_t most = 0;
+
+    if (c == NULL)
+        return NULL;
+    c->dm = &ex->dm;
+    c->ranges.dm = &ex->dm;
+    c->present.arena = &c->arena;
+    if ((c->reader = open_workbook(path, data, size)) == NULL) {
+        c->error = data ? "not a workbook" : "cannot open file";
+        return c;
+    }
+    xlsxioread_list_sheets(c->reader, list_sheets_callback, &c->present);
+
+    // room for every range of whichever sheet has the most
+    for (size_t i = 0; i < c->dm->nsheets; i++) {
+        if (c->dm->sheets[i].nranges > most)
+            most = c->dm->sheets[i].nranges;
+    }
+    if (most && (c->ranges.active = dm_arena_alloc(&c->arena, most * sizeof(uint32_t))) == NULL)
+        c->error = "out of memory";
+    return c;
+}
+
+extern DmCursor *dm_cursor_open(const DmExtractor *ex, const char *path)
+{
+    return cursor_open(ex, path, NULL, 0);
+}
+
+extern DmCursor *dm_cursor_open_memory(const DmExtractor *ex, const void *data, size_t size)
+{
+    return cursor_open(ex, NULL, data, size);
+}
+
+// Make the current value the record for line l, at (range_row, range_col) if it is a range
+static int cursor_record(DmCursor *c, uint32_t l, size_t range_row, size_t range_col)
+{
+    const DmLine *line = &c->dm->lines[l];
+
+    c->record.key = line->key;
+    c->record.sheet = c->ranges.sheet->name;
+    c->record.cellref = c->cellref;
+    c->record.value = c->value;
+    c->record.range_row = (unsigned)range_row;
+    c->record.range_col = (unsigned)range_col;
+    c->record.problem = NULL;
+    dm_format_cellref(c->row, c->col, c->cellref);
+    for (uint32_t r = line->rule; r; r = c->dm->rules[r - 1].next) {
+        DmCheck why = dm_rule_check(&c->dm->rules[r - 1], c->value);
+        if (why != DM_CHECK_OK) {
+            dm_rule_describe(&c->dm->rules[r - 1], why, c->problem, sizeof(c->problem));
+            c->record.problem = c->problem;
+            break;
+        }
+    }
+    return 1;
+}
+
+// The next line that wants the current value, as sheet_cell_callback() finds them
+static int next_match(DmCursor *c)
+{
+    const DmSheet *sheet = c->ranges.sheet;
+    const DmCellSlot *slot;
+
+    if (c->match == 0) {
+        c->match = 1;
+        if ((slot = dm_index_find(&sheet->index, c->row, c->col)) != NULL)
+            c->same_cell = slot->line + 1;
+    }
+    if (c->same_cell) {
+        uint32_t l = c->same_cell - 1;
+        c->same_cell = c->dm->lines[l].next;
+        return cursor_record(c, l, 0, 0);
+    }
+    while (c->match <= c->ranges.nactive) {
+        uint32_t l = c->ranges.active[c->match++ - 1];
+        const DmLine *line = &c->dm->lines[l];
+        if (c->col >= line->col && c->col <= line->last_col)
+            return cursor_record(c, l, c->row - line->row + 1, c->col - line->col + 1);
+    }
     return 0;
-    
+}
+
+// Open the next of the datamap's sheets that the workbook has. 0 if there are no more.
+static int next_sheet(DmCursor *c)
+{
+    while (c->next_sheet < c->dm->nsheets) {
+        const DmSheet *sheet = &c->dm->sheets[c->next_sheet++];
+        if (!sheet_list_contains(&c->present, sheet->name))
+            continue;
+        if ((c->sheet = xlsxioread_sheet_open(c->reader, sheet->name, XLSXIOREAD_SKIP_EMPTY_ROWS)) == NULL) {
+            c->error = "cannot read sheet";
+            return 0;
+        }
+        c->ranges.sheet = sheet;
+        c->ranges.nactive = 0;
+        c->ranges.next_range = 0;
+        c->ranges.row = 0;
+        return 1;
+    }
+    return 0;
+}
+
+extern int dm_cursor_next(DmCursor *c)
+{
+    for (;;) {
+        if (c->error)
+            return -1;
+        if (c->value) {
+            if (next_match(c))
+                return 1;
+            xlsxioread_free(c->value);
+            c->value = NULL;
+        }
+
+        if (c->in_row) {
+            const DmSheet *sheet = c->ranges.sheet;
+            char *value = xlsxioread_sheet_next_cell(c->sheet);
+            if (value == NULL) {
+                c->in_row = 0;
+                continue;
+            }
+            size_t col = xlsxioread_sheet_last_column_index(c->sheet);
+            if (*value == '\0' || col < sheet->min_col || col > sheet->max_col) {
+                xlsxioread_free(value);
+                // the rest of the row is outside the box too
+                if (col > sheet->max_col)
+                    c->in_row = 0;
+                continue;
+            }
+            c->value = value;
+            c->col = col;
+            c->match = 0;
+            continue;
+        }
+
+        if (c->sheet) {
+            const DmSheet *sheet = c->ranges.sheet;
+            size_t row = xlsxioread_sheet_next_row(c->sheet) ? xlsxioread_sheet_last_row_index(c->sheet) : 0;
+            // at the end of the sheet, or past the bottom of the datamap's box
+            if (row == 0 || row > sheet->max_row) {
+                xlsxioread_sheet_close(c->sheet);
+                c->sheet = NULL;
+                continue;
+            }
+            if (row < sheet->min_row)
+                continue;
+            if (sheet->nranges)
+                advance_ranges(&c->ranges, row);
+            c->row = row;
+            c->in_row = 1;
+            continue;
+        }
+
+        if (!next_sheet(c))
+            return c->error ? -1 : 0;
+    }
+}
+
+extern const DmRecord *dm_cursor_record(const DmCursor *c)
+{
+    return &c->record;
+}
+
+extern const char *dm_cursor_error(const DmCursor *c)
+{
+    return c->error;
+}
+
+extern void dm_cursor_close(DmCursor *c)
+{
+    if (c == NULL)
+        return;
+    if (c->value)
+        xlsxioread_free(c->value);
+    if (c->sheet)
+        xlsxioread_sheet_close(c->sheet);
+    if (c->reader)
+        xlsxioread_close(c->reader);
+    dm_arena_free(&c->arena);
+    free(c);
+}
+
+/* -- Typed values -----------------------------
+ *
+ * xlsxio hands us every cell as text. Before a value is stored we work
+ * out whether it is really an integer, a real or a boolean, so that
+ * return_data holds native numbers that SQLite can add up without CASTs
+ * (and that take less room than their text). Numbers are only taken as
+ * numbers if nothing would be lost: "007" is a code, so it stays text.
+ * Where the stored number would not print back as exactly the text that
+ * was read ("2.20", "1E3"), that text is kept in return_data.raw.
+ *
+ * Text is stored once, in the value table, and return_data refers to it by
+ * id (see the writer in batch.c).
+ *
+ * Dates arrive as Excel serial numbers. Without the workbook's number
+ * formats, which xlsxio doesn't give us, they can't be told apart from
+ * other numbers, so they are stored as numbers.
+ */
+
+static int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Would SQLite print r as exactly text? It uses "%.15g" and makes sure
+// there is a decimal point.
+static int real_prints_as(double r, const char *text)
+{
+    char buf[40];
+    int len = snprintf(buf, sizeof(buf), "%.15g", r);
+    char *e = strchr(buf, 'e');
+
+    if (len <= 0 || (size_t)len + 3 > sizeof(buf))
+        return 0;
+    if (strchr(buf, '.') == NULL) {
+        if (e) {
+            memmove(e + 2, e, strlen(e) + 1);
+            memcpy(e, ".0", 2);
+        } else {
+            strcat(buf, ".0");
+        }
+    }
+    return strcmp(buf, text) == 0;
+}
+
+// Classify text, without allocating. v gets the value to store.
+extern DmValueType dm_classify_value(const char *text, DmValue *v)
+{
+    const char *p = text, *digits;
+    int neg = 0, overflow = 0;
+    uint64_t n = 0;
+
+    v->type = DM_VALUE_TEXT;
+    v->i = 0;
+    v->r = 0;
+    v->exact = 1;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    digits = p;
+    while (is_digit(*p)) {
+        if (n > (UINT64_MAX - 9) / 10)
+            overflow = 1;
+        else
+            n = n * 10 + (uint64_t)(*p - '0');
+        p++;
+    }
+
+    if (p > digits && *p == '\0') {
+        // all digits: an integer, unless it is a code with leading zeros
+        if (p - digits > 1 && *digits == '0')
+            return v->type;
+        if (!overflow && n <= (uint64_t)INT64_MAX + neg) {
+            v->type = DM_VALUE_INTEGER;
+            v->i = neg ? (n ? -(int64_t)(n - 1) - 1 : 0) : (int64_t)n;
+            v->exact = !(neg && n == 0); // "-0"
+            return v->type;
+        }
+    }
+
+    // [-]digits[.digits][e[+-]digits], with at least one digit before the e
+    p = digits;
+    int mantissa = 0;
+    while (is_digit(*p)) {
+        p++;
+        mantissa++;
+    }
+    if (*p == '.') {
+        p++;
+        while (is_digit(*p)) {
+            p++;
+            mantissa++;
+        }
+    }
+    if (mantissa > 0 && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (*p == '+' || *p == '-')
+            p++;
+        if (!is_digit(*p))
+            return v->type;
+        while (is_digit(*p))
+            p++;
+    }
+    if (mantissa > 0 && *p == '\0') {
+        double r = strtod(text, NULL);
+        if (!isfinite(r)) // too big for a double
+            return v->type;
+        v->type = DM_VALUE_REAL;
+        v->r = r;
+        v->exact = real_prints_as(r, text);
+        return v->type;
+    }
+
+    if (!neg) {
+        const char *word = NULL;
+        if (strlen(text) == 4 && strncasecmp(text, "true", 4) == 0)
+            word = "TRUE";
+        else if (strlen(text) == 5 && strncasecmp(text, "false", 5) == 0)
+            word = "FALSE";
+        if (word) {
+            v->type = DM_VALUE_BOOLEAN;
+            v->i = word[0] == 'T';
+            v->exact = strcmp(text, word) == 0;
+        }
+    }
+    return v->type;
+}
+
+
+/* A fast, non-cryptographic 64-bit hash (MurmurHash64A) used to tell
+ * whether a workbook has changed since it was last imported. */
+extern uint64_t dm_hash_bytes(const void *data, size_t len)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *p = data;
+    const unsigned char *end = p + (len & ~(size_t)7);
+    uint64_t h = 0x9747b28cULL ^ (len * m);
+
+    for (; p != end; p += 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7) {
+        case 7: h ^= (uint64_t)p[6] << 48; /* fall through */
+        case 6: h ^= (uint64_t)p[5] << 40; /* fall through */
+        case 5: h ^= (uint64_t)p[4] << 32; /* fall through */
+        case 4: h ^= (uint64_t)p[3] << 24; /* fall through */
+        case 3: h ^= (uint64_t)p[2] << 16; /* fall through */
+        case 2: h ^= (uint64_t)p[1] << 8;  /* fall through */
+        case 1: h ^= (uint64_t)p[0];
+                h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// Hash the bytes of the file at path, and give its size if size is not
+// NULL. Returns 0 on success.
+extern int dm_hash_file(const char *path, uint64_t *hash, size_t *size)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+    if (size)
+        *size = (size_t)st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
+        *hash = dm_hash_bytes("", 0);
+        return 0;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 1;
+    *hash = dm_hash_bytes(data, st.st_size);
+    munmap(data, st.st_size);
+    return 0;
+}
+
+
+// Read a single spreadsheet - a batch of one.
+extern int read_spreadsheet(char *filepath, char *dm_name) {
+    DmImportOptions opts = {1, 0, 0};
+    return dm_import_batch(&filepath, 1, &dm_name, 1, &opts);
+}
+
+// Read a single spreadsheet that is already in memory, stored as name.
+extern int read_spreadsheet_buffer(char *name, const void *data, size_t size, char *dm_name) {
+    DmImportOptions opts = {1, 0, 0};
+    DmWorkbook wb = {name, data, size, 0};
+    return dm_import_workbooks(&wb, 1, &dm_name, 1, &opts);
 }
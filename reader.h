@@ -1,28 +1,520 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <regex.h>
 #include <sqlite3.h>
 #include <xlsxio_read.h>
+#include "datamaps.h"
 
 /* -- Datamap stuff ------------------------------------ */
 
 #define EXCEL_MAX_SHEETNAME 256
+#define DM_CSV_MAX_FIELDS 16 // we only look at the first few; more are counted
+
+// One field of a CSV record. Not NUL-terminated: it points into the file.
+typedef struct DmCsvField {
+    const char *str;
+    size_t len;
+} DmCsvField;
+
+// A datamap CSV file being parsed, see dm_csv_next()
+typedef struct DmCsv {
+    char *data;
+    size_t size;
+    size_t pos;
+    size_t lineno;    // line the last record started on
+    size_t next_line; // line the next record starts on
+    int mapped;
+} DmCsv;
 
 // Data extracted from a datamap goes in here
 typedef struct Datamapline {
-    char *key;
-    char sheet[EXCEL_MAX_SHEETNAME];
-    char cellref[5];
+    DmCsvField key;
+    DmCsvField sheet;
+    DmCsvField cellref;
 } Datamapline;
 
-extern int dm_import_dm(); // Import a datamap file into the database
-extern int dm_populate_datamapLine(char *line, Datamapline *dml);
+extern int dm_import_dm(char *dm_path, char *dm_name, int dm_overwrite); // Import a datamap file into the database
+extern int dm_populate_datamapLine(const DmCsvField *fields, size_t nfields, Datamapline *dml);
+extern void dm_csv_init(DmCsv *csv, char *data, size_t size);
+extern int dm_csv_open(DmCsv *csv, const char *path);
+extern int dm_csv_next(DmCsv *csv, DmCsvField *fields, size_t maxfields, size_t *nfields);
+extern void dm_csv_close(DmCsv *csv);
+
+
+/* -- Cell reference stuff ------------------------------- */
+
+#define EXCEL_MAX_ROWS 1048576
+#define EXCEL_MAX_COLS 16384 // column XFD
+#define DM_CELLREF_MAX 16    // enough for "XFD1048576" plus terminator
+#define DM_RANGEREF_MAX (2 * DM_CELLREF_MAX) // "A1:XFD1048576"
+#define DM_RANGE_MAX_CELLS 65536 // largest table one datamap line can cover
+
+// A cell is packed into a single 64-bit key: row in the high half, column in
+// the low half. Rows and columns are 1-based, so a packed cell is never 0.
+#define DM_CELL_PACK(row, col) (((uint64_t)(row) << 32) | (uint32_t)(col))
+
+// One slot of a DmCellIndex. cell == 0 marks an empty slot.
+typedef struct DmCellSlot {
+    uint64_t cell;
+    uint32_t line; // whatever the owner wants to map the cell to
+} DmCellSlot;
+
+// Open addressing hash table of packed cells, built once per sheet from the
+// datamap so the sheet callback can match a cell without formatting strings.
+typedef struct DmCellIndex {
+    DmCellSlot *slots;
+    size_t bits;  // capacity is 1 << bits
+    size_t count;
+} DmCellIndex;
+
+#define DM_INDEX_MIN_BITS 4 // the smallest index dm_index_init() makes
+
+extern int dm_parse_cellref(const char *ref, size_t *row, size_t *col); // "AB12" -> 12, 28
+extern void dm_format_cellref(size_t row, size_t col, char *buf); // buf must hold DM_CELLREF_MAX
+extern int dm_parse_range(const char *ref, size_t *row, size_t *col, size_t *last_row, size_t *last_col); // "AB10:AF200", or one cell
+extern int dm_index_init(DmCellIndex *idx, size_t expected);
+extern int dm_index_add(DmCellIndex *idx, size_t row, size_t col, uint32_t line);
+extern const DmCellSlot *dm_index_find(const DmCellIndex *idx, size_t row, size_t col);
+extern void dm_index_free(DmCellIndex *idx);
+
+
+/* -- Arena stuff ------------------------------- */
+
+#define DM_ARENA_MIN_CHUNK 4096
+#define DM_ARENA_MAX_CHUNK (1 << 20)
+
+typedef struct DmArenaChunk DmArenaChunk;
+
+// Bump allocator whose memory is all released at once (see arena.c)
+typedef struct DmArena {
+    DmArenaChunk *chunk; // the one being filled; earlier ones hang off it
+    size_t chunk_size;   // of the newest chunk
+    char **interned;     // open addressing set of interned strings
+    size_t intern_bits;
+    size_t intern_count;
+} DmArena;
+
+extern void dm_arena_init(DmArena *a, size_t chunk_size); // 0 for the default
+extern void *dm_arena_alloc(DmArena *a, size_t size);
+extern void *dm_arena_calloc(DmArena *a, size_t n, size_t size);
+extern char *dm_arena_strdup(DmArena *a, const char *s);
+extern char *dm_arena_strndup(DmArena *a, const char *s, size_t len);
+extern const char *dm_arena_intern(DmArena *a, const char *s);
+extern void dm_arena_adopt(DmArena *a, DmArena *src);
+extern void dm_arena_reset(DmArena *a);
+extern void dm_arena_free(DmArena *a);
+
+/* -- Validation rule stuff ------------------------------- */
+
+#define DM_RULE_MIN 1 // DmRule.min is set
+#define DM_RULE_MAX 2 // DmRule.max is set
+
+// What a line's values have to look like, from the datamap's optional
+// type, min, max, pattern and allowed columns (see rules.c)
+typedef struct DmRule {
+    uint32_t types;  // 1 << DmValueType for each type allowed; 0 for any
+    uint32_t flags;  // DM_RULE_MIN, DM_RULE_MAX
+    double min, max; // bounds for a number, inclusive
+    char *pattern;   // extended regex the whole value must match, or NULL
+    char *allowed;   // "|"-separated list the value must be one of, or NULL
+    regex_t *regex;  // pattern compiled, owned by the DmDatamap it came from
+    // only in a merged datamap, where a cell can have a rule from each datamap:
+    uint32_t next;       // the cell's next rule + 1, 0 for none
+    uint32_t owner;      // the datamap in the set it came from
+    uint32_t owner_line; // the line of that datamap it is the rule for
+} DmRule;
+
+// Why a value broke its rule
+typedef enum DmCheck {
+    DM_CHECK_OK = 0,
+    DM_CHECK_TYPE,
+    DM_CHECK_MIN,
+    DM_CHECK_MAX,
+    DM_CHECK_PATTERN,
+    DM_CHECK_ALLOWED,
+} DmCheck;
+
+// A value that broke its line's rule, found as the workbook was read
+typedef struct DmCheckFailure {
+    uint32_t line;  // in the DmDatamap extracted against
+    uint32_t slot;  // in DmReturn.values
+    uint32_t rule;  // in DmDatamap.rules
+    DmCheck why;
+} DmCheckFailure;
+
+extern int dm_rule_parse(const char *type, const char *min, const char *max, DmRule *rule);
+extern int dm_rule_compile(const char *pattern, regex_t *re);
+extern DmCheck dm_rule_check(const DmRule *rule, const char *value);
+extern void dm_rule_describe(const DmRule *rule, DmCheck why, char *buf, size_t size);
+
+/* -- Compiled datamap stuff ------------------------------- */
+
+// A datamap line ready for extraction, with its cellref already decoded.
+// A line can cover a range of cells (a table), in which case it has a value
+// slot for each of them, row by row.
+typedef struct DmLine {
+    int64_t id; // datamap_line.id
+    char *key;
+    uint32_t sheet; // index into DmDatamap.sheets
+    uint32_t row;
+    uint32_t col;
+    uint32_t last_row; // the same as row and col unless the line is a range
+    uint32_t last_col;
+    uint32_t value; // its first slot in DmReturn.values
+    uint32_t rule; // its rule in DmDatamap.rules + 1, 0 if its values aren't checked
+    uint32_t next; // the next single-cell line on the same cell + 1, 0 for none
+} DmLine;
+
+#define DM_LINE_IS_RANGE(l) ((l)->last_row != (l)->row || (l)->last_col != (l)->col)
+#define DM_LINE_WIDTH(l) ((l)->last_col - (l)->col + 1)
+#define DM_LINE_CELLS(l) (((l)->last_row - (l)->row + 1) * DM_LINE_WIDTH(l))
+
+// Every line of a datamap that lives on one sheet
+typedef struct DmSheet {
+    char *name;
+    size_t first_line; // lines are grouped by sheet in DmDatamap.lines
+    size_t nlines;
+    uint32_t min_row, max_row; // bounding box of every cell the datamap
+    uint32_t min_col, max_col; // wants from this sheet
+    DmCellIndex index; // cell -> offset into DmDatamap.lines, for single cells;
+                       // more lines on the same cell follow on through DmLine.next
+    size_t first_range; // range lines are in DmDatamap.ranges instead,
+    size_t nranges;     // ordered by their first row
+} DmSheet;
+
+// The whole of a datamap, loaded with a single query and grouped by sheet
+typedef struct DmDatamap {
+    int64_t id; // datamap.id
+    DmLine *lines;
+    size_t nlines;
+    DmSheet *sheets;
+    size_t nsheets;
+    uint32_t *ranges; // offsets into lines, grouped by sheet
+    size_t nranges;
+    size_t nvalues; // value slots over all lines
+    DmRule *rules;
+    size_t nrules;
+    regex_t *regexes; // the rules' compiled patterns, see dm_datamap_compile_rules()
+    size_t nregexes;
+    void *image; // set if keys, names and indexes live in a mapped cache image
+    size_t image_size;
+    DmArena arena; // otherwise keys and names live here
+} DmDatamap;
+
+extern int get_all_sheet_and_cellrefs_from_datamap_in_sqlite3(sqlite3 *db, char *dm_name, DmDatamap *dm);
+extern int dm_datamap_compile_csv(const char *path, DmDatamap *dm); // straight from the file, no database
+extern int dm_datamap_layout(DmDatamap *dm); // number value slots and list range lines
+extern int dm_datamap_compile_rules(DmDatamap *dm);
+extern void dm_datamap_free(DmDatamap *dm);
+
+/* -- datamap set stuff ------------------------------- */
+
+// Several datamaps applied in one pass over each workbook (see dmset.c)
+typedef struct DmDatamapSet {
+    DmDatamap *dms;           // one per name, in the order given
+    size_t ndms;
+    DmDatamap merged;         // a line per distinct cell or range any of dms wants
+    uint32_t **merged_line;   // merged_line[d][i]: the merged line for dms[d].lines[i]; NULL with one datamap
+    const DmDatamap *extract; // what workbooks are extracted against
+} DmDatamapSet;
+
+extern int dm_load_datamap_set(sqlite3 *db, char **names, size_t nnames, DmDatamapSet *set);
+extern size_t dm_datamap_set_values(const DmDatamapSet *set, size_t d, const char **values, const char **out);
+extern size_t dm_datamap_set_failures(const DmDatamapSet *set, size_t d, const DmCheckFailure *failures, size_t n,
+                                      DmCheckFailure *out);
+extern void dm_datamap_set_free(DmDatamapSet *set);
+
+/* -- Compiled datamap cache stuff ------------------------------- */
+
+extern int dm_load_datamap(sqlite3 *db, char *dm_name, DmDatamap *dm); // cache if current, else SQLite
+extern int dm_cache_rebuild(sqlite3 *db, char *dm_name);
+extern int dm_upgrade_datamap_line(sqlite3 *db); // add the revision and rule columns to an older database
+extern void dm_cache_path(const char *dm_name, char *buf, size_t size);
+extern int dm_cache_write(const DmDatamap *dm, const char *dm_name, uint64_t stamp);
+extern int dm_cache_read(const char *dm_name, uint64_t stamp, DmDatamap *dm);
 
 
 /* -- sqlite3 stuff ------------------------------------ */
 
+extern const char *dm_sql_str_create_table_return; // return and return_data, if not there already
+extern const char *dm_sql_str_create_index_datamap; // datamap and datamap_line's indexes
+extern const char *dm_sql_str_create_trigger_datamap; // keeping datamap.revision up to date
+// The text a row of return_data AS d was read as, given value AS v LEFT
+// JOINed on v.id = d.value_id; return_value's text column
+#define DM_SQL_RETURN_TEXT "COALESCE(d.raw, v.text," \
+                           "         CASE d.vtype WHEN 3 THEN CASE d.value WHEN 1 THEN 'TRUE' ELSE 'FALSE' END" \
+                           "                ELSE CAST(d.value AS TEXT) END)"
+
 extern void dm_sql_check_error(int rc, sqlite3 *db); // Helper function which returns a sqlite3 error and cleans up
 extern int dm_exec_sql_stmt(const char *stmt, sqlite3 *db); // call a SQL statement in sqlite3
 
+/* -- stats stuff ----------------------------- */
+
+// Where an import spends its time and how much work each phase does.
+// Times are seconds from dm_now(). Phases that run on the extraction
+// threads (hash, open, sheets) are summed over all threads, so with more
+// than one job they can add up to more than wall_time.
+//
+// xlsxio inflates, parses and hands us cells in one streaming pass, so
+// sheet_time covers inflation, XML parsing and cellref matching together;
+// cells and matched say how that work divides up.
+typedef struct DmStats {
+    double wall_time;    // the whole import
+    double datamap_time; // loading the datamap (cache image or sqlite3)
+    double hash_time;    // hashing workbook files
+    double open_time;    // opening workbooks: zip directory and sheet list
+    double sheet_time;   // inflating, parsing and matching datamap sheets
+    double store_time;   // inserting returns
+    double commit_time;  // committing transactions
+    uint64_t workbooks;     // workbooks looked at
+    uint64_t bytes_read;    // size of those workbook files
+    uint64_t sheets_opened;
+    uint64_t rows;          // rows visited
+    uint64_t cells;         // non-empty cells visited
+    uint64_t matched;       // cells whose value was kept
+    uint64_t rows_inserted; // return and return_data rows
+    uint64_t commits;
+    uint64_t checks_failed; // values that broke their line's rule
+} DmStats;
+
+extern double dm_now(void); // monotonic clock, in seconds
+extern void dm_stats_add(DmStats *total, const DmStats *s);
+extern void dm_stats_print(const DmStats *s, FILE *out, int json);
+
 /* -- spreadsheet importing stuff ----------------------------- */
-extern int read_spreadsheet(); // Read a single spreadsheet
+
+// The values extracted from one workbook against a DmDatamap
+typedef struct DmReturn {
+    char *filepath;
+    const char **values; // one per DmDatamap value slot, NULL where nothing was found
+    size_t nmatched; // how many of values are set
+    const char *error; // NULL if the workbook was read, otherwise why not
+    uint64_t hash;   // of the workbook file's bytes
+    int unchanged;   // already imported with this hash and datamap - values not read
+    DmStats stats;   // the work done on this workbook
+    DmArena arena;   // filepath, values and everything they point to
+    DmCheckFailure *failures; // values that broke their rules, in the order read
+    size_t nfailures;
+    size_t failures_size;
+} DmReturn;
+
+// What a cell's text turned out to be; stored in return_data.vtype
+typedef enum DmValueType {
+    DM_VALUE_TEXT = 0,
+    DM_VALUE_INTEGER = 1,
+    DM_VALUE_REAL = 2,
+    DM_VALUE_BOOLEAN = 3,
+} DmValueType;
+
+typedef struct DmValue {
+    DmValueType type;
+    int64_t i; // DM_VALUE_INTEGER, and 1 or 0 for DM_VALUE_BOOLEAN
+    double r;  // DM_VALUE_REAL
+    int exact; // stored as above, it prints back as the text that was read
+} DmValue;
+
+extern DmValueType dm_classify_value(const char *text, DmValue *v);
+extern int dm_extract_workbook(const DmDatamap *dm, const char *filepath, DmReturn *ret);
+extern int dm_extract_workbook_parallel(const DmDatamap *dm, const char *filepath, DmReturn *ret, int nthreads);
+extern int dm_extract_workbook_buffer(const DmDatamap *dm, const char *filepath, const void *data, size_t size,
+                                      DmReturn *ret, int nthreads);
+extern void dm_return_free(DmReturn *ret);
+extern uint64_t dm_hash_bytes(const void *data, size_t len);
+extern int dm_hash_file(const char *path, uint64_t *hash, size_t *size);
+extern int read_spreadsheet(char *filepath, char *dm_name); // Read a single spreadsheet
+extern int read_spreadsheet_buffer(char *name, const void *data, size_t size, char *dm_name); // ... from memory
+
+/* -- batch importing stuff ----------------------------- */
+
+#define DM_BATCH_COMMIT_EVERY 64 // returns per writer transaction
+#define DM_STAGING_DB "test.db-staging" // where a bulk load is written before it is published
+#define DM_BULK_CACHE_KB 65536 // page cache for each database during a bulk load
+
+// How a batch import should behave
+typedef struct DmImportOptions {
+    int jobs;  // extraction threads, 0 for one per CPU
+    int force; // re-import workbooks even if they are unchanged
+    int quiet; // only report failures
+    DmStats *stats; // if not NULL, filled in with the totals for the batch
+    int sheet_threads; // threads per workbook, sharing out its sheets; 0 or 1 for one
+    int bulk; // write to a staging database and publish the batch in one go
+} DmImportOptions;
+
+// One workbook for a batch: a file, or bytes already in memory
+typedef struct DmWorkbook {
+    char *name;       // the file to read, or what its return is stored as
+    const void *data; // NULL to read the file called name
+    size_t size;      // of data
+    size_t inflated;  // if not 0, data is raw deflate for a workbook this big
+} DmWorkbook;
+
+#define DM_WRITER_MAX_TEXTS (1 << 20) // text ids the writer remembers before starting afresh
+
+// A text value and its id in the value table
+typedef struct DmTextId {
+    const char *text;
+    int64_t id;
+} DmTextId;
+
+// The single writer's connection and the statements it reuses for every return
+typedef struct DmWriter {
+    sqlite3 *db;
+    sqlite3_stmt *delete_return;
+    sqlite3_stmt *insert_return;
+    sqlite3_stmt *insert_value;
+    sqlite3_stmt *insert_check;
+    sqlite3_stmt *find_text;
+    sqlite3_stmt *insert_text;
+    const char **values; // scratch for dm_writer_store_set()
+    size_t values_size;
+    DmCheckFailure *failures; // ... and for their failed checks
+    size_t failures_size;
+    int staging; // writing to the staging database
+    int64_t last_staged; // text new to a staged batch gets ids -1, -2, ...
+    DmTextId *text_ids; // open addressing, a power of two in size
+    size_t text_bits;
+    size_t ntexts;
+    DmArena texts; // text_ids' copies of the text
+} DmWriter;
+
+extern int dm_upgrade_return_data(sqlite3 *db); // bring an older return_data up to date
+extern int dm_writer_open(DmWriter *w, sqlite3 *db);
+extern int dm_writer_open_staging(DmWriter *w, sqlite3 *db); // ... writing to the staging database
+extern int dm_writer_store(DmWriter *w, const DmDatamap *dm, const DmReturn *ret);
+extern int dm_writer_store_set(DmWriter *w, const DmDatamapSet *set, const DmReturn *ret, size_t *rows);
+extern void dm_writer_close(DmWriter *w);
+
+extern int dm_stage_open(sqlite3 *db);
+extern int dm_stage_publish(sqlite3 *db);
+extern void dm_stage_discard(sqlite3 *db);
+
+// A return that a return spec (an id, a workbook, or a batch's directory or bundle) stands for
+typedef struct DmReturnRef {
+    int64_t id;
+    char *file;       // as it was imported
+    const char *name; // in file: the workbook's name or, for a batch, its path under the spec
+} DmReturnRef;
+
+typedef struct DmReturnRefs {
+    DmReturnRef *refs; // in name order
+    size_t count;
+    int batch; // the spec was a directory or bundle, not one return
+} DmReturnRefs;
+
+extern int dm_is_workbook_name(const char *name);
+extern int dm_expand_paths(const char *spec, char ***paths, size_t *npaths);
+extern void dm_free_paths(char **paths, size_t npaths);
+extern int dm_is_return_id(const char *spec); // all digits
+extern int dm_find_returns(sqlite3 *db, int64_t dm_id, const char *spec, int batches, DmReturnRefs *refs);
+extern void dm_free_return_refs(DmReturnRefs *refs);
+extern int dm_import_batch(char **paths, size_t npaths, char **dm_names, size_t ndm_names, const DmImportOptions *opts);
+extern int dm_import_workbooks(const DmWorkbook *workbooks, size_t npaths, char **dm_names, size_t ndm_names,
+                               const DmImportOptions *opts);
+extern int dm_import_stdin(const char *name, char **dm_names, size_t ndm_names, const DmImportOptions *opts);
+
+/* -- bundle stuff ----------------------------- */
+
+#define DM_STDIN_NAME "-" // the path that means standard input
+
+// The workbooks in a zip, tar or gzipped tar bundle, ready to import
+// without unpacking (see bundle.c)
+typedef struct DmBundle {
+    DmWorkbook *workbooks;
+    size_t nworkbooks;
+    void *map;        // the bundle file, mapped
+    size_t map_size;
+    void *buf;        // or its bytes read from stdin, or a tar inflated from gzip
+    DmArena arena;    // member names
+} DmBundle;
+
+extern int dm_read_stream(FILE *f, void **data, size_t *size);
+extern int dm_bundle_open(const char *path, const char *stdin_name, DmBundle *bundle); // "-" for stdin
+extern void dm_bundle_close(DmBundle *bundle);
+extern int dm_inflate_raw(const void *src, size_t src_size, void *dst, size_t dst_size);
+
+/* -- export stuff ----------------------------- */
+
+extern int dm_export_master(char *dm_name, const char *output_file);
+extern const char *dm_sql_str_master_values; // every line of a datamap with its values, for the master
+extern void dm_csv_field(FILE *f, const char *s);
+
+/* -- diff stuff ----------------------------- */
+
+extern int dm_diff(char *dm_name, const char *old_spec, const char *new_spec, const char *output_file, int quiet);
+
+/* -- query stuff ----------------------------- */
+
+#define DM_STMT_CACHE_SIZE 8
+
+// Statements prepared once and reused for every lookup, found by their SQL.
+// When it is full the oldest is finalized to make room.
+typedef struct DmStmtCache {
+    sqlite3 *db;
+    const char *sql[DM_STMT_CACHE_SIZE];
+    sqlite3_stmt *stmt[DM_STMT_CACHE_SIZE];
+    size_t count;
+    size_t next; // the slot to reuse when full
+} DmStmtCache;
+
+extern void dm_stmt_cache_init(DmStmtCache *cache, sqlite3 *db);
+extern sqlite3_stmt *dm_stmt_cache_get(DmStmtCache *cache, const char *sql);
+extern void dm_stmt_cache_free(DmStmtCache *cache);
+extern int dm_query(char *dm_name, const char *return_spec, char **keys, const char *output_file, int json);
+
+/* -- snapshot stuff ----------------------------- */
+
+#define DM_SNAPSHOT_MIXED 0xff // DmSnapshotKey.type of a column with more than one type of value
+
+// Where things are in a snapshot file (see snapshot.c). Offsets are from the start of the file.
+typedef struct DmSnapshotReturn {
+    int64_t id;
+    uint64_t file_off; // in the pool
+} DmSnapshotReturn;
+
+typedef struct DmSnapshotKey {
+    uint64_t key_off; // in the pool
+    int64_t line_id;
+    uint32_t range_row; // 0 and 0 for a single cell
+    uint32_t range_col;
+    uint32_t type;      // DmValueType, or DM_SNAPSHOT_MIXED
+    uint32_t pad;
+    uint64_t count;     // returns with a value
+    uint64_t present_off; // null bitmap: bit r of word r / 64 is set if return r has a value
+    uint64_t values_off;  // a DmSnapshotValue for every return
+    uint64_t types_off;   // for a mixed column, a DmValueType byte for every return
+} DmSnapshotKey;
+
+// One slot of a column. Booleans are 1 or 0; text is the pool offset of the string.
+typedef union DmSnapshotValue {
+    int64_t i;
+    double r;
+    uint64_t text_off;
+} DmSnapshotValue;
+
+// A snapshot file mapped in
+typedef struct DmSnapshot {
+    const char *map;
+    size_t size;
+    int64_t dm_id;
+    size_t nreturns;
+    size_t nkeys;
+    const DmSnapshotReturn *returns; // by id
+    const DmSnapshotKey *keys;       // by datamap line, then range cell
+    const char *pool;                // NUL-terminated strings
+    size_t pool_size;
+} DmSnapshot;
+
+extern int dm_snapshot_write(char *dm_name, const char *return_spec, const char *path);
+extern int dm_snapshot_open(const char *path, DmSnapshot *snap);
+extern void dm_snapshot_close(DmSnapshot *snap);
+extern const char *dm_snapshot_string(const DmSnapshot *snap, uint64_t off);
+extern int dm_snapshot_summary(const char *path, const char *output_file, int quiet);
+
+/* -- watch stuff ----------------------------- */
+
+#define DM_WATCH_SETTLE_MS 250 // quiet time after the last write before a workbook is read
+#define DM_WATCH_RETRIES 5     // times a workbook that won't open is tried again
+
+extern int dm_watch(const char *dir, char **dm_names, size_t ndm_names, const DmImportOptions *opts);
@@ -1,4 +1,5 @@
 #include <glib.h>
+#include <unistd.h>
 #include "reader.h"
 
 /* This is instructive: https://developer.gnome.org/glib/stable/glib-Testing.html
@@ -10,11 +11,11 @@ typedef struct {
 } dm_fixture;
 
 void dm_setup(dm_fixture *df, gconstpointer test_data) {
-    Datamapline test_dml = {"Test Key", "Test Sheet", "A1"};
+    Datamapline test_dml = {{"Test Key", 8}, {"Test Sheet", 10}, {"A1", 2}};
     df->dm_file = "tits";
     df->dml = test_dml;
     printf("In dm_setup - data is %d\n", *df->dm_file);
-    printf("Test DML key is %s\n", df->dml.key);
+    printf("Test DML key is %.*s\n", (int)df->dml.key.len, df->dml.key.str);
 }
 
 void test_parse_dm(dm_fixture *df, gconstpointer ignored){
@@ -25,8 +26,927 @@ void dm_teardown(dm_fixture *df, gconstpointer test_data) {
     printf("In dm_teardown\n");
 }
 
+void test_parse_cellref(void) {
+    size_t row, col;
+    g_assert_cmpint(dm_parse_cellref("B12", &row, &col), ==, 0);
+    g_assert_cmpuint(row, ==, 12);
+    g_assert_cmpuint(col, ==, 2);
+    g_assert_cmpint(dm_parse_cellref("AB10\n", &row, &col), ==, 0);
+    g_assert_cmpuint(col, ==, 28);
+    g_assert_cmpint(dm_parse_cellref("$XFD$1048576", &row, &col), ==, 0);
+    g_assert_cmpuint(col, ==, EXCEL_MAX_COLS);
+    g_assert_cmpint(dm_parse_cellref("12", &row, &col), ==, 1);
+    g_assert_cmpint(dm_parse_cellref("B", &row, &col), ==, 1);
+    g_assert_cmpint(dm_parse_cellref("XFE1", &row, &col), ==, 1);
+}
+
+void test_format_cellref(void) {
+    char buf[DM_CELLREF_MAX];
+    dm_format_cellref(9, 3, buf);
+    g_assert_cmpstr(buf, ==, "C9");
+    dm_format_cellref(3, 32, buf);
+    g_assert_cmpstr(buf, ==, "AF3");
+    dm_format_cellref(1, 702, buf);
+    g_assert_cmpstr(buf, ==, "ZZ1");
+}
+
+void test_parse_range(void) {
+    size_t row, col, last_row, last_col;
+    g_assert_cmpint(dm_parse_range("AB10:AF200\n", &row, &col, &last_row, &last_col), ==, 0);
+    g_assert_cmpuint(row, ==, 10);
+    g_assert_cmpuint(col, ==, 28);
+    g_assert_cmpuint(last_row, ==, 200);
+    g_assert_cmpuint(last_col, ==, 32);
+    g_assert_cmpint(dm_parse_range("C9", &row, &col, &last_row, &last_col), ==, 0);
+    g_assert_cmpuint(last_row, ==, 9);
+    g_assert_cmpuint(last_col, ==, 3);
+    g_assert_cmpint(dm_parse_range("D5:B2", &row, &col, &last_row, &last_col), ==, 0);
+    g_assert_cmpuint(row, ==, 2);
+    g_assert_cmpuint(last_col, ==, 4);
+    g_assert_cmpint(dm_parse_range("A1:", &row, &col, &last_row, &last_col), ==, 1);
+    g_assert_cmpint(dm_parse_range("A1:XFD1048576", &row, &col, &last_row, &last_col), ==, 1);
+}
+
+void test_csv_quoted_fields(void) {
+    char data[] = "cell_key,template_sheet,cellreference\r\n"
+                  "\"Project, name\",Introduction,C9\r\n"
+                  "\"Say \"\"hi\"\"\nthere\",Summary,B2\n"
+                  "Last,Summary,AB10";
+    DmCsv csv;
+    DmCsvField f[DM_CSV_MAX_FIELDS];
+    size_t n;
+
+    dm_csv_init(&csv, data, strlen(data));
+    g_assert_cmpint(dm_csv_next(&csv, f, DM_CSV_MAX_FIELDS, &n), ==, 1);
+    g_assert_cmpuint(n, ==, 3);
+    g_assert_cmpuint(f[2].len, ==, strlen("cellreference"));
+
+    g_assert_cmpint(dm_csv_next(&csv, f, DM_CSV_MAX_FIELDS, &n), ==, 1);
+    g_assert_cmpuint(n, ==, 3);
+    g_assert_cmpint(strncmp(f[0].str, "Project, name", f[0].len), ==, 0);
+    g_assert_cmpuint(f[0].len, ==, 13);
+    g_assert_cmpuint(f[2].len, ==, 2);
+
+    g_assert_cmpint(dm_csv_next(&csv, f, DM_CSV_MAX_FIELDS, &n), ==, 1);
+    g_assert_cmpuint(csv.lineno, ==, 3);
+    g_assert_cmpuint(f[0].len, ==, strlen("Say \"hi\"\nthere"));
+    g_assert_cmpint(strncmp(f[0].str, "Say \"hi\"\nthere", f[0].len), ==, 0);
+
+    g_assert_cmpint(dm_csv_next(&csv, f, DM_CSV_MAX_FIELDS, &n), ==, 1);
+    g_assert_cmpuint(csv.lineno, ==, 5);
+    g_assert_cmpuint(f[2].len, ==, 4);
+    g_assert_cmpint(dm_csv_next(&csv, f, DM_CSV_MAX_FIELDS, &n), ==, 0);
+}
+
+void test_csv_unterminated_quote(void) {
+    char data[] = "a,\"b,c\n";
+    DmCsv csv;
+    DmCsvField f[DM_CSV_MAX_FIELDS];
+    size_t n;
+
+    dm_csv_init(&csv, data, strlen(data));
+    g_assert_cmpint(dm_csv_next(&csv, f, DM_CSV_MAX_FIELDS, &n), ==, -1);
+}
+
+// Write a cache image, giving it a checksum that matches if fix_checksum
+static void write_image(const char *path, char *image, size_t size, int fix_checksum) {
+    if (fix_checksum) {
+        uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a, with the checksum (header offset 136) zeroed
+        memset(image + 136, 0, 8);
+        for (size_t i = 0; i < size; i++)
+            h = (h ^ (unsigned char)image[i]) * 0x100000001b3ULL;
+        memcpy(image + 136, &h, sizeof(h));
+    }
+    FILE *f = fopen(path, "wb");
+    g_assert_nonnull(f);
+    g_assert_cmpuint(fwrite(image, 1, size, f), ==, size);
+    fclose(f);
+}
+
+void test_cache_roundtrip(void) {
+    DmDatamap dm, loaded;
+    DmLine lines[3] = {{11, "Project name", 0, 9, 3, 9, 3},
+                       {12, "Cost", 0, 40, 28, 40, 28},
+                       {13, "Milestones", 0, 50, 2, 60, 4}};
+    DmSheet sheet = {"Introduction", 0, 3, 9, 60, 2, 28};
+
+    memset(&dm, 0, sizeof(dm));
+    dm.id = 7;
+    dm.lines = lines;
+    dm.nlines = 3;
+    dm.sheets = &sheet;
+    dm.nsheets = 1;
+    dm_index_init(&sheet.index, 2);
+    dm_index_add(&sheet.index, 9, 3, 0);
+    dm_index_add(&sheet.index, 40, 28, 1);
+    g_assert_cmpint(dm_datamap_layout(&dm), ==, 0);
+    g_assert_cmpuint(dm.nvalues, ==, 2 + 11 * 3);
+
+    g_assert_cmpint(dm_cache_write(&dm, "roundtrip test", 42), ==, 0);
+    g_assert_cmpint(dm_cache_read("roundtrip test", 43, &loaded), ==, 1);
+    g_assert_cmpint(dm_cache_read("roundtrip test", 42, &loaded), ==, 0);
+    g_assert_cmpint(loaded.id, ==, 7);
+    g_assert_cmpuint(loaded.nlines, ==, 3);
+    g_assert_cmpstr(loaded.sheets[0].name, ==, "Introduction");
+    g_assert_cmpstr(loaded.lines[1].key, ==, "Cost");
+    g_assert_cmpuint(loaded.sheets[0].max_col, ==, 28);
+    g_assert_cmpuint(dm_index_find(&loaded.sheets[0].index, 40, 28)->line, ==, 1);
+    g_assert_null(dm_index_find(&loaded.sheets[0].index, 40, 27));
+    g_assert_cmpuint(loaded.sheets[0].nranges, ==, 1);
+    g_assert_cmpuint(loaded.ranges[loaded.sheets[0].first_range], ==, 2);
+    g_assert_cmpuint(loaded.lines[2].last_row, ==, 60);
+    g_assert_cmpuint(loaded.lines[2].value, ==, 2);
+    g_assert_cmpuint(loaded.nvalues, ==, 35);
+
+    dm_datamap_free(&loaded);
+    dm_index_free(&sheet.index);
+    free(dm.ranges);
+
+    // a damaged image is refused rather than read
+    char path[512], image[4096];
+    dm_cache_path("roundtrip test", path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    g_assert_nonnull(f);
+    size_t size = fread(image, 1, sizeof(image), f);
+    fclose(f);
+    char *forged = malloc(size);
+    uint64_t n = 1000;
+    memcpy(forged, image, size);
+    memcpy(forged + 40, &n, sizeof(n)); // the header's nlines
+    write_image(path, forged, size, 0);
+    g_assert_cmpint(dm_cache_read("roundtrip test", 42, &loaded), ==, 1);
+    // even with a checksum to match, the lines would run off the end
+    write_image(path, forged, size, 1);
+    g_assert_cmpint(dm_cache_read("roundtrip test", 42, &loaded), ==, 1);
+    // a sheet index too small to hash into, on an empty slot so it adds up otherwise
+    uint64_t slots_off, j = 0;
+    memcpy(forged, image, size);
+    memcpy(&slots_off, forged + 88, sizeof(slots_off));
+    while (*(uint64_t *)(forged + slots_off + j * sizeof(DmCellSlot)) != 0)
+        j++;
+    memcpy(forged + 144 + 24, &j, sizeof(j)); // the sheet's slots_first,
+    n = 0;
+    memcpy(forged + 144 + 32, &n, sizeof(n)); // index_bits
+    memcpy(forged + 144 + 40, &n, sizeof(n)); // and index_count
+    write_image(path, forged, size, 1);
+    g_assert_cmpint(dm_cache_read("roundtrip test", 42, &loaded), ==, 1);
+    free(forged);
+    write_image(path, image, size - 8, 0);
+    g_assert_cmpint(dm_cache_read("roundtrip test", 42, &loaded), ==, 1);
+    unlink(path);
+}
+
+void test_cell_index(void) {
+    DmCellIndex idx;
+    g_assert_cmpint(dm_index_init(&idx, 2), ==, 0);
+    for (size_t r = 1; r <= 100; r++)
+        g_assert_cmpint(dm_index_add(&idx, r, 27, (uint32_t)r), ==, 0);
+    g_assert_cmpuint(idx.count, ==, 100);
+    g_assert_nonnull(dm_index_find(&idx, 50, 27));
+    g_assert_cmpuint(dm_index_find(&idx, 50, 27)->line, ==, 50);
+    g_assert_null(dm_index_find(&idx, 50, 26));
+    dm_index_free(&idx);
+}
+
+// A ustar header for a regular file called name, size bytes long
+static void tar_header(char *h, const char *name, size_t size) {
+    unsigned sum = 0;
+    memset(h, 0, 512);
+    strcpy(h, name);
+    sprintf(h + 124, "%011zo", size);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < 512; i++)
+        sum += (unsigned char)h[i];
+    sprintf(h + 148, "%06o", sum);
+}
+
+void test_bundle_tar(void) {
+    char tar[512 * 6];
+    DmBundle bundle;
+    const char *path = "test_bundle.tar";
+
+    memset(tar, 0, sizeof(tar));
+    tar_header(tar, "notes.txt", 3);
+    memcpy(tar + 512, "hi\n", 3);
+    tar_header(tar + 1024, "returns/a.xlsx", 4);
+    memcpy(tar + 1536, "PK\3\4", 4);
+    FILE *f = fopen(path, "wb");
+    g_assert_nonnull(f);
+    fwrite(tar, 1, sizeof(tar), f);
+    fclose(f);
+
+    g_assert_cmpint(dm_bundle_open(path, NULL, &bundle), ==, 0);
+    g_assert_cmpuint(bundle.nworkbooks, ==, 1);
+    g_assert_nonnull(strstr(bundle.workbooks[0].name, "test_bundle.tar/returns/a.xlsx"));
+    g_assert_cmpuint(bundle.workbooks[0].size, ==, 4);
+    g_assert_cmpint(memcmp(bundle.workbooks[0].data, "PK\3\4", 4), ==, 0);
+    dm_bundle_close(&bundle);
+    unlink(path);
+}
+
+// How many returns test.db has for file
+static int count_returns(const char *file) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int n = -1;
+
+    g_assert_cmpint(sqlite3_open("test.db", &db), ==, SQLITE_OK);
+    g_assert_cmpint(sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM return WHERE file = ?", -1, &stmt, NULL), ==, SQLITE_OK);
+    sqlite3_bind_text(stmt, 1, file, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        n = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return n;
+}
+
+void test_import_stdin(void) {
+    const char *path = "test_stdin.csv";
+    char *names[] = {"stdin test"};
+    DmImportOptions opts = {1, 0, 1, NULL, 1, 0};
+    char cache[512];
+
+    FILE *f = fopen(path, "w");
+    g_assert_nonnull(f);
+    fputs("key,sheet,cellref\nNum,Introduction,A1\n", f);
+    fclose(f);
+    unlink("test.db");
+    g_assert_cmpint(dm_import_dm((char *)path, names[0], 1), ==, 0);
+    unlink(path);
+
+    // each import keeps its own name, so the second doesn't replace the first
+    g_assert_nonnull(freopen("_test_template.xlsx", "rb", stdin));
+    g_assert_cmpint(dm_import_stdin("first.xlsx", names, 1, &opts), ==, 0);
+    g_assert_nonnull(freopen("_test_template.xlsx", "rb", stdin));
+    g_assert_cmpint(dm_import_stdin("second.xlsx", names, 1, &opts), ==, 0);
+    g_assert_cmpint(count_returns("first.xlsx"), ==, 1);
+    g_assert_cmpint(count_returns("second.xlsx"), ==, 1);
+    g_assert_cmpint(dm_import_stdin(NULL, names, 1, &opts), ==, 1);
+
+    unlink("test.db");
+    dm_cache_path(names[0], cache, sizeof(cache));
+    unlink(cache);
+}
+
+/* The returns a publish test stores: one imported before the batch, then
+ * the batch, which replaces it. Slots are Name, Cost, RAG and then the
+ * four cells of a range. */
+static const char *publish_returns[4][7] = {
+    {"Alpha", "10", "Green", "x", "y", NULL, "Alpha"},
+    {"Beta", "2.5", "Amber", "Green", "new text", "TRUE", NULL},
+    {"Gamma", "007", "Red", "new text", "Beta", NULL, NULL},
+    {"Delta", "11", "Green", NULL, NULL, NULL, NULL},
+};
+static char *publish_files[4] = {"old.xlsx", "a.xlsx", "b.xlsx", "old.xlsx"};
+
+// A database at path with the publish test's datamap and its first return
+static sqlite3 *publish_db(const char *path, DmDatamap *dm) {
+    sqlite3 *db;
+    DmWriter w;
+    DmReturn ret;
+
+    g_assert_cmpint(sqlite3_open(path, &db), ==, SQLITE_OK);
+    g_assert_cmpint(dm_exec_sql_stmt("PRAGMA foreign_keys = ON;"
+                                     "CREATE TABLE datamap(id INTEGER PRIMARY KEY, name TEXT, date_created TEXT,"
+                                     "  revision INTEGER NOT NULL DEFAULT 0);"
+                                     "CREATE TABLE datamap_line(id INTEGER PRIMARY KEY, dm_id INTEGER,"
+                                     "  key TEXT NOT NULL, sheet TEXT NOT NULL, cellref TEXT,"
+                                     "  type TEXT, min REAL, max REAL, pattern TEXT, allowed TEXT);"
+                                     "INSERT INTO datamap VALUES(1, 'publish', '2020-01-01', 0);"
+                                     "INSERT INTO datamap_line(id, dm_id, key, sheet, cellref) VALUES"
+                                     "  (1, 1, 'Name', 'Summary', 'A1'), (2, 1, 'Cost', 'Summary', 'B1'),"
+                                     "  (3, 1, 'RAG', 'Summary', 'C1'), (4, 1, 'Table', 'Summary', 'A3:B4');", db),
+                    ==, SQLITE_OK);
+    g_assert_cmpint(get_all_sheet_and_cellrefs_from_datamap_in_sqlite3(db, "publish", dm), ==, 0);
+    g_assert_cmpuint(dm->nvalues, ==, 7);
+
+    memset(&ret, 0, sizeof(ret));
+    ret.filepath = publish_files[0];
+    ret.hash = 1;
+    ret.values = publish_returns[0];
+    g_assert_cmpint(dm_writer_open(&w, db), ==, 0);
+    g_assert_cmpint(dm_writer_store(&w, dm, &ret), ==, 0);
+    dm_writer_close(&w);
+    return db;
+}
+
+// The rows of sql, one per line, columns separated by |
+static char *dump_rows(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    char *out = sqlite3_mprintf("");
+
+    g_assert_cmpint(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL), ==, SQLITE_OK);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        for (int c = 0; c < sqlite3_column_count(stmt); c++)
+            out = sqlite3_mprintf("%z%s|", out, sqlite3_column_text(stmt, c) ? (const char *)sqlite3_column_text(stmt, c) : "NULL");
+        out = sqlite3_mprintf("%z\n", out);
+    }
+    sqlite3_finalize(stmt);
+    return out;
+}
+
+void test_stage_publish(void) {
+    DmDatamap direct_dm, bulk_dm;
+    sqlite3 *direct = publish_db(":memory:", &direct_dm), *bulk = publish_db(":memory:", &bulk_dm);
+    DmWriter w;
+    DmReturn ret;
+
+    // the batch, written straight to one database and staged for the other
+    g_assert_cmpint(dm_writer_open(&w, direct), ==, 0);
+    g_assert_cmpint(dm_exec_sql_stmt("BEGIN;", direct), ==, SQLITE_OK);
+    for (int r = 1; r < 4; r++) {
+        memset(&ret, 0, sizeof(ret));
+        ret.filepath = publish_files[r];
+        ret.hash = r + 1;
+        ret.values = publish_returns[r];
+        g_assert_cmpint(dm_writer_store(&w, &direct_dm, &ret), ==, 0);
+    }
+    g_assert_cmpint(dm_exec_sql_stmt("COMMIT;", direct), ==, SQLITE_OK);
+    dm_writer_close(&w);
+
+    g_assert_cmpint(dm_writer_open_staging(&w, bulk), ==, 0);
+    g_assert_cmpint(dm_exec_sql_stmt("BEGIN;", bulk), ==, SQLITE_OK);
+    for (int r = 1; r < 4; r++) {
+        memset(&ret, 0, sizeof(ret));
+        ret.filepath = publish_files[r];
+        ret.hash = r + 1;
+        ret.values = publish_returns[r];
+        g_assert_cmpint(dm_writer_store(&w, &bulk_dm, &ret), ==, 0);
+    }
+    g_assert_cmpint(dm_exec_sql_stmt("COMMIT;", bulk), ==, SQLITE_OK);
+    g_assert_cmpint(dm_stage_publish(bulk), ==, 0);
+    dm_writer_close(&w);
+    dm_stage_discard(bulk);
+
+    const char *checks[] = {
+        "SELECT id, file, hash, dm_id FROM return ORDER BY id",
+        "SELECT id, text FROM value ORDER BY id",
+        "SELECT return_id, datamap_line_id, range_row, range_col, value, vtype, text"
+        "  FROM return_value ORDER BY return_id, datamap_line_id, range_row, range_col",
+    };
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        char *want = dump_rows(direct, checks[i]), *got = dump_rows(bulk, checks[i]);
+        g_assert_cmpstr(got, ==, want);
+        sqlite3_free(want);
+        sqlite3_free(got);
+    }
+    // the first import of old.xlsx was replaced, and its text kept
+    char *returns = dump_rows(bulk, "SELECT id, file FROM return ORDER BY id");
+    g_assert_cmpstr(returns, ==, "2|a.xlsx|\n3|b.xlsx|\n4|old.xlsx|\n");
+    sqlite3_free(returns);
+    char *texts = dump_rows(bulk, "SELECT text FROM value ORDER BY id");
+    g_assert_cmpstr(texts, ==, "Alpha|\nGreen|\nx|\ny|\nBeta|\nAmber|\nnew text|\nGamma|\n007|\nRed|\nDelta|\n");
+    sqlite3_free(texts);
+
+    dm_datamap_free(&direct_dm);
+    dm_datamap_free(&bulk_dm);
+    sqlite3_close(direct);
+    sqlite3_close(bulk);
+}
+
+/* test.db as importing the publish test's returns one at a time leaves
+ * it, for the commands that read it: a.xlsx is return 2, b.xlsx 3 and
+ * old.xlsx 4. */
+static void write_test_db(void) {
+    DmDatamap dm;
+    DmWriter w;
+    DmReturn ret;
+
+    unlink("test.db");
+    sqlite3 *db = publish_db("test.db", &dm);
+    g_assert_cmpint(dm_exec_sql_stmt(dm_sql_str_create_index_datamap, db), ==, SQLITE_OK);
+    g_assert_cmpint(dm_writer_open(&w, db), ==, 0);
+    for (int r = 1; r < 4; r++) {
+        memset(&ret, 0, sizeof(ret));
+        ret.filepath = publish_files[r];
+        ret.hash = r + 1;
+        ret.values = publish_returns[r];
+        g_assert_cmpint(dm_writer_store(&w, &dm, &ret), ==, 0);
+    }
+    dm_writer_close(&w);
+    dm_datamap_free(&dm);
+    sqlite3_close(db);
+}
+
+// The whole of the file at path, to be freed
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    g_assert_nonnull(f);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *s = malloc(size + 1);
+    g_assert_nonnull(s);
+    g_assert_cmpint(fread(s, 1, size, f), ==, size);
+    s[size] = '\0';
+    fclose(f);
+    return s;
+}
+
+void test_export_master(void) {
+    sqlite3 *db;
+
+    write_test_db();
+    g_assert_cmpint(sqlite3_open("test.db", &db), ==, SQLITE_OK);
+    // lines in id order, each one's values from an index: nothing built or sorted
+    char *sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", dm_sql_str_master_values);
+    char *plan = dump_rows(db, sql);
+    g_assert_null(strstr(plan, "MATERIALIZE"));
+    g_assert_null(strstr(plan, "AUTOMATIC"));
+    g_assert_null(strstr(plan, "TEMP B-TREE"));
+    g_assert_nonnull(strstr(plan, "SCAN l|"));
+    g_assert_nonnull(strstr(plan, "SEARCH d USING INDEX return_data_by_line"));
+    sqlite3_free(plan);
+    sqlite3_free(sql);
+    sqlite3_close(db);
+
+    g_assert_cmpint(dm_export_master("publish", "test_master.csv"), ==, 0);
+    char *csv = read_file("test_master.csv");
+    g_assert_cmpstr(csv, ==, "key,a.xlsx,b.xlsx,old.xlsx\n"
+                             "Name,Beta,Gamma,Delta\n"
+                             "Cost,2.5,007,11\n"
+                             "RAG,Amber,Red,Green\n"
+                             "\"Table[1,1]\",Green,new text,\n"
+                             "\"Table[1,2]\",new text,Beta,\n"
+                             "\"Table[2,1]\",TRUE,,\n");
+    free(csv);
+    unlink("test_master.csv");
+    unlink("test.db");
+}
+
+void test_diff(void) {
+    write_test_db();
+
+    // a.xlsx to b.xlsx: 007 is a code, not a number, and a.xlsx had a cell b.xlsx hasn't
+    g_assert_cmpint(dm_diff("publish", "2", "3", "test_diff.csv", 1), ==, 0);
+    char *csv = read_file("test_diff.csv");
+    g_assert_cmpstr(csv, ==, "return,key,status,old,new,delta\n"
+                             "b.xlsx,Name,changed,Beta,Gamma,\n"
+                             "b.xlsx,Cost,changed,2.5,007,\n"
+                             "b.xlsx,RAG,changed,Amber,Red,\n"
+                             "b.xlsx,\"Table[1,1]\",changed,Green,new text,\n"
+                             "b.xlsx,\"Table[1,2]\",changed,new text,Beta,\n"
+                             "b.xlsx,\"Table[2,1]\",removed,TRUE,,\n");
+    free(csv);
+
+    // by workbook: numbers get a delta, and old.xlsx has no table
+    g_assert_cmpint(dm_diff("publish", "old.xlsx", "a.xlsx", "test_diff.csv", 1), ==, 0);
+    csv = read_file("test_diff.csv");
+    g_assert_cmpstr(csv, ==, "return,key,status,old,new,delta\n"
+                             "a.xlsx,Name,changed,Delta,Beta,\n"
+                             "a.xlsx,Cost,changed,11,2.5,-8.5\n"
+                             "a.xlsx,RAG,changed,Green,Amber,\n"
+                             "a.xlsx,\"Table[1,1]\",added,,Green,\n"
+                             "a.xlsx,\"Table[1,2]\",added,,new text,\n"
+                             "a.xlsx,\"Table[2,1]\",added,,TRUE,\n");
+    free(csv);
+
+    // nothing changed, nothing to say
+    g_assert_cmpint(dm_diff("publish", "3", "b.xlsx", "test_diff.csv", 1), ==, 0);
+    csv = read_file("test_diff.csv");
+    g_assert_cmpstr(csv, ==, "return,key,status,old,new,delta\n");
+    free(csv);
+
+    g_assert_cmpint(dm_diff("publish", "3", "99", "test_diff.csv", 1), ==, 1);
+    unlink("test_diff.csv");
+    unlink("test.db");
+}
+
+void test_query(void) {
+    char *keys[] = {"Cost", "Table", NULL};
+    char *missing[] = {"Cost", "Nope", NULL};
+
+    write_test_db();
+
+    g_assert_cmpint(dm_query("publish", "2", keys, "test_query.out", 0), ==, 0);
+    char *out = read_file("test_query.out");
+    g_assert_cmpstr(out, ==, "return,file,key,value\n"
+                             "2,a.xlsx,Cost,2.5\n"
+                             "2,a.xlsx,\"Table[1,1]\",Green\n"
+                             "2,a.xlsx,\"Table[1,2]\",new text\n"
+                             "2,a.xlsx,\"Table[2,1]\",TRUE\n");
+    free(out);
+
+    // numbers and booleans as themselves
+    g_assert_cmpint(dm_query("publish", "a.xlsx", keys, "test_query.out", 1), ==, 0);
+    out = read_file("test_query.out");
+    g_assert_cmpstr(out, ==, "[\n"
+                             "  {\"return\": 2, \"file\": \"a.xlsx\", \"key\": \"Cost\", \"value\": 2.5},\n"
+                             "  {\"return\": 2, \"file\": \"a.xlsx\", \"key\": \"Table[1,1]\", \"value\": \"Green\"},\n"
+                             "  {\"return\": 2, \"file\": \"a.xlsx\", \"key\": \"Table[1,2]\", \"value\": \"new text\"},\n"
+                             "  {\"return\": 2, \"file\": \"a.xlsx\", \"key\": \"Table[2,1]\", \"value\": true}\n"
+                             "]\n");
+    free(out);
+
+    // a key across every return; one the datamap hasn't got fails, but not the rest
+    g_assert_cmpint(dm_query("publish", NULL, missing, "test_query.out", 0), ==, 1);
+    out = read_file("test_query.out");
+    g_assert_cmpstr(out, ==, "return,file,key,value\n"
+                             "2,a.xlsx,Cost,2.5\n"
+                             "3,b.xlsx,Cost,007\n"
+                             "4,old.xlsx,Cost,11\n");
+    free(out);
+
+    g_assert_cmpint(dm_query("publish", "old.xlsx", missing, "test_query.out", 1), ==, 1);
+    g_assert_cmpint(dm_query("publish", "5", keys, "test_query.out", 0), ==, 1);
+    unlink("test_query.out");
+    unlink("test.db");
+}
+
+// Is return r's bit set in the null bitmap at off?
+static int snapshot_present(const DmSnapshot *snap, uint64_t off, size_t r) {
+    const uint64_t *bits = (const uint64_t *)(snap->map + off);
+    return (bits[r / 64] >> (r % 64)) & 1;
+}
+
+void test_snapshot(void) {
+    DmSnapshot snap;
+
+    write_test_db();
+    g_assert_cmpint(dm_snapshot_write("publish", NULL, "test.snap"), ==, 0);
+    g_assert_cmpint(dm_snapshot_open("test.snap", &snap), ==, 0);
+
+    g_assert_cmpuint(snap.nreturns, ==, 3);
+    g_assert_cmpint(snap.returns[0].id, ==, 2);
+    g_assert_cmpstr(dm_snapshot_string(&snap, snap.returns[2].file_off), ==, "old.xlsx");
+    // Name, Cost, RAG and the three table cells anything has a value for
+    g_assert_cmpuint(snap.nkeys, ==, 6);
+
+    const DmSnapshotKey *name = &snap.keys[0];
+    g_assert_cmpstr(dm_snapshot_string(&snap, name->key_off), ==, "Name");
+    g_assert_cmpuint(name->type, ==, DM_VALUE_TEXT);
+    g_assert_cmpuint(name->count, ==, 3);
+    const DmSnapshotValue *v = (const DmSnapshotValue *)(snap.map + name->values_off);
+    g_assert_cmpstr(dm_snapshot_string(&snap, v[1].text_off), ==, "Gamma");
+
+    // 2.5, 007 and 11: a real, a code and an integer, so a byte of type each
+    const DmSnapshotKey *cost = &snap.keys[1];
+    g_assert_cmpuint(cost->type, ==, DM_SNAPSHOT_MIXED);
+    g_assert_cmpuint(cost->types_off, !=, 0);
+    const unsigned char *types = (const unsigned char *)(snap.map + cost->types_off);
+    g_assert_cmpuint(types[0], ==, DM_VALUE_REAL);
+    g_assert_cmpuint(types[1], ==, DM_VALUE_TEXT);
+    g_assert_cmpuint(types[2], ==, DM_VALUE_INTEGER);
+    v = (const DmSnapshotValue *)(snap.map + cost->values_off);
+    g_assert_cmpfloat(v[0].r, ==, 2.5);
+    g_assert_cmpstr(dm_snapshot_string(&snap, v[1].text_off), ==, "007");
+    g_assert_cmpint(v[2].i, ==, 11);
+
+    // only a.xlsx has the last table cell
+    const DmSnapshotKey *flag = &snap.keys[5];
+    g_assert_cmpstr(dm_snapshot_string(&snap, flag->key_off), ==, "Table");
+    g_assert_cmpuint(flag->range_row, ==, 2);
+    g_assert_cmpuint(flag->range_col, ==, 1);
+    g_assert_cmpuint(flag->type, ==, DM_VALUE_BOOLEAN);
+    g_assert_cmpuint(flag->count, ==, 1);
+    g_assert_true(snapshot_present(&snap, flag->present_off, 0));
+    g_assert_false(snapshot_present(&snap, flag->present_off, 1));
+    g_assert_false(snapshot_present(&snap, flag->present_off, 2));
+    g_assert_cmpint(((const DmSnapshotValue *)(snap.map + flag->values_off))[0].i, ==, 1);
+    dm_snapshot_close(&snap);
+
+    // one return of them
+    g_assert_cmpint(dm_snapshot_write("publish", "b.xlsx", "test.snap"), ==, 0);
+    g_assert_cmpint(dm_snapshot_open("test.snap", &snap), ==, 0);
+    g_assert_cmpuint(snap.nreturns, ==, 1);
+    g_assert_cmpint(snap.returns[0].id, ==, 3);
+    g_assert_cmpuint(snap.nkeys, ==, 5);
+    dm_snapshot_close(&snap);
+
+    unlink("test.snap");
+    unlink("test.db");
+}
+
+void test_find_returns(void) {
+    DmDatamap dm;
+    DmReturnRefs refs;
+    sqlite3 *db = publish_db(":memory:", &dm);
+
+    g_assert_cmpint(dm_exec_sql_stmt("INSERT INTO return(id, file, imported, dm_id) VALUES"
+                                     "  (7, '/q1/b.xlsx', 'now', 1), (8, '/q1/a.xlsx', 'now', 1),"
+                                     "  (9, '/q1/sub/c.xlsx', 'now', 1), (10, '/q1x/d.xlsx', 'now', 1);", db),
+                    ==, SQLITE_OK);
+
+    g_assert_true(dm_is_return_id("42"));
+    g_assert_false(dm_is_return_id(""));
+    g_assert_false(dm_is_return_id("4a"));
+
+    g_assert_cmpint(dm_find_returns(db, 1, "8", 1, &refs), ==, 0);
+    g_assert_cmpuint(refs.count, ==, 1);
+    g_assert_false(refs.batch);
+    g_assert_cmpint(refs.refs[0].id, ==, 8);
+    g_assert_cmpstr(refs.refs[0].name, ==, "a.xlsx");
+    dm_free_return_refs(&refs);
+
+    // not a batch, however the path starts
+    g_assert_cmpint(dm_find_returns(db, 1, "/q1x/d.xlsx", 1, &refs), ==, 0);
+    g_assert_cmpuint(refs.count, ==, 1);
+    g_assert_cmpint(refs.refs[0].id, ==, 10);
+    dm_free_return_refs(&refs);
+
+    // a batch is everything under it, by name, and nothing in /q1x
+    g_assert_cmpint(dm_find_returns(db, 1, "/q1", 1, &refs), ==, 0);
+    g_assert_true(refs.batch);
+    g_assert_cmpuint(refs.count, ==, 3);
+    g_assert_cmpstr(refs.refs[0].name, ==, "a.xlsx");
+    g_assert_cmpstr(refs.refs[1].name, ==, "b.xlsx");
+    g_assert_cmpstr(refs.refs[2].name, ==, "sub/c.xlsx");
+    g_assert_cmpstr(refs.refs[2].file, ==, "/q1/sub/c.xlsx");
+    dm_free_return_refs(&refs);
+
+    g_assert_cmpint(dm_find_returns(db, 1, "/q1", 0, &refs), ==, 0);
+    g_assert_cmpuint(refs.count, ==, 0);
+    g_assert_cmpint(dm_find_returns(db, 2, "8", 1, &refs), ==, 0);
+    g_assert_cmpuint(refs.count, ==, 0);
+
+    dm_datamap_free(&dm);
+    sqlite3_close(db);
+}
+
+void test_arena(void) {
+    DmArena a;
+    dm_arena_init(&a, 64);
+
+    const char *green = dm_arena_intern(&a, "Green");
+    g_assert_cmpstr(green, ==, "Green");
+    char buf[16] = "Green";
+    g_assert_true(dm_arena_intern(&a, buf) == green);
+    g_assert_true(dm_arena_intern(&a, "Amber") != green);
+
+    // enough to need several chunks and a bigger intern table
+    for (int i = 0; i < 500; i++) {
+        snprintf(buf, sizeof(buf), "value %d", i);
+        g_assert_nonnull(dm_arena_intern(&a, buf));
+    }
+    g_assert_cmpuint(a.intern_count, ==, 502);
+    g_assert_true(dm_arena_intern(&a, "Green") == green);
+
+    uint64_t *n = dm_arena_alloc(&a, sizeof(uint64_t));
+    g_assert_cmpuint((uintptr_t)n % sizeof(void *), ==, 0);
+    g_assert_cmpstr(dm_arena_strndup(&a, "Summary sheet", 7), ==, "Summary");
+
+    dm_arena_reset(&a);
+    g_assert_cmpuint(a.intern_count, ==, 0);
+    g_assert_cmpstr(dm_arena_intern(&a, "Red"), ==, "Red");
+    dm_arena_free(&a);
+}
+
+void test_classify_value(void) {
+    DmValue v;
+
+    g_assert_cmpint(dm_classify_value("10", &v), ==, DM_VALUE_INTEGER);
+    g_assert_cmpint(v.i, ==, 10);
+    g_assert_true(v.exact);
+    g_assert_cmpint(dm_classify_value("-9223372036854775808", &v), ==, DM_VALUE_INTEGER);
+    g_assert_cmpint(v.i, ==, INT64_MIN);
+    g_assert_cmpint(dm_classify_value("007", &v), ==, DM_VALUE_TEXT);
+
+    g_assert_cmpint(dm_classify_value("2.2", &v), ==, DM_VALUE_REAL);
+    g_assert_cmpfloat(v.r, ==, 2.2);
+    g_assert_true(v.exact);
+    g_assert_cmpint(dm_classify_value("2.2000000000000002", &v), ==, DM_VALUE_REAL);
+    g_assert_false(v.exact);
+    g_assert_cmpint(dm_classify_value("1E3", &v), ==, DM_VALUE_REAL);
+    g_assert_cmpfloat(v.r, ==, 1000.0);
+    g_assert_false(v.exact);
+    g_assert_cmpint(dm_classify_value("99999999999999999999", &v), ==, DM_VALUE_REAL);
+    g_assert_false(v.exact);
+
+    g_assert_cmpint(dm_classify_value("TRUE", &v), ==, DM_VALUE_BOOLEAN);
+    g_assert_cmpint(v.i, ==, 1);
+    g_assert_true(v.exact);
+    g_assert_cmpint(dm_classify_value("false", &v), ==, DM_VALUE_BOOLEAN);
+    g_assert_false(v.exact);
+
+    g_assert_cmpint(dm_classify_value("", &v), ==, DM_VALUE_TEXT);
+    g_assert_cmpint(dm_classify_value("-", &v), ==, DM_VALUE_TEXT);
+    g_assert_cmpint(dm_classify_value("1.", &v), ==, DM_VALUE_REAL);
+    g_assert_cmpint(dm_classify_value("1e", &v), ==, DM_VALUE_TEXT);
+    g_assert_cmpint(dm_classify_value(" 1", &v), ==, DM_VALUE_TEXT);
+    g_assert_cmpint(dm_classify_value("0x10", &v), ==, DM_VALUE_TEXT);
+    g_assert_cmpint(dm_classify_value("Green", &v), ==, DM_VALUE_TEXT);
+}
+
+void test_rules(void) {
+    DmRule rule;
+    regex_t re;
+    char why[128];
+
+    g_assert_cmpint(dm_rule_parse("integer|TEXT", "0", "100", &rule), ==, 0);
+    g_assert_cmpint(dm_rule_check(&rule, "50"), ==, DM_CHECK_OK);
+    g_assert_cmpint(dm_rule_check(&rule, "101"), ==, DM_CHECK_MAX);
+    g_assert_cmpint(dm_rule_check(&rule, "-1"), ==, DM_CHECK_MIN);
+    // text is allowed, but can't be held to bounds
+    g_assert_cmpint(dm_rule_check(&rule, "Green"), ==, DM_CHECK_TYPE);
+    g_assert_cmpint(dm_rule_check(&rule, "2.5"), ==, DM_CHECK_TYPE);
+    dm_rule_describe(&rule, DM_CHECK_TYPE, why, sizeof(why));
+    g_assert_cmpstr(why, ==, "is not text|integer");
+
+    g_assert_cmpint(dm_rule_parse("number", NULL, "", &rule), ==, 0);
+    g_assert_cmpint(dm_rule_check(&rule, "2.5"), ==, DM_CHECK_OK);
+    g_assert_cmpint(dm_rule_check(&rule, "007"), ==, DM_CHECK_TYPE);
+    g_assert_cmpint(dm_rule_parse("date", NULL, NULL, &rule), ==, 1);
+    g_assert_cmpint(dm_rule_parse(NULL, "ten", NULL, &rule), ==, 1);
+
+    g_assert_cmpint(dm_rule_parse(NULL, NULL, NULL, &rule), ==, 0);
+    rule.allowed = "Red|Amber|Green";
+    g_assert_cmpint(dm_rule_check(&rule, "Amber"), ==, DM_CHECK_OK);
+    g_assert_cmpint(dm_rule_check(&rule, "Amb"), ==, DM_CHECK_ALLOWED);
+    g_assert_cmpint(dm_rule_check(&rule, ""), ==, DM_CHECK_ALLOWED);
+
+    rule.allowed = NULL;
+    rule.pattern = "[A-Z]{3}[0-9]+";
+    g_assert_cmpint(dm_rule_compile(rule.pattern, &re), ==, 0);
+    rule.regex = &re;
+    g_assert_cmpint(dm_rule_check(&rule, "ABC123"), ==, DM_CHECK_OK);
+    // the whole value has to match
+    g_assert_cmpint(dm_rule_check(&rule, "xABC123"), ==, DM_CHECK_PATTERN);
+    regfree(&re);
+    g_assert_cmpint(dm_rule_compile("(oops", &re), ==, 1);
+}
+
+void test_cursor(void) {
+    const char *path = "test_cursor.csv";
+    const DmRecord *r;
+
+    FILE *f = fopen(path, "w");
+    g_assert_nonnull(f);
+    fputs("key,sheet,cellref,max\n"
+          "Intro,Introduction,A1:J9,\n"
+          "Num,Introduction,A1,5\n"
+          "Missing,Nowhere,A1,\n", f);
+    fclose(f);
+    DmExtractor *ex = dm_extractor_compile(path);
+    unlink(path);
+    g_assert_nonnull(ex);
+
+    DmCursor *c = dm_cursor_open(ex, "_test_template.xlsx");
+    g_assert_nonnull(c);
+    // the cell's own line, then the range it is in
+    g_assert_cmpint(dm_cursor_next(c), ==, 1);
+    r = dm_cursor_record(c);
+    g_assert_cmpstr(r->key, ==, "Num");
+    g_assert_cmpstr(r->value, ==, "10");
+    g_assert_cmpstr(r->problem, ==, "is above 5");
+    g_assert_cmpint(dm_cursor_next(c), ==, 1);
+    r = dm_cursor_record(c);
+    g_assert_cmpstr(r->key, ==, "Intro");
+    g_assert_cmpuint(r->range_row, ==, 1);
+    g_assert_null(r->problem);
+    g_assert_cmpint(dm_cursor_next(c), ==, 1);
+    r = dm_cursor_record(c);
+    g_assert_cmpstr(r->sheet, ==, "Introduction");
+    g_assert_cmpstr(r->cellref, ==, "C9");
+    g_assert_cmpstr(r->value, ==, "Test Department");
+    g_assert_cmpuint(r->range_row, ==, 9);
+    g_assert_cmpuint(r->range_col, ==, 3);
+    g_assert_cmpint(dm_cursor_next(c), ==, 1);
+    g_assert_cmpstr(dm_cursor_record(c)->cellref, ==, "J9");
+    g_assert_cmpint(dm_cursor_next(c), ==, 0);
+    dm_cursor_close(c);
+
+    c = dm_cursor_open(ex, "no_such_workbook.xlsx");
+    g_assert_cmpint(dm_cursor_next(c), ==, -1);
+    g_assert_nonnull(dm_cursor_error(c));
+    dm_cursor_close(c);
+    dm_extractor_free(ex);
+}
+
+void test_shared_cell(void) {
+    const char *path = "test_shared_cell.csv";
+    DmDatamap dm, loaded;
+    DmReturn ret;
+
+    FILE *f = fopen(path, "w");
+    g_assert_nonnull(f);
+    fputs("key,sheet,cellref,max\n"
+          "Num,Introduction,A1,\n"
+          "Same num,Introduction,A1,5\n", f);
+    fclose(f);
+    g_assert_cmpint(dm_datamap_compile_csv(path, &dm), ==, 0);
+    g_assert_cmpuint(dm.nlines, ==, 2);
+
+    // both keys get the cell's value
+    g_assert_cmpint(dm_extract_workbook(&dm, "_test_template.xlsx", &ret), ==, 0);
+    g_assert_cmpstr(ret.values[dm.lines[0].value], ==, "10");
+    g_assert_cmpstr(ret.values[dm.lines[1].value], ==, "10");
+    g_assert_cmpuint(ret.nmatched, ==, 2);
+    g_assert_cmpuint(ret.nfailures, ==, 1);
+    g_assert_cmpuint(ret.failures[0].line, ==, 1);
+    dm_return_free(&ret);
+
+    // and still do once the datamap has been through the cache
+    g_assert_cmpint(dm_cache_write(&dm, "shared cell test", 1), ==, 0);
+    g_assert_cmpint(dm_cache_read("shared cell test", 1, &loaded), ==, 0);
+    g_assert_cmpuint(loaded.lines[0].next, ==, 2);
+    g_assert_cmpuint(loaded.lines[1].next, ==, 0);
+    dm_datamap_free(&loaded);
+    dm_datamap_free(&dm);
+    char cache[512];
+    dm_cache_path("shared cell test", cache, sizeof(cache));
+    unlink(cache);
+
+    DmExtractor *ex = dm_extractor_compile(path);
+    unlink(path);
+    g_assert_nonnull(ex);
+    DmCursor *c = dm_cursor_open(ex, "_test_template.xlsx");
+    g_assert_cmpint(dm_cursor_next(c), ==, 1);
+    g_assert_cmpstr(dm_cursor_record(c)->key, ==, "Num");
+    g_assert_null(dm_cursor_record(c)->problem);
+    g_assert_cmpint(dm_cursor_next(c), ==, 1);
+    g_assert_cmpstr(dm_cursor_record(c)->key, ==, "Same num");
+    g_assert_cmpstr(dm_cursor_record(c)->value, ==, "10");
+    g_assert_cmpstr(dm_cursor_record(c)->problem, ==, "is above 5");
+    g_assert_cmpint(dm_cursor_next(c), ==, 0);
+    dm_cursor_close(c);
+    dm_extractor_free(ex);
+}
+
+void test_cursor_wide_header(void) {
+    const char *path = "test_cursor_wide.csv";
+
+    FILE *f = fopen(path, "w");
+    g_assert_nonnull(f);
+    fputs("key,sheet,cellref", f);
+    for (int i = 4; i < 24; i++)
+        fprintf(f, ",note%d", i);
+    fputs(",max\nNum,Introduction,A1", f);
+    for (int i = 4; i < 24; i++)
+        fputs(",", f);
+    fputs(",5\n", f);
+    fclose(f);
+    DmExtractor *ex = dm_extractor_compile(path);
+    unlink(path);
+    g_assert_nonnull(ex);
+
+    // max is the 24th column, past the ones we keep, so it isn't a rule
+    DmCursor *c = dm_cursor_open(ex, "_test_template.xlsx");
+    g_assert_cmpint(dm_cursor_next(c), ==, 1);
+    g_assert_cmpstr(dm_cursor_record(c)->value, ==, "10");
+    g_assert_null(dm_cursor_record(c)->problem);
+    g_assert_cmpint(dm_cursor_next(c), ==, 0);
+    dm_cursor_close(c);
+    dm_extractor_free(ex);
+}
+
+void test_upgrade_baseline(void) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    DmDatamap dm;
+    char cache[64];
+
+    // the tables as the first release made them
+    g_assert_cmpint(sqlite3_open(":memory:", &db), ==, SQLITE_OK);
+    g_assert_cmpint(dm_exec_sql_stmt("CREATE TABLE datamap(id INTEGER PRIMARY KEY, name TEXT, date_created TEXT);"
+                                     "CREATE TABLE datamap_line(id INTEGER PRIMARY KEY, dm_id INTEGER,"
+                                     "  key TEXT NOT NULL, sheet TEXT NOT NULL, cellref TEXT);"
+                                     "INSERT INTO datamap VALUES(1, 'old', '2020-01-01');"
+                                     "INSERT INTO datamap_line VALUES(1, 1, 'Num', 'Introduction', 'A1');", db),
+                    ==, SQLITE_OK);
+
+    g_assert_cmpint(dm_load_datamap(db, "old", &dm), ==, 0);
+    g_assert_cmpuint(dm.nlines, ==, 1);
+    dm_datamap_free(&dm);
+    dm_cache_path("old", cache, sizeof(cache));
+    unlink(cache);
+
+    // edits bump the revision, so a compiled datamap is seen to be stale
+    g_assert_cmpint(dm_exec_sql_stmt("UPDATE datamap_line SET cellref = 'B2';", db), ==, SQLITE_OK);
+    g_assert_cmpint(sqlite3_prepare_v2(db, "SELECT revision FROM datamap", -1, &stmt, NULL), ==, SQLITE_OK);
+    g_assert_cmpint(sqlite3_step(stmt), ==, SQLITE_ROW);
+    g_assert_cmpint(sqlite3_column_int(stmt, 0), ==, 1);
+    sqlite3_finalize(stmt);
+    // and a second go has nothing to do
+    g_assert_cmpint(dm_upgrade_datamap_line(db), ==, 0);
+    sqlite3_close(db);
+}
+
 int main(int argc, char **argv) {
     g_test_init(&argc, &argv, NULL);
     g_test_add("/set1/new test", dm_fixture, NULL, dm_setup, test_parse_dm, dm_teardown);
+    g_test_add_func("/cellref/parse", test_parse_cellref);
+    g_test_add_func("/cellref/format", test_format_cellref);
+    g_test_add_func("/cellref/range", test_parse_range);
+    g_test_add_func("/cellref/index", test_cell_index);
+    g_test_add_func("/csv/quoted", test_csv_quoted_fields);
+    g_test_add_func("/csv/unterminated", test_csv_unterminated_quote);
+    g_test_add_func("/cache/roundtrip", test_cache_roundtrip);
+    g_test_add_func("/cache/upgrade", test_upgrade_baseline);
+    g_test_add_func("/arena/intern", test_arena);
+    g_test_add_func("/bundle/tar", test_bundle_tar);
+    g_test_add_func("/import/stdin", test_import_stdin);
+    g_test_add_func("/import/publish", test_stage_publish);
+    g_test_add_func("/export/master", test_export_master);
+    g_test_add_func("/returns/find", test_find_returns);
+    g_test_add_func("/diff/returns", test_diff);
+    g_test_add_func("/query/keys", test_query);
+    g_test_add_func("/snapshot/roundtrip", test_snapshot);
+    g_test_add_func("/value/classify", test_classify_value);
+    g_test_add_func("/rules/check", test_rules);
+    g_test_add_func("/cursor/records", test_cursor);
+    g_test_add_func("/cursor/wide-header", test_cursor_wide_header);
+    g_test_add_func("/extract/shared-cell", test_shared_cell);
     return g_test_run();
 }
@@ -0,0 +1,208 @@
+#include <strings.h>
+#include "reader.h"
+
+/* -- Validation rules -----------------------------
+ *
+ * A datamap CSV can carry any of these columns after the first three,
+ * found by their names in the header:
+ *
+ *   type     what the value must be: text, integer, real, number (integer
+ *            or real) or boolean; several can be given as "integer|text"
+ *   min/max  bounds for a number, inclusive. A value that isn't a number
+ *            fails them as the wrong type
+ *   pattern  an extended regular expression the whole value must match
+ *   allowed  "|"-separated values, one of which it must be exactly
+ *
+ * Types are worked out as for storage (see dm_classify_value()), so "007"
+ * is text. Dates are numbers in a workbook, so they are checked as numbers.
+ *
+ * They are stored with the datamap's lines and compiled into a DmRule per
+ * line when the datamap is loaded, patterns included, so checking a value
+ * as the sheet callback keeps it costs a classify and a few compares.
+ */
+
+static const struct {
+    const char *name;
+    uint32_t types;
+} type_names[] = {
+    {"text", 1u << DM_VALUE_TEXT},
+    {"integer", 1u << DM_VALUE_INTEGER},
+    {"real", 1u << DM_VALUE_REAL},
+    {"number", (1u << DM_VALUE_INTEGER) | (1u << DM_VALUE_REAL)},
+    {"boolean", 1u << DM_VALUE_BOOLEAN},
+};
+
+#define NTYPE_NAMES (sizeof(type_names) / sizeof(type_names[0]))
+
+static int parse_types(const char *s, uint32_t *types)
+{
+    *types = 0;
+    while (*s) {
+        size_t len = strcspn(s, "|");
+        size_t i;
+        for (i = 0; i < NTYPE_NAMES; i++) {
+            if (strlen(type_names[i].name) == len && strncasecmp(type_names[i].name, s, len) == 0)
+                break;
+        }
+        if (i == NTYPE_NAMES)
+            return 1;
+        *types |= type_names[i].types;
+        s += len;
+        if (*s == '|')
+            s++;
+    }
+    return 0;
+}
+
+static int parse_number(const char *s, double *n)
+{
+    char *end;
+    *n = strtod(s, &end);
+    return end == s || *end != '\0';
+}
+
+/* Fill in rule's type and bounds from a datamap line's columns, any of
+ * which may be NULL or empty. pattern and allowed are left to the caller.
+ * Returns 1 if one of them makes no sense. */
+extern int dm_rule_parse(const char *type, const char *min, const char *max, DmRule *rule)
+{
+    memset(rule, 0, sizeof(DmRule));
+    if (type && *type && parse_types(type, &rule->types))
+        return 1;
+    if (min && *min) {
+        if (parse_number(min, &rule->min))
+            return 1;
+        rule->flags |= DM_RULE_MIN;
+    }
+    if (max && *max) {
+        if (parse_number(max, &rule->max))
+            return 1;
+        rule->flags |= DM_RULE_MAX;
+    }
+    return 0;
+}
+
+// Compile pattern to match a whole value. Returns 0 on success.
+extern int dm_rule_compile(const char *pattern, regex_t *re)
+{
+    size_t len = strlen(pattern);
+    char *anchored = malloc(len + 5);
+
+    if (anchored == NULL)
+        return 1;
+    snprintf(anchored, len + 5, "^(%s)$", pattern);
+    int rc = regcomp(re, anchored, REG_EXTENDED | REG_NOSUB);
+    free(anchored);
+    return rc != 0;
+}
+
+static int allowed_contains(const char *allowed, const char *value)
+{
+    size_t len = strlen(value);
+
+    for (;;) {
+        size_t n = strcspn(allowed, "|");
+        if (n == len && strncmp(allowed, value, len) == 0)
+            return 1;
+        if (allowed[n] == '\0')
+            return 0;
+        allowed += n + 1;
+    }
+}
+
+// Does value keep to rule? Called from the sheet callback, so it doesn't allocate.
+extern DmCheck dm_rule_check(const DmRule *rule, const char *value)
+{
+    DmValue v;
+    DmValueType type = dm_classify_value(value, &v);
+
+    if (rule->types && !(rule->types & (1u << type)))
+        return DM_CHECK_TYPE;
+    if (rule->flags) {
+        double n;
+        if (type == DM_VALUE_INTEGER)
+            n = (double)v.i;
+        else if (type == DM_VALUE_REAL)
+            n = v.r;
+        else
+            return DM_CHECK_TYPE;
+        if ((rule->flags & DM_RULE_MIN) && n < rule->min)
+            return DM_CHECK_MIN;
+        if ((rule->flags & DM_RULE_MAX) && n > rule->max)
+            return DM_CHECK_MAX;
+    }
+    if (rule->allowed && !allowed_contains(rule->allowed, value))
+        return DM_CHECK_ALLOWED;
+    if (rule->regex && regexec(rule->regex, value, 0, NULL, 0) != 0)
+        return DM_CHECK_PATTERN;
+    return DM_CHECK_OK;
+}
+
+// What was wrong, for the report: "is not integer|real", "is above 100"
+extern void dm_rule_describe(const DmRule *rule, DmCheck why, char *buf, size_t size)
+{
+    size_t used = 0;
+
+    switch (why) {
+        case DM_CHECK_TYPE:
+            used = snprintf(buf, size, "is not ");
+            if (!rule->types) {
+                // only min or max, which want a number
+                snprintf(buf + used, size - used, "a number");
+                break;
+            }
+            const char *sep = "";
+            for (size_t i = 0; i < NTYPE_NAMES && used < size; i++) {
+                // "number" covers integer and real, so skip it
+                if (type_names[i].types & (type_names[i].types - 1))
+                    continue;
+                if (rule->types & type_names[i].types) {
+                    used += snprintf(buf + used, size - used, "%s%s", sep, type_names[i].name);
+                    sep = "|";
+                }
+            }
+            break;
+        case DM_CHECK_MIN:
+            snprintf(buf, size, "is below %g", rule->min);
+            break;
+        case DM_CHECK_MAX:
+            snprintf(buf, size, "is above %g", rule->max);
+            break;
+        case DM_CHECK_PATTERN:
+            snprintf(buf, size, "does not match %s", rule->pattern);
+            break;
+        case DM_CHECK_ALLOWED:
+            snprintf(buf, size, "is not one of %s", rule->allowed);
+            break;
+        default:
+            snprintf(buf, size, "is fine");
+    }
+}
+
+/* Compile the patterns of every rule in dm, which may have come from SQLite
+ * or from a cache image. Returns 0 on success, 1 if a pattern won't
+ * compile (the datamap import checks them, so only if it was edited). */
+extern int dm_datamap_compile_rules(DmDatamap *dm)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < dm->nrules; i++) {
+        if (dm->rules[i].pattern)
+            n++;
+    }
+    if (n == 0)
+        return 0;
+    if ((dm->regexes = calloc(n, sizeof(regex_t))) == NULL)
+        return 1;
+    for (size_t i = 0; i < dm->nrules; i++) {
+        DmRule *rule = &dm->rules[i];
+        if (rule->pattern == NULL)
+            continue;
+        if (dm_rule_compile(rule->pattern, &dm->regexes[dm->nregexes])) {
+            fprintf(stderr, "Bad pattern '%s' in datamap.\n", rule->pattern);
+            return 1;
+        }
+        rule->regex = &dm->regexes[dm->nregexes++];
+    }
+    return 0;
+}
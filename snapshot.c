@@ -0,0 +1,646 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "reader.h"
+
+/* -- Columnar snapshots -----------------------------
+ *
+ * The returns imported against a datamap (or one return, or one batch),
+ * written out as a flat file to be mapped and scanned in place rather than
+ * read out of SQLite a row at a time:
+ *
+ *   DmsHeader | DmSnapshotReturn[nreturns] | DmSnapshotKey[nkeys]
+ *             | a column for each key | string pool
+ *
+ * The returns are the file's return dictionary, in id order, and a return
+ * is the same slot r in every column. The keys are its key dictionary: every
+ * datamap line, or cell of a range line, that has a value in at least one
+ * of the returns, in datamap line order. A key's column is
+ *
+ *   - a null bitmap, a bit per return
+ *   - a DmSnapshotValue per return: the integer, real or boolean itself,
+ *     or the pool offset of the text. Each distinct text is in the pool
+ *     once, as it is in the value table.
+ *   - only if the key's values aren't all one type, a DmValueType byte per
+ *     return. Otherwise DmSnapshotKey.type says what they all are.
+ *
+ * Everything is 8-byte aligned and in the writer's byte order, which the
+ * header records. Opening a snapshot is an mmap and a check that the
+ * offsets stay inside the file; nothing is parsed or copied, so a scan of
+ * a column runs at the speed of memory. As with the datamap image, the file
+ * is written under a temporary name and renamed into place.
+ */
+
+#define DMS_MAGIC "DMAPSNAP"
+#define DMS_VERSION 1
+#define DMS_BYTE_ORDER 0x01020304u // reads back as something else with the other byte order
+
+typedef struct DmsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order;
+    uint32_t pad;
+    int64_t dm_id;
+    uint64_t nreturns;
+    uint64_t nkeys;
+    uint64_t returns_off;
+    uint64_t keys_off;
+    uint64_t pool_off;
+    uint64_t pool_size;
+    uint64_t file_size;
+} DmsHeader;
+
+struct snap_return {
+    int64_t id;
+    const char *file;
+};
+
+struct snap_key {
+    int64_t line;
+    uint32_t row, col;
+    const char *key;
+    uint32_t type;
+    uint64_t count;
+};
+
+struct snap_text {
+    int64_t id; // in the value table
+    const char *text;
+    uint64_t off;
+};
+
+// What goes in a snapshot, read from the database before any of it is laid out
+struct snap_build {
+    DmArena arena; // the strings
+    struct snap_return *returns;
+    size_t nreturns;
+    struct snap_key *keys;
+    size_t nkeys;
+    struct snap_text *texts;
+    size_t ntexts;
+};
+
+// The returns a snapshot has, when it has every one against the datamap
+static const char *all_returns_sql = "INSERT INTO temp.snapshot_return(id, file)"
+                                     "   SELECT id, file FROM return WHERE dm_id = ?";
+
+static const char *keys_sql = "SELECT d.datamap_line_id, d.range_row, d.range_col, l.key,"
+                              "       MIN(d.vtype), MAX(d.vtype), COUNT(*)"
+                              "  FROM temp.snapshot_return AS s"
+                              "  JOIN return_data AS d ON d.return_id = s.id"
+                              "  JOIN datamap_line AS l ON l.id = d.datamap_line_id"
+                              " GROUP BY d.datamap_line_id, d.range_row, d.range_col"
+                              " ORDER BY d.datamap_line_id, d.range_row, d.range_col";
+
+static const char *texts_sql = "SELECT id, text FROM value"
+                               " WHERE id IN (SELECT d.value_id FROM temp.snapshot_return AS s"
+                               "                JOIN return_data AS d ON d.return_id = s.id)"
+                               " ORDER BY id";
+
+static const char *values_sql = "SELECT d.return_id, d.datamap_line_id, d.range_row, d.range_col,"
+                                "       d.value, d.vtype, d.value_id"
+                                "  FROM temp.snapshot_return AS s"
+                                "  JOIN return_data AS d ON d.return_id = s.id";
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~(uint64_t)7;
+}
+
+// Room for one more in an array of count things of size bytes, with *cap of them
+static void *grow(void *array, size_t count, size_t *cap, size_t size)
+{
+    if (count < *cap)
+        return array;
+    size_t new_cap = *cap ? *cap * 2 : 64;
+    void *a = realloc(array, new_cap * size);
+    if (a)
+        *cap = new_cap;
+    return a;
+}
+
+/* Put the returns return_spec (a return id, a workbook, or the directory
+ * or bundle a batch came from) stands for, or every one against dm_id if it
+ * is NULL, in temp.snapshot_return. Returns 1 on error. */
+static int choose_returns(sqlite3 *db, int64_t dm_id, const char *return_spec)
+{
+    sqlite3_stmt *stmt;
+    DmReturnRefs refs;
+    int rc, err = 0;
+
+    if (return_spec == NULL) {
+        rc = sqlite3_prepare_v2(db, all_returns_sql, -1, &stmt, NULL);
+        dm_sql_check_error(rc, db);
+        sqlite3_bind_int64(stmt, 1, dm_id);
+        err = sqlite3_step(stmt) != SQLITE_DONE;
+        sqlite3_finalize(stmt);
+        return err;
+    }
+
+    if (dm_find_returns(db, dm_id, return_spec, 1, &refs))
+        return 1;
+    rc = sqlite3_prepare_v2(db, "INSERT INTO temp.snapshot_return(id, file) VALUES (?, ?)", -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    for (size_t i = 0; !err && i < refs.count; i++) {
+        sqlite3_bind_int64(stmt, 1, refs.refs[i].id);
+        sqlite3_bind_text(stmt, 2, refs.refs[i].file, -1, SQLITE_STATIC);
+        err = sqlite3_step(stmt) != SQLITE_DONE;
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    dm_free_return_refs(&refs);
+    return err;
+}
+
+// Read everything a snapshot needs but the values. Returns 1 on error.
+static int read_dictionaries(sqlite3 *db, struct snap_build *b)
+{
+    sqlite3_stmt *stmt;
+    size_t cap = 0;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, "SELECT id, file FROM temp.snapshot_return ORDER BY id", -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct snap_return *r = grow(b->returns, b->nreturns, &cap, sizeof(struct snap_return));
+        if (r == NULL)
+            break;
+        b->returns = r;
+        r[b->nreturns].id = sqlite3_column_int64(stmt, 0);
+        r[b->nreturns].file = dm_arena_strdup(&b->arena, (const char *)sqlite3_column_text(stmt, 1));
+        if (r[b->nreturns++].file == NULL)
+            break;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+        return 1;
+
+    cap = 0;
+    rc = sqlite3_prepare_v2(db, keys_sql, -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct snap_key *k = grow(b->keys, b->nkeys, &cap, sizeof(struct snap_key));
+        if (k == NULL)
+            break;
+        b->keys = k;
+        k += b->nkeys;
+        k->line = sqlite3_column_int64(stmt, 0);
+        k->row = (uint32_t)sqlite3_column_int64(stmt, 1);
+        k->col = (uint32_t)sqlite3_column_int64(stmt, 2);
+        k->key = dm_arena_strdup(&b->arena, (const char *)sqlite3_column_text(stmt, 3));
+        int min_type = sqlite3_column_int(stmt, 4), max_type = sqlite3_column_int(stmt, 5);
+        k->type = min_type == max_type ? (uint32_t)min_type : DM_SNAPSHOT_MIXED;
+        k->count = (uint64_t)sqlite3_column_int64(stmt, 6);
+        if (k->key == NULL)
+            break;
+        b->nkeys++;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+        return 1;
+
+    cap = 0;
+    rc = sqlite3_prepare_v2(db, texts_sql, -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct snap_text *t = grow(b->texts, b->ntexts, &cap, sizeof(struct snap_text));
+        if (t == NULL)
+            break;
+        b->texts = t;
+        t[b->ntexts].id = sqlite3_column_int64(stmt, 0);
+        t[b->ntexts].text = dm_arena_strdup(&b->arena, (const char *)sqlite3_column_text(stmt, 1));
+        if (t[b->ntexts++].text == NULL)
+            break;
+    }
+    sqlite3_finalize(stmt);
+    return rc != SQLITE_DONE;
+}
+
+static int compare_return_id(const void *id, const void *r)
+{
+    int64_t a = *(const int64_t *)id, b = ((const struct snap_return *)r)->id;
+    return a < b ? -1 : a > b;
+}
+
+static int compare_text_id(const void *id, const void *t)
+{
+    int64_t a = *(const int64_t *)id, b = ((const struct snap_text *)t)->id;
+    return a < b ? -1 : a > b;
+}
+
+// Keys are looked up by (line, row, col), which is the order they are in
+static int compare_key(const void *want, const void *k)
+{
+    const struct snap_key *a = want, *b = k;
+    if (a->line != b->line)
+        return a->line < b->line ? -1 : 1;
+    if (a->row != b->row)
+        return a->row < b->row ? -1 : 1;
+    return a->col < b->col ? -1 : a->col > b->col;
+}
+
+static uint64_t pool_add(char *pool, uint64_t *used, const char *s)
+{
+    uint64_t off = *used;
+    size_t len = strlen(s) + 1;
+    memcpy(pool + off, s, len);
+    *used += len;
+    return off;
+}
+
+/* Lay b out as a snapshot image, with the values from stmt put in their
+ * columns. *image is the caller's to free. Returns 1 on error. */
+static int build_image(sqlite3_stmt *stmt, int64_t dm_id, struct snap_build *b, char **image, uint64_t *size)
+{
+    DmsHeader hdr;
+    uint64_t words = (b->nreturns + 63) / 64, pool_size = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DMS_MAGIC, 8);
+    hdr.version = DMS_VERSION;
+    hdr.header_size = sizeof(DmsHeader);
+    hdr.byte_order = DMS_BYTE_ORDER;
+    hdr.dm_id = dm_id;
+    hdr.nreturns = b->nreturns;
+    hdr.nkeys = b->nkeys;
+    hdr.returns_off = align8(sizeof(DmsHeader));
+    hdr.keys_off = align8(hdr.returns_off + b->nreturns * sizeof(DmSnapshotReturn));
+
+    // each key's column is its bitmap, its values and maybe its types, together
+    uint64_t off = align8(hdr.keys_off + b->nkeys * sizeof(DmSnapshotKey));
+    for (size_t i = 0; i < b->nkeys; i++) {
+        off += words * 8 + b->nreturns * sizeof(DmSnapshotValue);
+        if (b->keys[i].type == DM_SNAPSHOT_MIXED)
+            off += align8(b->nreturns);
+        pool_size += strlen(b->keys[i].key) + 1;
+    }
+    for (size_t i = 0; i < b->nreturns; i++)
+        pool_size += strlen(b->returns[i].file) + 1;
+    for (size_t i = 0; i < b->ntexts; i++)
+        pool_size += strlen(b->texts[i].text) + 1;
+    hdr.pool_off = off;
+    hdr.pool_size = pool_size;
+    hdr.file_size = hdr.pool_off + pool_size;
+
+    char *img = calloc(1, hdr.file_size);
+    if (img == NULL)
+        return 1;
+    *image = img;
+    *size = hdr.file_size;
+    memcpy(img, &hdr, sizeof(hdr));
+
+    DmSnapshotReturn *returns = (DmSnapshotReturn *)(img + hdr.returns_off);
+    DmSnapshotKey *keys = (DmSnapshotKey *)(img + hdr.keys_off);
+    char *pool = img + hdr.pool_off;
+    uint64_t pool_used = 0;
+
+    for (size_t i = 0; i < b->nreturns; i++) {
+        returns[i].id = b->returns[i].id;
+        returns[i].file_off = pool_add(pool, &pool_used, b->returns[i].file);
+    }
+    off = align8(hdr.keys_off + b->nkeys * sizeof(DmSnapshotKey));
+    for (size_t i = 0; i < b->nkeys; i++) {
+        keys[i].key_off = pool_add(pool, &pool_used, b->keys[i].key);
+        keys[i].line_id = b->keys[i].line;
+        keys[i].range_row = b->keys[i].row;
+        keys[i].range_col = b->keys[i].col;
+        keys[i].type = b->keys[i].type;
+        keys[i].count = b->keys[i].count;
+        keys[i].present_off = off;
+        keys[i].values_off = off + words * 8;
+        off = keys[i].values_off + b->nreturns * sizeof(DmSnapshotValue);
+        if (b->keys[i].type == DM_SNAPSHOT_MIXED) {
+            keys[i].types_off = off;
+            off += align8(b->nreturns);
+        }
+    }
+    for (size_t i = 0; i < b->ntexts; i++)
+        b->texts[i].off = pool_add(pool, &pool_used, b->texts[i].text);
+
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int64_t return_id = sqlite3_column_int64(stmt, 0);
+        struct snap_key want = {sqlite3_column_int64(stmt, 1), (uint32_t)sqlite3_column_int64(stmt, 2),
+                                (uint32_t)sqlite3_column_int64(stmt, 3)};
+        const struct snap_return *r = bsearch(&return_id, b->returns, b->nreturns, sizeof(struct snap_return),
+                                              compare_return_id);
+        const struct snap_key *k = bsearch(&want, b->keys, b->nkeys, sizeof(struct snap_key), compare_key);
+        if (r == NULL || k == NULL)
+            continue; // imported since the dictionaries were read; can't happen in one transaction
+        size_t slot = r - b->returns;
+        const DmSnapshotKey *key = &keys[k - b->keys];
+        DmSnapshotValue *v = (DmSnapshotValue *)(img + key->values_off) + slot;
+        int vtype = sqlite3_column_int(stmt, 5);
+
+        if (vtype == DM_VALUE_REAL) {
+            v->r = sqlite3_column_double(stmt, 4);
+        } else if (vtype == DM_VALUE_TEXT) {
+            int64_t value_id = sqlite3_column_int64(stmt, 6);
+            const struct snap_text *t = bsearch(&value_id, b->texts, b->ntexts, sizeof(struct snap_text),
+                                                compare_text_id);
+            if (t == NULL)
+                continue;
+            v->text_off = t->off;
+        } else {
+            v->i = sqlite3_column_int64(stmt, 4);
+        }
+        ((uint64_t *)(img + key->present_off))[slot / 64] |= (uint64_t)1 << (slot % 64);
+        if (key->types_off)
+            ((uint8_t *)(img + key->types_off))[slot] = (uint8_t)vtype;
+    }
+    return rc != SQLITE_DONE;
+}
+
+static int write_file(const char *path, const char *image, uint64_t size)
+{
+    char tmp[4096];
+
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+    FILE *f = fopen(tmp, "wb");
+    int failed = f == NULL || fwrite(image, 1, size, f) != size;
+    if (f && fclose(f) != 0)
+        failed = 1;
+    if (failed || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/* Snapshot the returns imported against datamap dm_name, or only those
+ * return_spec stands for if it isn't NULL, to the file at path.
+ * Returns 0 on success. */
+extern int dm_snapshot_write(char *dm_name, const char *return_spec, const char *path)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    struct snap_build b;
+    int64_t dm_id = 0;
+    char *image = NULL;
+    uint64_t size = 0;
+    int err = 0;
+
+    int rc = sqlite3_open("test.db", &db);
+    dm_sql_check_error(rc, db);
+    if (dm_upgrade_return_data(db) || dm_exec_sql_stmt(dm_sql_str_create_table_return, db) != SQLITE_OK) {
+        sqlite3_close(db);
+        return 1;
+    }
+
+    rc = sqlite3_prepare_v2(db, "SELECT MAX(id) FROM datamap WHERE name = ?", -1, &stmt, NULL);
+    dm_sql_check_error(rc, db);
+    sqlite3_bind_text(stmt, 1, dm_name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        dm_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (dm_id == 0) {
+        fprintf(stderr, "No datamap called '%s' found in the database.\n", dm_name);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    // one read transaction, so the dictionaries and the values agree
+    memset(&b, 0, sizeof(b));
+    dm_exec_sql_stmt("BEGIN TRANSACTION;"
+                     "CREATE TEMP TABLE snapshot_return(id INTEGER PRIMARY KEY, file TEXT NOT NULL);", db);
+    if ((err = choose_returns(db, dm_id, return_spec) || read_dictionaries(db, &b)))
+        fprintf(stderr, "Unable to read the returns: %s\n", sqlite3_errmsg(db));
+    if (!err && b.nreturns == 0) {
+        fprintf(stderr, "No returns for %s found against this datamap.\n", return_spec ? return_spec : dm_name);
+        err = 1;
+    }
+    if (!err) {
+        rc = sqlite3_prepare_v2(db, values_sql, -1, &stmt, NULL);
+        dm_sql_check_error(rc, db);
+        if ((err = build_image(stmt, dm_id, &b, &image, &size)))
+            fprintf(stderr, "Unable to read the values: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+    }
+    dm_exec_sql_stmt("COMMIT;", db);
+    sqlite3_close(db);
+
+    if (!err && write_file(path, image, size)) {
+        fprintf(stderr, "Cannot write to %s\n", path);
+        err = 1;
+    }
+    if (!err)
+        printf("Wrote %zu keys across %zu returns to %s.\n", b.nkeys, b.nreturns, path);
+    free(image);
+    free(b.returns);
+    free(b.keys);
+    free(b.texts);
+    dm_arena_free(&b.arena);
+    return err;
+}
+
+// Does a section of n things of size bytes at off fit between from and to?
+static int fits(uint64_t off, uint64_t n, uint64_t size, uint64_t from, uint64_t to)
+{
+    return off >= from && off <= to && n <= (to - off) / size;
+}
+
+/* Map the snapshot at path into snap. Everything is checked to be inside
+ * the file, so the columns can be read without further checks; strings
+ * should be got with dm_snapshot_string(). Returns 0 on success. */
+extern int dm_snapshot_open(const char *path, DmSnapshot *snap)
+{
+    struct stat st;
+
+    memset(snap, 0, sizeof(DmSnapshot));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DmsHeader)) {
+        fprintf(stderr, "%s is not a snapshot.\n", path);
+        close(fd);
+        return 1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        return 1;
+    }
+
+    const DmsHeader *hdr = (const DmsHeader *)map;
+    uint64_t size = st.st_size;
+    if (memcmp(hdr->magic, DMS_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a snapshot.\n", path);
+        munmap(map, size);
+        return 1;
+    }
+    if (hdr->version != DMS_VERSION || hdr->header_size != sizeof(DmsHeader) || hdr->byte_order != DMS_BYTE_ORDER) {
+        fprintf(stderr, "%s is a snapshot this version of datamaps can't read.\n", path);
+        munmap(map, size);
+        return 1;
+    }
+
+    int ok = hdr->file_size == size
+             && hdr->pool_off <= size && hdr->pool_size == size - hdr->pool_off
+             && (hdr->pool_size == 0 || map[size - 1] == '\0')
+             && fits(hdr->returns_off, hdr->nreturns, sizeof(DmSnapshotReturn), sizeof(DmsHeader), hdr->pool_off)
+             && fits(hdr->keys_off, hdr->nkeys, sizeof(DmSnapshotKey), sizeof(DmsHeader), hdr->pool_off)
+             && hdr->returns_off % 8 == 0 && hdr->keys_off % 8 == 0;
+    const DmSnapshotKey *keys = (const DmSnapshotKey *)(map + hdr->keys_off);
+    uint64_t words = (hdr->nreturns + 63) / 64;
+    for (uint64_t i = 0; ok && i < hdr->nkeys; i++) {
+        const DmSnapshotKey *k = &keys[i];
+        ok = k->present_off % 8 == 0 && k->values_off % 8 == 0
+             && fits(k->present_off, words, 8, sizeof(DmsHeader), hdr->pool_off)
+             && fits(k->values_off, hdr->nreturns, sizeof(DmSnapshotValue), sizeof(DmsHeader), hdr->pool_off)
+             && (k->type != DM_SNAPSHOT_MIXED || fits(k->types_off, hdr->nreturns, 1, sizeof(DmsHeader), hdr->pool_off));
+    }
+    if (!ok) {
+        fprintf(stderr, "%s is damaged.\n", path);
+        munmap(map, size);
+        return 1;
+    }
+
+    snap->map = map;
+    snap->size = size;
+    snap->dm_id = hdr->dm_id;
+    snap->nreturns = hdr->nreturns;
+    snap->nkeys = hdr->nkeys;
+    snap->returns = (const DmSnapshotReturn *)(map + hdr->returns_off);
+    snap->keys = keys;
+    snap->pool = map + hdr->pool_off;
+    snap->pool_size = hdr->pool_size;
+    return 0;
+}
+
+extern void dm_snapshot_close(DmSnapshot *snap)
+{
+    if (snap->map)
+        munmap((void *)snap->map, snap->size);
+    memset(snap, 0, sizeof(DmSnapshot));
+}
+
+// The string at off in the pool, or "" if off is outside it
+extern const char *dm_snapshot_string(const DmSnapshot *snap, uint64_t off)
+{
+    return off < snap->pool_size ? snap->pool + off : "";
+}
+
+static const char *type_name(uint32_t type)
+{
+    switch (type) {
+        case DM_VALUE_TEXT: return "text";
+        case DM_VALUE_INTEGER: return "integer";
+        case DM_VALUE_REAL: return "real";
+        case DM_VALUE_BOOLEAN: return "boolean";
+        default: return "mixed";
+    }
+}
+
+struct column_sum {
+    size_t numbers;
+    double sum, min, max;
+};
+
+static void add_number(struct column_sum *s, double n)
+{
+    if (s->numbers == 0 || n < s->min)
+        s->min = n;
+    if (s->numbers == 0 || n > s->max)
+        s->max = n;
+    s->sum += n;
+    s->numbers++;
+}
+
+// Add up the numbers in key's column, a bitmap word at a time
+static void scan_column(const DmSnapshot *snap, const DmSnapshotKey *key, struct column_sum *s)
+{
+    const uint64_t *present = (const uint64_t *)(snap->map + key->present_off);
+    const DmSnapshotValue *values = (const DmSnapshotValue *)(snap->map + key->values_off);
+    const uint8_t *types = key->type == DM_SNAPSHOT_MIXED ? (const uint8_t *)(snap->map + key->types_off) : NULL;
+
+    memset(s, 0, sizeof(struct column_sum));
+    if (key->type != DM_VALUE_INTEGER && key->type != DM_VALUE_REAL && types == NULL)
+        return;
+    for (size_t w = 0; w * 64 < snap->nreturns; w++) {
+        uint64_t bits = present[w];
+        for (size_t r = w * 64; bits; r++, bits >>= 1) {
+            if (!(bits & 1))
+                continue;
+            uint32_t type = types ? types[r] : key->type;
+            if (type == DM_VALUE_INTEGER)
+                add_number(s, (double)values[r].i);
+            else if (type == DM_VALUE_REAL)
+                add_number(s, values[r].r);
+        }
+    }
+}
+
+/* Map the snapshot at path and write a line per key to output_file ("-"
+ * for standard output) as CSV:
+ *
+ *   key,type,count,sum,min,max
+ *
+ * with the sum, smallest and largest of its numbers, where it has any.
+ * Unless quiet, how long the scan took goes to standard error. */
+extern int dm_snapshot_summary(const char *path, const char *output_file, int quiet)
+{
+    DmSnapshot snap;
+    int to_stdout = strcmp(output_file, "-") == 0;
+    double t = dm_now();
+
+    if (dm_snapshot_open(path, &snap))
+        return 1;
+    double opened = dm_now() - t;
+
+    FILE *f = to_stdout ? stdout : fopen(output_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write to %s\n", output_file);
+        dm_snapshot_close(&snap);
+        return 1;
+    }
+
+    // every column first, so the time is the scan's alone
+    struct column_sum *sums = calloc(snap.nkeys ? snap.nkeys : 1, sizeof(struct column_sum));
+    if (sums == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        if (!to_stdout)
+            fclose(f);
+        dm_snapshot_close(&snap);
+        return 1;
+    }
+    t = dm_now();
+    for (size_t i = 0; i < snap.nkeys; i++)
+        scan_column(&snap, &snap.keys[i], &sums[i]);
+    double scan_time = dm_now() - t;
+
+    fputs("key,type,count,sum,min,max\n", f);
+    for (size_t i = 0; i < snap.nkeys; i++) {
+        const DmSnapshotKey *key = &snap.keys[i];
+        const char *name = dm_snapshot_string(&snap, key->key_off);
+
+        if (key->range_row) {
+            char *label = sqlite3_mprintf("%s[%u,%u]", name, key->range_row, key->range_col);
+            dm_csv_field(f, label ? label : name);
+            sqlite3_free(label);
+        } else {
+            dm_csv_field(f, name);
+        }
+        fprintf(f, ",%s,%llu", type_name(key->type), (unsigned long long)key->count);
+        if (sums[i].numbers)
+            fprintf(f, ",%.15g,%.15g,%.15g\n", sums[i].sum, sums[i].min, sums[i].max);
+        else
+            fputs(",,,\n", f);
+    }
+    free(sums);
+
+    int err = 0;
+    if (!to_stdout)
+        err = fclose(f) != 0;
+    else
+        fflush(stdout);
+    if (!quiet)
+        fprintf(stderr, "%zu keys across %zu returns: mapped in %.3f ms, scanned in %.3f ms.\n",
+                snap.nkeys, snap.nreturns, opened * 1000, scan_time * 1000);
+    dm_snapshot_close(&snap);
+    return err;
+}
@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "reader.h"
+
+/* -- Watching a drop directory -----------------------------
+ *
+ * `datamaps watch DIR` stays running and imports workbooks as they land in
+ * DIR. The database connection, the writer's prepared statements and the
+ * datamap are set up once, so a new return costs only its own extraction
+ * and insert.
+ *
+ * inotify tells us when a file in DIR is closed after writing or moved
+ * into it. Some tools write a workbook in several goes, so a file is only
+ * read once DM_WATCH_SETTLE_MS have passed without another event for it. A
+ * workbook that still won't open (a zip with no central directory yet) is
+ * tried again after another settle period, up to DM_WATCH_RETRIES times.
+ *
+ * Everything that is due when we wake up is written in one transaction.
+ * SIGINT or SIGTERM stops the watch: whatever is still pending is read
+ * straight away and committed before we exit.
+ *
+ * If the datamap is re-imported while a watch is running, restart the
+ * watch to pick it up.
+ */
+
+struct pending {
+    char *path;
+    double due; // dm_now() after which it is read
+    int attempts;
+};
+
+struct watch {
+    sqlite3 *db;
+    DmDatamapSet set;
+    DmWriter writer;
+    sqlite3_stmt *stored_hash;
+    const DmImportOptions *opts;
+    DmStats stats;
+    struct pending *pending;
+    size_t npending;
+    size_t size;
+    size_t imported;
+    size_t failed;
+};
+
+static volatile sig_atomic_t stop_watching = 0;
+
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    stop_watching = 1;
+}
+
+// Note that path was written to, pushing back when it is due
+static int watch_pending_add(struct watch *w, const char *path)
+{
+    double due = dm_now() + DM_WATCH_SETTLE_MS / 1000.0;
+
+    for (size_t i = 0; i < w->npending; i++) {
+        if (strcmp(w->pending[i].path, path) == 0) {
+            w->pending[i].due = due;
+            w->pending[i].attempts = 0;
+            return 0;
+        }
+    }
+    if (w->npending == w->size) {
+        size_t size = w->size ? w->size * 2 : 16;
+        struct pending *p = realloc(w->pending, size * sizeof(struct pending));
+        if (p == NULL)
+            return 1;
+        w->pending = p;
+        w->size = size;
+    }
+    if ((w->pending[w->npending].path = strdup(path)) == NULL)
+        return 1;
+    w->pending[w->npending].due = due;
+    w->pending[w->npending].attempts = 0;
+    w->npending++;
+    return 0;
+}
+
+static void watch_pending_remove(struct watch *w, size_t i)
+{
+    free(w->pending[i].path);
+    w->pending[i] = w->pending[--w->npending];
+}
+
+// Was path already imported against every datamap with this hash?
+static int watch_unchanged(struct watch *w, const char *path, uint64_t hash)
+{
+    sqlite3_stmt *stmt = w->stored_hash;
+    int unchanged = 1;
+
+    for (size_t d = 0; unchanged && d < w->set.ndms; d++) {
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, w->set.dms[d].id);
+        unchanged = sqlite3_step(stmt) == SQLITE_ROW
+                    && sqlite3_column_type(stmt, 0) != SQLITE_NULL
+                    && (uint64_t)sqlite3_column_int64(stmt, 0) == hash;
+        sqlite3_reset(stmt);
+    }
+    return unchanged;
+}
+
+/* Try to import pending[i]. Returns 1 if it is finished with, one way or
+ * the other, and 0 if it should stay pending for another go. */
+static int watch_import_one(struct watch *w, size_t i)
+{
+    struct pending *p = &w->pending[i];
+    DmReturn ret;
+    uint64_t hash;
+    size_t size = 0;
+    double t = dm_now();
+
+    // gone again (a temporary file, or moved on) - nothing to do
+    if (dm_hash_file(p->path, &hash, &size))
+        return 1;
+    w->stats.hash_time += dm_now() - t;
+    if (!w->opts->force && watch_unchanged(w, p->path, hash)) {
+        if (!w->opts->quiet)
+            printf("Unchanged %s\n", p->path);
+        return 1;
+    }
+
+    if (dm_extract_workbook_parallel(w->set.extract, p->path, &ret, w->opts->sheet_threads)) {
+        if (++p->attempts < DM_WATCH_RETRIES && !stop_watching) {
+            // probably still being written
+            p->due = dm_now() + DM_WATCH_SETTLE_MS / 1000.0;
+            dm_return_free(&ret);
+            return 0;
+        }
+        fprintf(stderr, "Failed to import %s: %s\n", p->path, ret.error);
+        w->failed++;
+        dm_return_free(&ret);
+        return 1;
+    }
+    ret.hash = hash;
+    ret.stats.bytes_read = size;
+    ret.stats.workbooks = 1;
+    dm_stats_add(&w->stats, &ret.stats);
+
+    size_t rows;
+    t = dm_now();
+    int err = dm_writer_store_set(&w->writer, &w->set, &ret, &rows);
+    w->stats.store_time += dm_now() - t;
+    if (err) {
+        fprintf(stderr, "Failed to store %s\n", p->path);
+        w->failed++;
+    } else {
+        if (!w->opts->quiet)
+            printf("Imported %s (%zu values)\n", p->path, ret.nmatched);
+        w->imported++;
+        w->stats.rows_inserted += rows;
+    }
+    dm_return_free(&ret);
+    return 1;
+}
+
+/* Import everything that is due, or everything pending if all is set, in
+ * one transaction. */
+static void watch_flush(struct watch *w, int all)
+{
+    double now = dm_now();
+    int begun = 0;
+
+    for (size_t i = 0; i < w->npending; ) {
+        if (!all && w->pending[i].due > now) {
+            i++;
+            continue;
+        }
+        if (!begun) {
+            dm_exec_sql_stmt("BEGIN TRANSACTION;", w->db);
+            begun = 1;
+        }
+        if (watch_import_one(w, i))
+            watch_pending_remove(w, i);
+        else
+            i++;
+    }
+    if (begun) {
+        double t = dm_now();
+        dm_exec_sql_stmt("COMMIT;", w->db);
+        w->stats.commit_time += dm_now() - t;
+        w->stats.commits++;
+        fflush(stdout);
+    }
+}
+
+// Milliseconds until the next pending workbook is due, -1 if none are
+static int watch_timeout(const struct watch *w)
+{
+    double next = 0;
+
+    if (w->npending == 0)
+        return -1;
+    for (size_t i = 0; i < w->npending; i++) {
+        if (i == 0 || w->pending[i].due < next)
+            next = w->pending[i].due;
+    }
+    double ms = (next - dm_now()) * 1000.0;
+    return ms <= 0 ? 0 : (int)ms + 1;
+}
+
+// Queue whatever inotify has told us about. Returns 1 on a read error.
+static int watch_read_events(struct watch *w, int fd, const char *dir)
+{
+    // aligned for the events read into it
+    union {
+        struct inotify_event event;
+        char bytes[4096];
+    } u;
+    char *buf = u.bytes;
+
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof(u.bytes));
+        if (len < 0)
+            return errno != EAGAIN && errno != EINTR;
+        if (len == 0)
+            return 0;
+        for (char *ptr = buf; ptr < buf + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                fprintf(stderr, "Missed some events in %s; restart the watch to pick them up.\n", dir);
+                continue;
+            }
+            if (event->len == 0 || !dm_is_workbook_name(event->name))
+                continue;
+
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+            if (watch_pending_add(w, path))
+                fprintf(stderr, "Out of memory; not importing %s\n", path);
+        }
+    }
+}
+
+/* Watch dir for workbooks and import each against dm_names as it lands,
+ * until SIGINT or SIGTERM. Workbooks already in dir are imported first, if
+ * they have changed since they were last imported.
+ *
+ * Returns 0 on a clean shutdown, 1 if the watch could not be set up or any
+ * workbook failed to import. */
+extern int dm_watch(const char *dir, char **dm_names, size_t ndm_names, const DmImportOptions *opts)
+{
+    struct watch w;
+    char *resolved;
+    int fd, rc, result = 0;
+    double start = dm_now(), t;
+
+    memset(&w, 0, sizeof(struct watch));
+    w.opts = opts;
+
+    // store paths the way a batch import does, so the two agree
+    if ((resolved = realpath(dir, NULL)) == NULL) {
+        fprintf(stderr, "Cannot watch %s\n", dir);
+        return 1;
+    }
+
+    rc = sqlite3_open("test.db", &w.db);
+    dm_sql_check_error(rc, w.db);
+    dm_exec_sql_stmt("PRAGMA foreign_keys = ON;", w.db);
+
+    t = dm_now();
+    if (dm_load_datamap_set(w.db, dm_names, ndm_names, &w.set)) {
+        sqlite3_close(w.db);
+        free(resolved);
+        return 1;
+    }
+    w.stats.datamap_time = dm_now() - t;
+    if (dm_writer_open(&w.writer, w.db)) {
+        dm_datamap_set_free(&w.set);
+        sqlite3_close(w.db);
+        free(resolved);
+        return 1;
+    }
+    rc = sqlite3_prepare_v2(w.db, "SELECT hash FROM return WHERE file = ? AND dm_id = ?",
+                            -1, &w.stored_hash, NULL);
+    dm_sql_check_error(rc, w.db);
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, resolved, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Cannot watch %s: %s\n", resolved, strerror(errno));
+        result = 1;
+        goto done;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // catch up on anything that arrived while we weren't watching
+    char **paths;
+    size_t npaths;
+    if (dm_expand_paths(resolved, &paths, &npaths) == 0) {
+        for (size_t i = 0; i < npaths; i++)
+            watch_pending_add(&w, paths[i]);
+        dm_free_paths(paths, npaths);
+        watch_flush(&w, 1);
+    }
+
+    if (!opts->quiet) {
+        if (ndm_names == 1)
+            printf("Watching %s for returns against '%s'. Ctrl-C to stop.\n", resolved, dm_names[0]);
+        else
+            printf("Watching %s for returns against %zu datamaps. Ctrl-C to stop.\n", resolved, ndm_names);
+        fflush(stdout);
+    }
+
+    while (!stop_watching) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int n = poll(&pfd, 1, watch_timeout(&w));
+
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "Watch failed: %s\n", strerror(errno));
+            result = 1;
+            break;
+        }
+        if (n > 0 && watch_read_events(&w, fd, resolved)) {
+            fprintf(stderr, "Watch failed: %s\n", strerror(errno));
+            result = 1;
+            break;
+        }
+        watch_flush(&w, 0);
+    }
+
+    // shutting down: don't leave anything we've heard about behind
+    watch_flush(&w, 1);
+    if (!opts->quiet)
+        printf("Stopped watching %s. Imported %zu workbooks (%zu failed).\n", resolved, w.imported, w.failed);
+
+done:
+    if (fd >= 0)
+        close(fd);
+    for (size_t i = 0; i < w.npending; i++)
+        free(w.pending[i].path);
+    free(w.pending);
+    w.stats.wall_time = dm_now() - start;
+    if (opts->stats)
+        *opts->stats = w.stats;
+    sqlite3_finalize(w.stored_hash);
+    dm_writer_close(&w.writer);
+    dm_datamap_set_free(&w.set);
+    sqlite3_close(w.db);
+    free(resolved);
+    return result || w.failed > 0;
+}